@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <sys/socket.h>
+
+#include "client.hpp"
+#include "quoted_printable.hpp"
+
+namespace wandbox {
+	namespace {
+		typedef std::chrono::steady_clock steady;
+
+		struct outcome {
+			double latency;
+			double first_output;
+			std::size_t output_bytes;
+			std::string error;
+		};
+
+		struct load {
+			std::string host;
+			std::string port;
+			int timeout;
+			std::string compiler;
+			std::string request;
+		};
+
+		// printable filler, so that the size on the wire does not depend on quoted-printable escapes
+		std::string filler(std::size_t n) {
+			std::string s(n, 'x');
+			for (std::size_t i = 79; i < n; i += 80) s[i] = '\n';
+			return s;
+		}
+
+		std::string make_request(const std::string &compiler, std::size_t source_size, std::size_t stdin_size, const std::vector<std::string> &runtime_options) {
+			std::string r = make_frame("Control", "compiler=" + compiler);
+			r += make_frame("Source", filler(source_size));
+			if (stdin_size != 0) r += make_frame("StdIn", filler(stdin_size));
+			std::string raw;
+			for (const auto &o: runtime_options) raw += o + "\n";
+			if (!raw.empty()) r += make_frame("RuntimeOptionRaw", raw);
+			r += make_frame("Control", "run");
+			return r;
+		}
+
+		outcome run_one(const load &l) {
+			outcome o = { 0, 0, 0, {} };
+			const auto begin = steady::now();
+			const auto ms = [&] { return std::chrono::duration<double, std::milli>(steady::now() - begin).count(); };
+			try {
+				const auto fd = connect_to(l.host, l.port, l.timeout);
+				o.error = send_all(fd.get(), l.request);
+				if (!o.error.empty()) return o;
+				std::string received;
+				std::size_t pos = 0;
+				std::string command, data;
+				char buf[65536];
+				while (true) {
+					while (next_frame(received, pos, command, data)) {
+						if (command == "StdOut" || command == "StdErr") {
+							if (o.output_bytes == 0) o.first_output = ms();
+							o.output_bytes += quoted_printable::decode(data).size();
+						} else if (command == "ExitCode" && quoted_printable::decode(data) != "0") {
+							o.error = "exit " + quoted_printable::decode(data);
+						} else if (command == "Signal") {
+							o.error = "signal " + quoted_printable::decode(data);
+						} else if (command == "Control" && data == "Finish") {
+							o.latency = ms();
+							return o;
+						}
+					}
+					if (pos > 65536) {
+						received.erase(0, pos);
+						pos = 0;
+					}
+					const auto r = ::recv(fd.get(), buf, sizeof(buf), 0);
+					if (r == -1 && errno == EINTR) continue;
+					if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) { o.error = "timed out"; return o; }
+					if (r == -1) { o.error = std::string("recv: ") + std::strerror(errno); return o; }
+					if (r == 0) { o.error = "connection closed before Finish"; return o; }
+					received.append(buf, r);
+				}
+			} catch (std::exception &e) {
+				o.error = std::string("connect: ") + e.what();
+				return o;
+			}
+		}
+
+		std::string json_string(const std::string &s) {
+			std::string r = "\"";
+			for (const char c: s) {
+				if (c == '"' || c == '\\') {
+					r += '\\';
+					r += c;
+				} else if (static_cast<unsigned char>(c) < 0x20) {
+					char esc[8];
+					std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+					r += esc;
+				} else {
+					r += c;
+				}
+			}
+			return r + "\"";
+		}
+
+		std::string json_percentiles(std::vector<double> v) {
+			if (v.empty()) return "null";
+			std::sort(v.begin(), v.end());
+			const auto at = [&](double p) { return v[std::min(static_cast<std::size_t>(p / 100 * (v.size() - 1) + 0.5), v.size() - 1)]; };
+			double sum = 0;
+			for (const auto x: v) sum += x;
+			char buf[256];
+			std::snprintf(buf, sizeof(buf), "{\"min\":%.3f,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}", v.front(), sum / v.size(), at(50), at(90), at(99), v.back());
+			return buf;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	using namespace wandbox;
+	namespace po = boost::program_options;
+
+	load l;
+	l.host = "127.0.0.1";
+	l.port = "2012";
+	l.timeout = 120;
+	l.compiler = "echo";
+	int concurrency = 16;
+	int requests = 1000;
+	int warmup = 0;
+	std::size_t source_size = 64;
+	std::size_t stdin_size = 0;
+	std::size_t output_size = 0;
+	std::vector<std::string> runtime_options;
+	std::string label;
+	{
+		po::options_description opt("options");
+		opt.add_options()
+			("help,h", "show this help")
+			("host", po::value<std::string>(&l.host), "cattleshed host (default: 127.0.0.1)")
+			("port,p", po::value<std::string>(&l.port), "cattleshed port (default: 2012)")
+			("timeout,t", po::value<int>(&l.timeout), "seconds to wait for a reply (default: 120)")
+			("compiler,c", po::value<std::string>(&l.compiler), "compiler to run (default: echo)")
+			("concurrency,j", po::value<int>(&concurrency), "requests in flight (default: 16)")
+			("requests,n", po::value<int>(&requests), "requests to measure (default: 1000)")
+			("warmup,w", po::value<int>(&warmup), "requests to send before measuring (default: 0)")
+			("source-size", po::value<std::size_t>(&source_size), "octets of Source (default: 64)")
+			("stdin-size", po::value<std::size_t>(&stdin_size), "octets of StdIn (default: 0)")
+			("output-size", po::value<std::size_t>(&output_size), "octets of output asked of the yes stub, sent as RuntimeOptionRaw (default: 0)")
+			("runtime-option,r", po::value<std::vector<std::string>>(&runtime_options), "line of RuntimeOptionRaw, e.g. seconds for the sleep stub")
+			("label,l", po::value<std::string>(&label), "name of this run in the output")
+		;
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, opt), vm);
+		po::notify(vm);
+
+		if (vm.count("help") || concurrency <= 0 || requests <= 0 || warmup < 0) {
+			std::cout << "usage: loadgen [options]" << std::endl << opt << std::endl;
+			return vm.count("help") ? 0 : 1;
+		}
+	}
+	if (output_size != 0) runtime_options.insert(runtime_options.begin(), std::to_string(output_size));
+	l.request = make_request(l.compiler, source_size, stdin_size, runtime_options);
+
+	std::vector<outcome> outcomes(requests);
+	const auto drive = [&](int count, bool measure) {
+		std::atomic<int> next(0);
+		std::vector<std::thread> workers;
+		for (int i = 0; i < std::min(concurrency, count); ++i) workers.emplace_back([&] {
+			while (true) {
+				const auto n = next++;
+				if (n >= count) return;
+				auto o = run_one(l);
+				if (measure) outcomes[n] = std::move(o);
+			}
+		});
+		for (auto &w: workers) w.join();
+	};
+	if (warmup != 0) drive(warmup, false);
+	const auto started = steady::now();
+	drive(requests, true);
+	const auto elapsed = std::chrono::duration<double>(steady::now() - started).count();
+
+	std::vector<double> latencies, first_outputs;
+	std::map<std::string, std::size_t> error_kinds;
+	std::size_t errors = 0, output_bytes = 0;
+	for (const auto &o: outcomes) {
+		output_bytes += o.output_bytes;
+		if (!o.error.empty()) {
+			++errors;
+			++error_kinds[o.error];
+			continue;
+		}
+		latencies.push_back(o.latency);
+		if (o.output_bytes != 0) first_outputs.push_back(o.first_output);
+	}
+
+	std::string kinds;
+	for (const auto &e: error_kinds) kinds += (kinds.empty() ? "" : ",") + json_string(e.first) + ":" + std::to_string(e.second);
+	std::printf("{\"label\":%s,\"compiler\":%s,\"concurrency\":%d,\"requests\":%d,\"warmup\":%d,"
+		"\"source_size\":%zu,\"stdin_size\":%zu,\"output_size\":%zu,"
+		"\"elapsed\":%.3f,\"throughput\":%.2f,\"errors\":%zu,\"output_bytes\":%zu,"
+		"\"latency_ms\":%s,\"first_output_ms\":%s,\"error_kinds\":{%s}}\n",
+		json_string(label.empty() ? l.compiler : label).c_str(), json_string(l.compiler).c_str(), concurrency, requests, warmup,
+		source_size, stdin_size, output_size,
+		elapsed, requests / elapsed, errors, output_bytes,
+		json_percentiles(latencies).c_str(), json_percentiles(first_outputs).c_str(), kinds.c_str());
+	return errors == 0 ? 0 : 2;
+}
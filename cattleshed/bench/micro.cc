@@ -0,0 +1,313 @@
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <benchmark/benchmark.h>
+
+#include <fcntl.h>
+
+#include "frame.hpp"
+#include "load_config.hpp"
+#include "posixapi.hpp"
+#include "quoted_printable.hpp"
+#include "socket_write_buffer.hpp"
+
+namespace {
+	// every allocation of the process, to count those of one operation
+	std::size_t allocations = 0;
+}
+
+void *operator new(std::size_t size) {
+	++allocations;
+	if (void *p = std::malloc(size == 0 ? 1 : size)) return p;
+	throw std::bad_alloc();
+}
+// out of line, or gcc sees the free() of memory from operator new and warns
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+	std::free(p);
+}
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept {
+	std::free(p);
+}
+
+namespace wandbox {
+	namespace {
+		// source-like text: printable, with a newline every 60 octets and some '=' to escape
+		std::string text(std::size_t n) {
+			std::string s(n, 'a');
+			for (std::size_t i = 0; i < n; ++i) s[i] = i % 61 == 60 ? '\n' : i % 37 == 0 ? '=' : static_cast<char>('!' + i % 90);
+			return s;
+		}
+		std::string binary(std::size_t n) {
+			std::mt19937 engine(0);
+			std::string s(n, '\0');
+			for (auto &c: s) c = static_cast<char>(engine());
+			return s;
+		}
+
+		void qp_encode_text(benchmark::State &state) {
+			const auto s = text(state.range(0));
+			for (auto _: state) benchmark::DoNotOptimize(quoted_printable::encode(s));
+			state.SetBytesProcessed(state.iterations() * s.size());
+		}
+		BENCHMARK(qp_encode_text)->Range(64, 1 << 20);
+
+		void qp_encode_binary(benchmark::State &state) {
+			const auto s = binary(state.range(0));
+			for (auto _: state) benchmark::DoNotOptimize(quoted_printable::encode(s));
+			state.SetBytesProcessed(state.iterations() * s.size());
+		}
+		BENCHMARK(qp_encode_binary)->Range(64, 1 << 20);
+
+		void qp_decode_text(benchmark::State &state) {
+			const auto s = quoted_printable::encode(text(state.range(0)));
+			for (auto _: state) benchmark::DoNotOptimize(quoted_printable::decode(s));
+			state.SetBytesProcessed(state.iterations() * s.size());
+		}
+		BENCHMARK(qp_decode_text)->Range(64, 1 << 20);
+
+		void qp_decode_binary(benchmark::State &state) {
+			const auto s = quoted_printable::encode(binary(state.range(0)));
+			for (auto _: state) benchmark::DoNotOptimize(quoted_printable::decode(s));
+			state.SetBytesProcessed(state.iterations() * s.size());
+		}
+		BENCHMARK(qp_decode_binary)->Range(64, 1 << 20);
+
+		std::vector<char> request(std::size_t source_size) {
+			const auto frame = [](const std::string &command, const std::string &data) {
+				const auto qp = quoted_printable::encode(data);
+				return command + " " + std::to_string(qp.size()) + ":" + qp + "\n";
+			};
+			const auto r = frame("Control", "compiler=gcc-head") + frame("CompilerOption", "warning,optimize,cpp-pedantic") + frame("Source", text(source_size)) + frame("StdIn", "1 2 3\n") + frame("Control", "run");
+			return std::vector<char>(r.begin(), r.end());
+		}
+
+		// parsing a whole request that has been received in one read
+		void frame_parse_request(benchmark::State &state) {
+			const auto buf = request(state.range(0));
+			for (auto _: state) {
+				auto ite = buf.begin();
+				std::string command, data;
+				while (parse_frame(ite, buf.end(), command, data)) benchmark::DoNotOptimize(data);
+			}
+			state.SetBytesProcessed(state.iterations() * buf.size());
+		}
+		BENCHMARK(frame_parse_request)->Range(64, 1 << 20);
+
+		// the request arriving BUFSIZ octets at a time, as compiler_bridge reads it: an incomplete frame is parsed again after every read
+		void frame_parse_request_incrementally(benchmark::State &state) {
+			const auto whole = request(state.range(0));
+			for (auto _: state) {
+				std::vector<char> buf;
+				for (std::size_t off = 0; off < whole.size(); off += BUFSIZ) {
+					buf.insert(buf.end(), whole.begin() + off, whole.begin() + std::min<std::size_t>(off + BUFSIZ, whole.size()));
+					auto ite = buf.begin();
+					std::string command, data;
+					while (parse_frame(ite, buf.end(), command, data)) benchmark::DoNotOptimize(data);
+					buf.erase(buf.begin(), ite);
+				}
+			}
+			state.SetBytesProcessed(state.iterations() * whole.size());
+		}
+		BENCHMARK(frame_parse_request_incrementally)->Range(64, 1 << 20);
+
+		// a program's stdout pipe and a client connected to a socket_write_buffer, read by the client as fast as it can
+		struct forwarding {
+			boost::asio::io_service aio;
+			// keeps run_one() from stopping the io_service between rounds
+			boost::asio::io_service::work busy;
+			std::shared_ptr<boost::asio::ip::tcp::socket> sock;
+			boost::asio::ip::tcp::socket client;
+			std::unique_ptr<unique_fd> out_fd;
+			std::unique_ptr<boost::asio::posix::stream_descriptor> pipe;
+			memory_budget budget;
+			std::shared_ptr<socket_write_buffer> sockbuf;
+			std::vector<char> received;
+			forwarding(): aio(), busy(aio), sock(std::make_shared<boost::asio::ip::tcp::socket>(aio)), client(aio), budget(), received(1 << 20) {
+				namespace asio = boost::asio;
+				asio::ip::tcp::acceptor acc(aio, asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+				sock->connect(acc.local_endpoint());
+				acc.accept(client);
+				int fds[2];
+				if (::pipe(fds) == -1) throw_system_error(errno);
+				out_fd.reset(new unique_fd(fds[1]));
+				pipe.reset(new asio::posix::stream_descriptor(aio, fds[0]));
+				::fcntl(fds[0], F_SETPIPE_SZ, 1 << 20);
+				sockbuf = std::make_shared<socket_write_buffer>(sock, budget);
+				drain();
+			}
+			void drain() {
+				client.async_read_some(boost::asio::buffer(received), [this](boost::system::error_code ec, std::size_t) { if (!ec) drain(); });
+			}
+			void write(const std::string &out) {
+				if (::write(out_fd->get(), out.data(), out.size()) != static_cast<ssize_t>(out.size())) throw_system_error(errno);
+			}
+		};
+
+		// a chunk of program output read from a pipe and written to the client as a frame, as output_forwarder
+		// does it; allocs_per_chunk counts the heap allocations of each once the buffers and the arena are warm
+		void forward_output(benchmark::State &state) {
+			forwarding f;
+			const auto out = text(state.range(0));
+			std::vector<char> buf(BUFSIZ);
+			const auto round = [&] {
+				f.write(out);
+				bool done = false;
+				f.pipe->async_read_some(boost::asio::buffer(buf), in_arena(f.sockbuf->arena, [&](boost::system::error_code, std::size_t len) {
+					f.sockbuf->async_write_command("StdOut", buf.data(), len, [&done] { done = true; });
+				}));
+				while (!done) f.aio.run_one();
+			};
+			round();
+			round();
+			const auto before = allocations;
+			for (auto _: state) round();
+			state.counters["allocs_per_chunk"] = static_cast<double>(allocations - before) / state.iterations();
+			state.SetBytesProcessed(state.iterations() * out.size());
+		}
+		BENCHMARK(forward_output)->Arg(64)->Arg(1024)->Arg(BUFSIZ);
+
+		// the same chunk with RawOutput, spliced from the pipe to the socket as raw_output_forwarder does it
+		void forward_output_raw(benchmark::State &state) {
+			forwarding f;
+			const auto out = binary(state.range(0));
+			const auto round = [&] {
+				f.write(out);
+				bool done = false;
+				f.sockbuf->async_splice_command("StdOutRaw", f.pipe->native_handle(), out.size(), [&done] { done = true; });
+				while (!done) f.aio.run_one();
+			};
+			round();
+			round();
+			const auto before = allocations;
+			for (auto _: state) round();
+			state.counters["allocs_per_chunk"] = static_cast<double>(allocations - before) / state.iterations();
+			state.SetBytesProcessed(state.iterations() * out.size());
+		}
+		BENCHMARK(forward_output_raw)->Arg(BUFSIZ)->Arg(1 << 16)->Arg(1 << 20);
+
+		// a session resumed by a read of the pipe and then by the write of the frame, as program_runner and the
+		// other stages of a connection are resumed; allocs_per_step counts the heap allocations of each resumption
+		struct forwarding_session: session<forwarding_session>, boost::asio::coroutine {
+			explicit forwarding_session(forwarding &f): session(f.sockbuf->arena), f(f), buf(BUFSIZ), steps(0) { }
+			void operator ()(boost::system::error_code ec = boost::system::error_code(), std::size_t len = 0) {
+				BOOST_ASIO_CORO_REENTER(this) while (true) {
+					BOOST_ASIO_CORO_YIELD f.pipe->async_read_some(boost::asio::buffer(buf), step());
+					if (ec) break;
+					++steps;
+					BOOST_ASIO_CORO_YIELD f.sockbuf->async_write_command("StdOut", buf.data(), len, step());
+					++steps;
+				}
+			}
+			forwarding &f;
+			std::vector<char> buf;
+			std::size_t steps;
+		};
+		void session_step(benchmark::State &state) {
+			forwarding f;
+			const auto out = text(state.range(0));
+			const auto s = std::make_shared<forwarding_session>(f);
+			(*s)();
+			const auto round = [&] {
+				const auto steps = s->steps + 2;
+				f.write(out);
+				while (s->steps != steps) f.aio.run_one();
+			};
+			round();
+			round();
+			const auto before = allocations;
+			for (auto _: state) round();
+			state.counters["allocs_per_step"] = static_cast<double>(allocations - before) / (state.iterations() * 2);
+			state.SetBytesProcessed(state.iterations() * out.size());
+			f.pipe->close();
+			while (f.aio.poll_one()) ;
+		}
+		BENCHMARK(session_step)->Arg(64)->Arg(BUFSIZ);
+
+		// a config shaped like compilers.default: a few families of compilers inheriting from a base, sharing switches
+		std::string generated_config(int compilers) {
+			std::string s = "{\"system\":{\"listen-port\":2012,\"max-connections\":32,\"max-queue\":256,\"basedir\":\"/tmp\",\"storedir\":\"/tmp\",\"tracedir\":\"\",\"trace-sample-rate\":0,\"trace-slow-threshold\":0,\"build-cache-dir\":\"\",\"build-cache-ttl\":0,\"output-cache-dir\":\"\",\"output-cache-ttl\":0,\"artifact-dir\":\"\",\"artifact-ttl\":0,\"artifact-size-limit\":0,\"artifact-quota\":0,\"capture-file\":\"\"},\n";
+			s += "\"jail\":{\"\":{\"jail-command\":[\"/usr/bin/env\"],\"program-duration\":60,\"compile-time-limit\":60,\"kill-wait\":5,\"output-limit-kill\":262144,\"output-limit-warn\":131072}},\n";
+			s += "\"switches\":{";
+			for (int i = 0; i < 50; ++i) {
+				if (i != 0) s += ",\n";
+				s += "\"sw" + std::to_string(i) + "\":{\"flags\":[\"-fsw" + std::to_string(i) + "\"],\"display-name\":\"switch " + std::to_string(i) + "\"" + (i % 5 == 0 ? ",\"conflicts\":[\"sw" + std::to_string(i + 1) + "\"]" : "") + "}";
+			}
+			s += "},\n\"compilers\":[\n";
+			for (int i = 0; i < compilers; ++i) {
+				if (i != 0) s += ",\n";
+				const auto name = "gcc-" + std::to_string(i);
+				if (i % 10 == 0) {
+					s += "{\"name\":\"" + name + "\",\"language\":\"C++\",\"compile-command\":[\"/usr/bin/g++\",\"-oprog.exe\",\"prog.cc\"],\"version-command\":[\"/usr/bin/g++\",\"-dumpversion\"],\"run-command\":[\"./prog.exe\"],\"output-file\":\"prog.cc\",\"display-name\":\"gcc\",\"display-compile-command\":\"g++ prog.cc\",\"jail-name\":\"\",\"displayable\":true,\"compiler-option-raw\":true,\"runtime-option-raw\":true,\"switches\":[";
+					for (int j = 0; j < 20; ++j) s += std::string(j == 0 ? "" : ",") + "\"sw" + std::to_string((i + j) % 50) + "\"";
+					s += "],\"initial-checked\":[\"sw" + std::to_string(i % 50) + "\"]}";
+				} else {
+					s += "{\"name\":\"" + name + "\",\"inherits\":[\"gcc-" + std::to_string(i / 10 * 10) + "\"],\"compile-command\":[\"/opt/" + name + "/bin/g++\",\"-oprog.exe\",\"prog.cc\"],\"display-name\":\"gcc " + std::to_string(i) + "\"}";
+				}
+			}
+			return s + "\n]}\n";
+		}
+
+		struct config_file {
+			std::string path;
+			explicit config_file(const std::string &contents) {
+				char name[] = "/tmp/cattleshed-bench-XXXXXX";
+				const int fd = ::mkstemp(name);
+				if (fd == -1) throw_system_error(errno);
+				path = name;
+				if (::write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size())) throw_system_error(errno);
+				::close(fd);
+			}
+			~config_file() {
+				::unlink(path.c_str());
+			}
+		};
+
+		void load_config_compilers(benchmark::State &state) {
+			const config_file f(generated_config(state.range(0)));
+			for (auto _: state) benchmark::DoNotOptimize(load_config({ f.path }));
+			state.SetItemsProcessed(state.iterations() * state.range(0));
+		}
+		BENCHMARK(load_config_compilers)->Arg(100)->Arg(1000)->Unit(benchmark::kMillisecond);
+
+		void displaying_compiler_config(benchmark::State &state) {
+			const config_file f(generated_config(1000));
+			const auto config = load_config({ f.path });
+			for (auto _: state) {
+				std::string r;
+				for (const auto &c: config.compilers) r += generate_displaying_compiler_config(c, "10.1.0", config.switches);
+				benchmark::DoNotOptimize(r);
+			}
+			state.SetItemsProcessed(state.iterations() * config.compilers.size());
+		}
+		BENCHMARK(displaying_compiler_config)->Unit(benchmark::kMillisecond);
+
+		// writing a source file into a fresh sandbox, as program_writer does for every source
+		void recursive_create_open(benchmark::State &state) {
+			const auto base = mkdtemp("/tmp/cattleshed-bench-XXXXXX");
+			const auto dir = opendir(base);
+			const auto path = state.range(0) == 0 ? std::string("prog.cc") : [&] {
+				std::string p;
+				for (int i = 0; i < state.range(0); ++i) p += "d" + std::to_string(i) + "/";
+				return p + "prog.cc";
+			}();
+			int n = 0;
+			for (auto _: state) {
+				const auto sandbox = std::to_string(n++);
+				::mkdirat(::dirfd(dir.get()), sandbox.c_str(), 0700);
+				const int fd = recursive_create_open_at(::dirfd(dir.get()), sandbox + "/" + path, O_WRONLY|O_CLOEXEC|O_CREAT|O_TRUNC|O_EXCL|O_NOATIME, 0700, 0600);
+				if (fd == -1) state.SkipWithError("recursive_create_open_at failed");
+				::close(fd);
+			}
+			std::system(("rm -rf " + base).c_str());
+		}
+		BENCHMARK(recursive_create_open)->Arg(0)->Arg(1)->Arg(4)->Arg(16);
+	}
+}
+
+BENCHMARK_MAIN();
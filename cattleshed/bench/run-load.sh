@@ -0,0 +1,43 @@
+#!/bin/bash
+# Starts cattleshed with the stub compilers and runs loadgen for every scenario,
+# printing a JSON array of the results.
+#   run-load.sh <cattleshed> <loadgen> <stub.conf> <port>
+set -e
+
+cattleshed=$1
+loadgen=$2
+conf=$3
+port=$4
+
+workdir=$(sed -n 's/^ *"basedir":"\(.*\)\/base",$/\1/p' "$conf")
+rm -rf "$workdir"
+mkdir -p "$workdir/base" "$workdir/ran"
+
+"$cattleshed" -c "$conf" > "$workdir/cattleshed.log" 2>&1 &
+server=$!
+trap 'kill $server 2> /dev/null; wait $server 2> /dev/null || true' EXIT
+for i in $(seq 50); do
+  (exec 3<> /dev/tcp/127.0.0.1/$port) 2> /dev/null && break
+  sleep 0.1
+done
+
+scenario() {
+  "$loadgen" -p "$port" "$@" || echo "loadgen failed: $*" >&2
+}
+
+echo "["
+# spawn and protocol overhead only
+scenario -l spawn -c echo -j 16 -n 2000 -w 200 -r ok
+echo ","
+# request parsing and writing a large source
+scenario -l source-256k -c echo -j 16 -n 100 -w 16 --source-size 262144 -r ok
+echo ","
+# StdIn forwarded to the program and echoed back
+scenario -l stdin-64k -c cat -j 16 -n 1000 -w 100 --stdin-size 65536
+echo ","
+# output forwarding and quoted-printable encoding
+scenario -l output-1m -c yes -j 16 -n 100 -w 16 --output-size 1048576
+echo ","
+# many idle runs in flight
+scenario -l sleep -c sleep -j 64 -n 640 -r 0.1
+echo "]"
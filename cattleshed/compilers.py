@@ -188,6 +188,15 @@ class Switches(object):
                 "flags":["-v"],
                 "display-name":"Verbose",
             },
+            "gcc-time-report":{
+                "flags":["-ftime-report"],
+                "display-name":"Time Report",
+            },
+            "clang-time-trace":{
+                "flags":["-ftime-trace"],
+                "display-name":"Time Trace",
+                "collect":["*.json"],
+            },
             "cpp-p":{
                 "flags":["-P"],
                 "display-name":"-P",
@@ -265,7 +274,7 @@ class Compilers(object):
                 "after": {
                     "display-name":"gcc HEAD",
                     "version-command":["/bin/sh", "-c", "/usr/local/gcc-head/bin/g++ --version | head -1 | cut -d' ' -f3-"],
-                    "switches": SWITCHES_DEFAULT + SWITCHES_BOOST + ["sprout", "c++98", "gnu++98", "c++11", "gnu++11", "c++1y", "gnu++1y", "c++1z", "gnu++1z"],
+                    "switches": SWITCHES_DEFAULT + ["gcc-time-report"] + SWITCHES_BOOST + ["sprout", "c++98", "gnu++98", "c++11", "gnu++11", "c++1y", "gnu++1y", "c++1z", "gnu++1z"],
                     "initial-checked":["warning", "gnu++1z", "boost-1.56", "sprout"],
                 },
             }),
@@ -341,6 +350,16 @@ class Compilers(object):
                 "-lpthread",
                 "prog.cc"
             ],
+            "object-command":[
+                "/usr/local/{name}/bin/g++",
+                "-c"
+            ],
+            "link-command":[
+                "/usr/local/{name}/bin/g++",
+                "-oprog.exe",
+                "-Wl,-rpath,/usr/local/{name}/lib64",
+                "-lpthread"
+            ],
             "version-command":["/usr/local/{name}/bin/g++", "-dumpversion"],
             "display-name":"gcc",
             "display-compile-command":"g++ prog.cc",
@@ -366,7 +385,7 @@ class Compilers(object):
                 },
                 "after": {
                     "display-name":"clang HEAD",
-                    "switches": SWITCHES_DEFAULT + SWITCHES_BOOST + ["sprout", "c++98", "gnu++98", "c++11", "gnu++11", "c++14", "gnu++14", "c++1z", "gnu++1z"],
+                    "switches": SWITCHES_DEFAULT + ["clang-time-trace"] + SWITCHES_BOOST + ["sprout", "c++98", "gnu++98", "c++11", "gnu++11", "c++14", "gnu++14", "c++1z", "gnu++1z"],
                     "initial-checked":["warning", "gnu++1z", "boost-1.56", "sprout"],
                     "compile-command":[
                         "/usr/local/llvm-head/bin/run-clang++.sh",
@@ -613,7 +632,6 @@ class Compilers(object):
             "run-command":["/usr/local/{name}/bin/{bin}", "prog.pl"],
             "language":"Perl",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/usr/local/{name}/bin/{bin}", "-e", "print $^V"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -670,7 +688,6 @@ class Compilers(object):
             "display-compile-command":"python prog.py",
             "language":"Python",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/usr/local/{name}/bin/{bin}", "-c", "import sys; print(sys.version.split()[0])"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -719,7 +736,6 @@ class Compilers(object):
             "display-compile-command":"ruby prog.rb",
             "language":"Ruby",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/usr/local/{name}/bin/ruby", "-e", "print RUBY_VERSION"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -748,7 +764,6 @@ class Compilers(object):
             "display-compile-command":"php prog.php",
             "language":"PHP",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/{name}/bin/php", "prog.php"],
             "version-command":["/bin/sh", "-c", "/usr/local/{name}/bin/php -v | head -1 | cut -d' ' -f2"],
         }
@@ -779,7 +794,6 @@ class Compilers(object):
             "display-compile-command":"escript prog.erl",
             "language":"Erlang",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/usr/local/{name}/bin/erl", "-eval", "io:format(\"~s~n\", [erlang:system_info(otp_release)]), halt().", "-noshell"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -802,7 +816,6 @@ class Compilers(object):
             "display-compile-command":"elixir prog.ex",
             "language":"Elixir",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/bin/bash", "-c", "PATH=/usr/local/erlang-head/bin:$PATH /usr/local/{name}/bin/elixir --version | cut -d' ' -f2"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -832,7 +845,6 @@ class Compilers(object):
             "output-file":"prog.js",
             "display-name":"node",
             "display-compile-command":"node prog.js",
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/{name}/bin/node", "prog.js"],
             "runtime-option-raw":True,
             "version-command":["/bin/sh", "-c", "/usr/local/{name}/bin/node --version | cut -c2-"],
@@ -848,7 +860,6 @@ class Compilers(object):
             "output-file":"prog.js",
             "display-name":"SpiderMonkey",
             "display-compile-command":"js24 prog.js",
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/mozjs-24.2.0/bin/js24", "prog.js"],
             "runtime-option-raw":True,
             "version-command":["/bin/sh", "-c", "/usr/local/mozjs-24.2.0/bin/js24 --help | grep Version | cut -d'-' -f2 | cut -c2-"],
@@ -883,7 +894,6 @@ class Compilers(object):
             "output-file":"prog.coffee",
             "display-name":"coffee",
             "display-compile-command":"coffee prog.coffee",
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/node-0.10.24/bin/node", "/usr/local/{name}/bin/coffee", "prog.coffee"],
             "runtime-option-raw":True,
             "version-command":["/bin/sh", "-c", "/usr/local/node-0.10.24/bin/node /usr/local/{name}/bin/coffee --version | cut -d' ' -f3"],
@@ -916,7 +926,6 @@ class Compilers(object):
             "display-compile-command":"cat prog.sql | sqlite3",
             "language":"SQL",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/bin/sh", "-c", "/usr/local/{name}/bin/sqlite3 -version | cut -d' ' -f1"],
         }
         compilers = self.make_common(NAMES, FORMATS)
@@ -1005,7 +1014,6 @@ class Compilers(object):
             "display-compile-command":"gcc prog.cpp -E",
             "language":"CPP",
             "output-file":"prog.cpp",
-            "compile-command":"/bin/true",
             "runtime-option-raw":True,
             "run-command":["/usr/local/gcc-4.8.2/bin/gcc", "-E", "prog.cpp"],
             "version-command":["/usr/local/gcc-4.8.2/bin/gcc", "-dumpversion"],
@@ -1068,7 +1076,6 @@ class Compilers(object):
             "display-compile-command":"bash prog.sh",
             "language":"Bash script",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "version-command":["/bin/sh", "-c", "/bin/bash --version | head -1"],
         },{
             "name":"lua-5.2.2",
@@ -1078,7 +1085,6 @@ class Compilers(object):
             "display-compile-command":"lua prog.lua",
             "language":"Lua",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/lua-5.2.2/bin/lua", "prog.lua"],
             "version-command":["/bin/sh", "-c", "/usr/local/lua-5.2.2/bin/lua -v | cut -d' ' -f2"],
         },{
@@ -1089,7 +1095,6 @@ class Compilers(object):
             "display-compile-command":"lazyk prog.lazy",
             "language":"Lazy K",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/lazyk/bin/lazyk", "prog.lazy"],
             "version-command":["/bin/echo", "-e", "\\n"],
         },{
@@ -1100,7 +1105,6 @@ class Compilers(object):
             "display-compile-command":"clisp prog.lisp",
             "language":"Lisp",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/clisp-2.49.0/bin/clisp", "prog.lisp"],
             "version-command":["/bin/sh", "-c", "/usr/local/clisp-2.49.0/bin/clisp --version | head -1 | cut -d' ' -f3"],
         },{
@@ -1137,7 +1141,6 @@ class Compilers(object):
             "jail-name":"jvm",
             "language":"Groovy",
             "runtime-option-raw":True,
-            "compile-command":"/bin/true",
             "run-command":["/usr/local/groovy-2.2.1/bin/groovy", "prog.groovy"],
             "version-command":["/bin/sh", "-c", "/usr/local/groovy-2.2.1/bin/groovy --version | cut -d' ' -f3"],
         }]
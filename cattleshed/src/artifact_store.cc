@@ -0,0 +1,149 @@
+#include "artifact_store.hpp"
+
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <random>
+#include <tuple>
+#include <vector>
+
+#include "posixapi.hpp"
+
+namespace wandbox {
+	namespace {
+		void remove_tree(const std::shared_ptr<DIR> &at, const std::string &name) {
+			try {
+				const auto d = opendirat(at, name);
+				while (const auto ent = ::readdir(d.get())) {
+					const std::string n = ent->d_name;
+					if (n == "." || n == "..") continue;
+					struct ::stat st;
+					if (::fstatat(::dirfd(d.get()), n.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) continue;
+					if (S_ISDIR(st.st_mode)) remove_tree(d, n);
+					else ::unlinkat(::dirfd(d.get()), n.c_str(), 0);
+				}
+			} catch (std::system_error &) {
+			}
+			::unlinkat(dirfd_or_cwd(at), name.c_str(), AT_REMOVEDIR);
+		}
+
+		bool read_meta(const std::string &path, std::string &compiler, long long &size) {
+			std::ifstream is(path + "/meta");
+			return std::getline(is, compiler) && (is >> size);
+		}
+
+		bool valid_handle(const std::string &handle) {
+			return handle.size() == 32 && std::all_of(handle.begin(), handle.end(), [](char c) { return ('0' <= c && c <= '9') || ('a' <= c && c <= 'f'); });
+		}
+	}
+
+	artifact_store::artifact_store(const std::string &dir, int ttl, long long size_limit, long long quota)
+		 : path(dir),
+		   dir(opendir(dir)),
+		   ttl(ttl),
+		   size_limit(size_limit),
+		   quota(quota)
+	{
+	}
+
+	std::string artifact_store::keep(const std::shared_ptr<DIR> &workdir, const std::string &compiler) const {
+		std::vector<std::string> files;
+		list_files_at(workdir, "store", files);
+		long long size = 0;
+		for (const auto &f: files) {
+			struct ::stat st;
+			if (::fstatat(::dirfd(workdir.get()), ("store/" + f).c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) throw_system_error(errno);
+			if (S_ISREG(st.st_mode)) size += st.st_size;
+		}
+		if (size_limit > 0 && size > size_limit) return {};
+		make_room(size);
+
+		std::random_device rd;
+		std::string handle;
+		while (true) {
+			handle.clear();
+			for (int i = 0; i < 32; ++i) handle.push_back("0123456789abcdef"[rd() % 16]);
+			if (::mkdirat(::dirfd(dir.get()), handle.c_str(), 0700) == 0) break;
+			if (errno != EEXIST) throw_system_error(errno);
+		}
+		const auto artifact = opendirat(dir, handle);
+		for (const auto &f: files) {
+			const auto file = "store/" + f;
+			// the files are shared by every execution, so they must not be writable
+			struct ::stat st;
+			if (::fstatat(::dirfd(workdir.get()), file.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) ::fchmodat(::dirfd(workdir.get()), file.c_str(), st.st_mode & ~0222, 0);
+			if (recursive_link_at(::dirfd(workdir.get()), file, ::dirfd(artifact.get()), file, 0700) == -1) {
+				const auto e = errno;
+				remove_tree(dir, handle);
+				throw_system_error(e);
+			}
+		}
+		// an artifact without meta is not handed out, so it is written last
+		unique_fd fd(::openat(::dirfd(artifact.get()), "meta", O_WRONLY|O_CLOEXEC|O_CREAT|O_EXCL, 0600));
+		const auto meta = compiler + "\n" + std::to_string(size) + "\n";
+		if (!fd || ::write(fd.get(), meta.data(), meta.size()) != static_cast<ssize_t>(meta.size())) {
+			const auto e = errno;
+			remove_tree(dir, handle);
+			throw_system_error(e);
+		}
+		return handle;
+	}
+
+	std::shared_ptr<DIR> artifact_store::checkout(const std::string &handle, std::string &compiler) const {
+		if (!valid_handle(handle)) return nullptr;
+		struct ::stat st;
+		if (::fstatat(::dirfd(dir.get()), handle.c_str(), &st, 0) == -1 || !S_ISDIR(st.st_mode)) return nullptr;
+		if (ttl > 0 && ::time(nullptr) - st.st_mtime > ttl) {
+			remove_tree(dir, handle);
+			return nullptr;
+		}
+		const auto artifact = opendirat(dir, handle);
+		long long size;
+		if (!read_meta(path + "/" + handle, compiler, size)) return nullptr;
+		// an artifact in use expires ttl seconds after its last execution
+		::futimens(::dirfd(artifact.get()), nullptr);
+
+		std::string unique_name;
+		std::shared_ptr<DIR> workdir;
+		while (unique_name.empty() || !workdir) try {
+			unique_name = mkdtemp("wandboxXXXXXX");
+			workdir = opendir(unique_name);
+		} catch (std::system_error &e) {
+			if (e.code().value() != ENOTDIR) throw;
+		}
+		std::vector<std::string> files;
+		list_files_at(artifact, "store", files);
+		for (const auto &f: files) {
+			if (recursive_link_at(::dirfd(artifact.get()), "store/" + f, ::dirfd(workdir.get()), "store/" + f, 0700) == -1) throw_system_error(errno);
+		}
+		return workdir;
+	}
+
+	void artifact_store::make_room(long long size) const {
+		if (ttl > 0) {
+			for (const auto &n: entries_older_than(dir, S_IFDIR, ttl)) remove_tree(dir, n);
+		}
+		if (quota <= 0) return;
+		std::vector<std::tuple<std::time_t, std::string, long long>> kept;
+		long long total = 0;
+		::rewinddir(dir.get());
+		while (const auto ent = ::readdir(dir.get())) {
+			const std::string n = ent->d_name;
+			if (n == "." || n == "..") continue;
+			struct ::stat st;
+			if (::fstatat(::dirfd(dir.get()), n.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISDIR(st.st_mode)) continue;
+			std::string compiler;
+			long long s = 0;
+			read_meta(path + "/" + n, compiler, s);
+			kept.emplace_back(st.st_mtime, n, s);
+			total += s;
+		}
+		// least recently executed artifacts go first
+		std::sort(kept.begin(), kept.end());
+		for (const auto &k: kept) {
+			if (total + size <= quota) break;
+			remove_tree(dir, std::get<1>(k));
+			total -= std::get<2>(k);
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef ARTIFACT_STORE_HPP_
+#define ARTIFACT_STORE_HPP_
+
+#include <memory>
+#include <string>
+
+#include <dirent.h>
+
+namespace wandbox {
+	// compiled stores kept by `Control prepare', handed out again by `Control execute'.
+	class artifact_store {
+	public:
+		artifact_store(const std::string &dir, int ttl, long long size_limit, long long quota);
+		artifact_store(const artifact_store &) = delete;
+		artifact_store &operator =(const artifact_store &) = delete;
+
+		// handle of the kept store, or empty if it is larger than the size limit
+		std::string keep(const std::shared_ptr<DIR> &workdir, const std::string &compiler) const;
+		// new working directory with links to the kept store, or null if the handle is unknown or expired
+		std::shared_ptr<DIR> checkout(const std::string &handle, std::string &compiler) const;
+	private:
+		void make_room(long long size) const;
+
+		std::string path;
+		std::shared_ptr<DIR> dir;
+		int ttl;
+		long long size_limit;
+		long long quota;
+	};
+}
+
+#endif
@@ -0,0 +1,155 @@
+#include "benchmark.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "posixapi.hpp"
+
+namespace wandbox {
+	namespace {
+		struct counter_type {
+			const char *name;
+			std::uint32_t type;
+			std::uint64_t config;
+		};
+		const counter_type counter_types[] = {
+			{ "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+			{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+			{ "cpu-migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+			{ "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+			{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+			{ "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		};
+
+		std::mutex reserved_mutex;
+		std::set<int> reserved;
+
+		std::string number(double v, int precision) {
+			char buf[64];
+			std::snprintf(buf, sizeof(buf), "%.*f", precision, v);
+			return buf;
+		}
+		// {"min":..,"median":..,"max":..} of `values', which are sorted on the way
+		std::string summary(std::vector<double> values, int precision) {
+			std::sort(values.begin(), values.end());
+			const auto n = values.size();
+			const double median = n % 2 ? values[n/2] : (values[n/2-1] + values[n/2]) / 2;
+			return "{\"min\":" + number(values.front(), precision) + ",\"median\":" + number(median, precision) + ",\"max\":" + number(values.back(), precision) + "}";
+		}
+	}
+
+	benchmark_options benchmark_options::parse(const std::string &s, int max_runs) {
+		benchmark_options opts = { 10, 1, false };
+		std::vector<std::string> items;
+		boost::algorithm::split(items, s, boost::is_any_of(",\n"));
+		for (const auto &item: items) {
+			if (item.compare(0, 5, "runs=") == 0) opts.runs = std::atoi(item.c_str() + 5);
+			else if (item.compare(0, 7, "warmup=") == 0) opts.warmup = std::atoi(item.c_str() + 7);
+			else if (item == "perf") opts.perf = true;
+		}
+		opts.runs = std::max(1, std::min(opts.runs, max_runs));
+		opts.warmup = std::max(0, std::min(opts.warmup, max_runs - opts.runs));
+		return opts;
+	}
+
+	perf_counters::~perf_counters() {
+		for (const auto &x: fds) ::close(x.second);
+	}
+
+	void perf_counters::open(pid_t pid) {
+		for (const auto &t: counter_types) {
+			::perf_event_attr attr = {};
+			attr.size = sizeof(attr);
+			attr.type = t.type;
+			attr.config = t.config;
+			attr.disabled = 1;
+			attr.enable_on_exec = 1;
+			attr.inherit = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			const int fd = static_cast<int>(::syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC));
+			if (fd == -1) missing.push_back(t.name);
+			else fds.emplace_back(t.name, fd);
+		}
+	}
+
+	std::vector<std::pair<std::string, double>> perf_counters::read() const {
+		std::vector<std::pair<std::string, double>> ret;
+		for (const auto &x: fds) {
+			// value, time enabled, time running; hardware counters share the pmu and are scaled up
+			// by the time they were not scheduled
+			std::uint64_t v[3];
+			if (::read(x.second, v, sizeof(v)) != sizeof(v) || v[2] == 0) continue;
+			ret.emplace_back(x.first, v[2] < v[1] ? static_cast<double>(v[0]) * v[1] / v[2] : static_cast<double>(v[0]));
+		}
+		return ret;
+	}
+
+	std::shared_ptr<int> reserve_cpu(const std::vector<int> &cpus) {
+		std::lock_guard<std::mutex> lock(reserved_mutex);
+		for (const int cpu: cpus) {
+			if (!reserved.insert(cpu).second) continue;
+			return std::shared_ptr<int>(new int(cpu), [](int *p) {
+				std::lock_guard<std::mutex> lock(reserved_mutex);
+				reserved.erase(*p);
+				delete p;
+			});
+		}
+		return nullptr;
+	}
+
+	void pin_to_cpu(pid_t pid, int cpu) {
+		::cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (::sched_setaffinity(pid, sizeof(set), &set) == -1) throw_system_error(errno);
+	}
+
+	std::string benchmark_result(const benchmark_options &opts, int cpu, const std::vector<benchmark_sample> &samples, const std::vector<std::string> &unavailable) {
+		std::string ret = "{\"runs\":" + std::to_string(samples.size()) + ",\"warmup\":" + std::to_string(opts.warmup) + ",\"cpu\":" + (cpu < 0 ? "null" : std::to_string(cpu));
+		if (!samples.empty()) {
+			std::vector<double> wall, user, sys, maxrss;
+			std::vector<std::pair<std::string, std::vector<double>>> counters;
+			for (const auto &s: samples) {
+				wall.push_back(s.wall);
+				user.push_back(s.user);
+				sys.push_back(s.sys);
+				maxrss.push_back(static_cast<double>(s.maxrss));
+				for (const auto &c: s.counters) {
+					auto it = std::find_if(counters.begin(), counters.end(), [&c](const std::pair<std::string, std::vector<double>> &x) { return x.first == c.first; });
+					if (it == counters.end()) it = counters.insert(counters.end(), std::make_pair(c.first, std::vector<double>()));
+					it->second.push_back(c.second);
+				}
+			}
+			ret += ",\"wall\":" + summary(wall, 6) + ",\"user\":" + summary(user, 6) + ",\"sys\":" + summary(sys, 6) + ",\"maxrss\":" + summary(maxrss, 0);
+			ret += ",\"counters\":{";
+			for (const auto &c: counters) ret += (&c == &counters.front() ? "\"" : ",\"") + c.first + "\":" + summary(c.second, 0);
+			ret += "}";
+		}
+		ret += ",\"unavailable\":[";
+		for (const auto &u: unavailable) ret += (&u == &unavailable.front() ? "\"" : ",\"") + u + "\"";
+		ret += "],\"samples\":[";
+		for (const auto &s: samples) {
+			ret += (&s == &samples.front() ? "" : ",");
+			ret += "{\"wall\":" + number(s.wall, 6) + ",\"user\":" + number(s.user, 6) + ",\"sys\":" + number(s.sys, 6) + ",\"maxrss\":" + std::to_string(s.maxrss) + ",\"counters\":{";
+			for (const auto &c: s.counters) ret += (&c == &s.counters.front() ? "\"" : ",\"") + c.first + "\":" + number(c.second, 0);
+			ret += "}}";
+		}
+		return ret + "]}";
+	}
+}
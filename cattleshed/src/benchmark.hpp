@@ -0,0 +1,57 @@
+#ifndef BENCHMARK_HPP_
+#define BENCHMARK_HPP_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace wandbox {
+	// `runs=<K>,warmup=<W>,perf` of a Benchmark frame; runs and warmups together are at most `max_runs`.
+	struct benchmark_options {
+		int runs;
+		int warmup;
+		bool perf;
+
+		static benchmark_options parse(const std::string &s, int max_runs);
+	};
+
+	// one measured run of the program; times in seconds, peak resident set in KiB
+	struct benchmark_sample {
+		double wall;
+		double user;
+		double sys;
+		long maxrss;
+		std::vector<std::pair<std::string, double>> counters;
+	};
+
+	// perf_event counters of a process that has not run its program yet, counting from its next exec
+	// and including every process it starts after that. Counters the kernel does not allow or the
+	// machine does not have are left out.
+	class perf_counters {
+	public:
+		perf_counters() = default;
+		perf_counters(const perf_counters &) = delete;
+		perf_counters &operator =(const perf_counters &) = delete;
+		~perf_counters();
+
+		void open(pid_t pid);
+		std::vector<std::pair<std::string, double>> read() const;
+		const std::vector<std::string> &unavailable() const { return missing; }
+	private:
+		std::vector<std::pair<std::string, int>> fds;
+		std::vector<std::string> missing;
+	};
+
+	// one of `cpus' no other benchmark is running on, held until the returned pointer is released;
+	// nullptr when all of them are in use.
+	std::shared_ptr<int> reserve_cpu(const std::vector<int> &cpus);
+	void pin_to_cpu(pid_t pid, int cpu);
+
+	// BenchmarkResult: the summary and every sample as json; `cpu' is -1 when the runs were not pinned
+	std::string benchmark_result(const benchmark_options &opts, int cpu, const std::vector<benchmark_sample> &samples, const std::vector<std::string> &unavailable);
+}
+
+#endif
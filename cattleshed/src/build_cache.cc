@@ -0,0 +1,158 @@
+#include "build_cache.hpp"
+
+#include <map>
+#include <random>
+
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/join.hpp>
+#include <boost/algorithm/string/split.hpp>
+
+#include "posixapi.hpp"
+#include "sha256.hpp"
+
+namespace wandbox {
+	namespace {
+		const std::size_t max_source_size = 16 * 1024 * 1024;
+
+		// whether `s' looks like an id the server issued, and so is safe as a directory name
+		bool valid_session(const std::string &s) {
+			if (s.size() != 32) return false;
+			for (const char c: s) if (!(('0' <= c && c <= '9') || ('a' <= c && c <= 'f'))) return false;
+			return true;
+		}
+
+		bool read_file(const std::shared_ptr<DIR> &workdir, const std::string &path, std::string &content) {
+			unique_fd fd(::openat(::dirfd(workdir.get()), ("store/" + path).c_str(), O_RDONLY|O_CLOEXEC|O_NOFOLLOW));
+			if (!fd) return false;
+			struct ::stat st;
+			if (::fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode) || static_cast<std::size_t>(st.st_size) > max_source_size) return false;
+			content.clear();
+			char buf[BUFSIZ];
+			while (true) {
+				const auto r = ::read(fd.get(), buf, sizeof(buf));
+				if (r == -1 && errno == EINTR) continue;
+				if (r <= 0) return r == 0;
+				content.append(buf, r);
+			}
+		}
+
+		std::vector<std::string> quoted_includes(const std::string &content) {
+			std::vector<std::string> ret;
+			std::size_t pos = 0;
+			while (pos < content.size()) {
+				auto eol = content.find('\n', pos);
+				if (eol == std::string::npos) eol = content.size();
+				auto p = content.find_first_not_of(" \t", pos);
+				if (p < eol && content[p] == '#') {
+					p = content.find_first_not_of(" \t", p + 1);
+					if (p < eol && content.compare(p, 7, "include") == 0) {
+						p = content.find_first_not_of(" \t", p + 7);
+						if (p < eol && content[p] == '"') {
+							const auto q = content.find('"', p + 1);
+							if (q < eol) ret.emplace_back(content, p + 1, q - p - 1);
+						}
+					}
+				}
+				pos = eol + 1;
+			}
+			return ret;
+		}
+
+		void remove_session(const std::shared_ptr<DIR> &base, const std::string &name) {
+			try {
+				const auto d = opendirat(base, name);
+				while (const auto ent = ::readdir(d.get())) {
+					const std::string n = ent->d_name;
+					if (n == "." || n == "..") continue;
+					::unlinkat(::dirfd(d.get()), n.c_str(), 0);
+				}
+			} catch (std::system_error &) {
+				return;
+			}
+			::unlinkat(::dirfd(base.get()), name.c_str(), AT_REMOVEDIR);
+		}
+	}
+
+	build_cache::build_cache(const std::string &dir, const std::string &session, int ttl)
+		 : dir(),
+		   id()
+	{
+		const auto base = opendir(dir);
+		// an id the client chose could be anybody's, so only a session the server issued and still has is continued
+		struct ::stat st;
+		if (valid_session(session) && ::fstatat(::dirfd(base.get()), session.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+			id = session;
+		} else {
+			std::random_device rd;
+			while (true) {
+				id.clear();
+				for (int i = 0; i < 32; ++i) id.push_back("0123456789abcdef"[rd() % 16]);
+				if (::mkdirat(::dirfd(base.get()), id.c_str(), 0700) == 0) break;
+				if (errno != EEXIST) throw_system_error(errno);
+			}
+		}
+
+		if (ttl > 0) {
+			for (const auto &n: entries_older_than(base, S_IFDIR, ttl)) if (n != id) remove_session(base, n);
+		}
+		this->dir = opendirat(base, id);
+		// keeps the session from expiring while it is used
+		::futimens(::dirfd(this->dir.get()), nullptr);
+	}
+
+	std::string build_cache::key(const std::shared_ptr<DIR> &workdir, const std::string &unit, const std::vector<std::string> &args) const {
+		// the sources are the client's, so the key must not collide even when they are made to
+		sha256 h;
+		h.field(std::to_string(args.size()));
+		for (const auto &a: args) h.field(a);
+
+		std::map<std::string, std::string> files;
+		std::vector<std::string> pending = { unit };
+		while (!pending.empty()) {
+			const auto path = std::move(pending.back());
+			pending.pop_back();
+			if (files.count(path) != 0) continue;
+			std::string content;
+			if (!read_file(workdir, path, content)) continue;
+			const auto slash = path.rfind('/');
+			const auto base = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+			for (const auto &inc: quoted_includes(content)) {
+				for (const auto &candidate: { normalize(base + inc), normalize(inc) }) {
+					if (!candidate.empty()) pending.push_back(candidate);
+				}
+			}
+			files.emplace(path, std::move(content));
+		}
+		for (const auto &f: files) {
+			h.field(f.first);
+			h.field(f.second);
+		}
+		return h.hex_digest();
+	}
+
+	bool build_cache::fetch(const std::string &key, const std::shared_ptr<DIR> &workdir, const std::string &object) const {
+		return ::linkat(::dirfd(dir.get()), (key + ".o").c_str(), ::dirfd(workdir.get()), ("store/" + object).c_str(), 0) == 0;
+	}
+
+	void build_cache::store(const std::string &key, const std::shared_ptr<DIR> &workdir, const std::string &object) const {
+		// the cached object is shared with later builds, so it must not be writable by the program
+		if (::fchmodat(::dirfd(workdir.get()), ("store/" + object).c_str(), 0400, 0) == -1) return;
+		::linkat(::dirfd(workdir.get()), ("store/" + object).c_str(), ::dirfd(dir.get()), (key + ".o").c_str(), 0);
+	}
+
+	std::string build_cache::normalize(const std::string &path) {
+		if (path.empty() || path[0] == '/') return {};
+		std::vector<std::string> parts, ret;
+		boost::algorithm::split(parts, path, boost::is_any_of("/"));
+		for (auto &p: parts) {
+			if (p.empty() || p == ".") continue;
+			if (p == "..") {
+				if (ret.empty()) return {};
+				ret.pop_back();
+			} else {
+				ret.push_back(std::move(p));
+			}
+		}
+		return boost::algorithm::join(ret, "/");
+	}
+}
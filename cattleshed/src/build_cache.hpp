@@ -0,0 +1,34 @@
+#ifndef BUILD_CACHE_HPP_
+#define BUILD_CACHE_HPP_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+
+namespace wandbox {
+	// object files of one build session, keyed by the translation unit, the flags it is compiled with
+	// and the contents of the local headers it includes. Sessions are named by the server: a client
+	// continues one by presenting the id it was given, and any other id starts a new session.
+	class build_cache {
+	public:
+		build_cache(const std::string &dir, const std::string &session, int ttl);
+		build_cache(const build_cache &) = delete;
+		build_cache &operator =(const build_cache &) = delete;
+
+		std::string key(const std::shared_ptr<DIR> &workdir, const std::string &unit, const std::vector<std::string> &args) const;
+		bool fetch(const std::string &key, const std::shared_ptr<DIR> &workdir, const std::string &object) const;
+		void store(const std::string &key, const std::shared_ptr<DIR> &workdir, const std::string &object) const;
+
+		// path relative to the store without '.' and '..', or empty if it leaves the store
+		static std::string normalize(const std::string &path);
+		// the id of the session, to be sent to the client
+		const std::string &session() const { return id; }
+	private:
+		std::shared_ptr<DIR> dir;
+		std::string id;
+	};
+}
+
+#endif
@@ -0,0 +1,31 @@
+#include "capture.hpp"
+
+#include <chrono>
+
+#include "posixapi.hpp"
+
+namespace wandbox {
+	capture_writer::capture_writer(std::string path)
+		 : path(std::move(path))
+	{
+	}
+
+	void capture_writer::record(const capture_record &r) const {
+		// one write per record, so that records of concurrent requests never interleave
+		const auto data = std::to_string(r.arrival) + " " + std::to_string(r.frames.size()) + "\n" + r.frames;
+		unique_fd fd(::open(path.c_str(), O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0600));
+		if (!fd) throw_system_error(errno);
+		if (::write(fd.get(), data.data(), data.size()) != static_cast<ssize_t>(data.size())) throw_system_error(errno);
+	}
+
+	bool read_capture_record(std::istream &is, capture_record &r) {
+		std::size_t len;
+		if (!(is >> r.arrival >> len) || is.get() != '\n') return false;
+		r.frames.assign(len, '\0');
+		return len == 0 || is.read(&r.frames[0], len);
+	}
+
+	std::int64_t capture_clock() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+}
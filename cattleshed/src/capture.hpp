@@ -0,0 +1,28 @@
+#ifndef CAPTURE_HPP_
+#define CAPTURE_HPP_
+
+#include <cstdint>
+#include <istream>
+#include <string>
+
+namespace wandbox {
+	// a capture file is a sequence of records, each a line "<arrival> <length>" (microseconds since the epoch, octets)
+	// followed by the frames of one request exactly as they were received.
+	struct capture_record {
+		std::int64_t arrival;
+		std::string frames;
+	};
+
+	class capture_writer {
+	public:
+		explicit capture_writer(std::string path);
+		void record(const capture_record &r) const;
+	private:
+		std::string path;
+	};
+
+	bool read_capture_record(std::istream &is, capture_record &r);
+	std::int64_t capture_clock();
+}
+
+#endif
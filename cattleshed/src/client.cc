@@ -0,0 +1,61 @@
+#include "client.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "quoted_printable.hpp"
+
+namespace wandbox {
+	unique_fd connect_to(const std::string &host, const std::string &port, int timeout) {
+		::addrinfo hints = {};
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		::addrinfo *res;
+		if (const int r = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) throw std::runtime_error(::gai_strerror(r));
+		const std::shared_ptr<::addrinfo> guard(res, &::freeaddrinfo);
+		for (auto p = res; p; p = p->ai_next) {
+			unique_fd fd(::socket(p->ai_family, p->ai_socktype|SOCK_CLOEXEC, p->ai_protocol));
+			if (!fd) continue;
+			::timeval tv = { timeout, 0 };
+			::setsockopt(fd.get(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			::setsockopt(fd.get(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			if (::connect(fd.get(), p->ai_addr, p->ai_addrlen) == 0) return fd;
+		}
+		throw_system_error(errno);
+	}
+
+	std::string send_all(int fd, const std::string &data) {
+		for (std::size_t off = 0; off < data.size(); ) {
+			const auto r = ::send(fd, data.data() + off, data.size() - off, MSG_NOSIGNAL);
+			if (r == -1 && errno == EINTR) continue;
+			if (r == -1) return std::string("send: ") + std::strerror(errno);
+			off += r;
+		}
+		return {};
+	}
+
+	bool next_frame(const std::string &frames, std::size_t &pos, std::string &command, std::string &data) {
+		const auto sp = frames.find(' ', pos);
+		if (sp == std::string::npos) return false;
+		const auto colon = frames.find(':', sp);
+		if (colon == std::string::npos) return false;
+		const auto len = std::strtoul(frames.c_str() + sp + 1, nullptr, 10);
+		if (frames.size() < colon + 1 + len + 1) return false;
+		command = frames.substr(pos, sp - pos);
+		data = frames.substr(colon + 1, len);
+		pos = colon + 1 + len + 1;
+		return true;
+	}
+
+	std::string make_frame(const std::string &command, const std::string &data) {
+		const auto encoded = quoted_printable::encode(data);
+		return command + " " + std::to_string(encoded.size()) + ":" + encoded + "\n";
+	}
+}
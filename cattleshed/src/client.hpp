@@ -0,0 +1,19 @@
+#ifndef CLIENT_HPP_
+#define CLIENT_HPP_
+
+#include <cstddef>
+#include <string>
+
+#include "posixapi.hpp"
+
+namespace wandbox {
+	// blocking helpers for the tools that talk to a running cattleshed
+	unique_fd connect_to(const std::string &host, const std::string &port, int timeout);
+	// empty on success, otherwise what failed
+	std::string send_all(int fd, const std::string &data);
+	// the frame at `pos' if it is complete, with its data still encoded
+	bool next_frame(const std::string &frames, std::size_t &pos, std::string &command, std::string &data);
+	std::string make_frame(const std::string &command, const std::string &data);
+}
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef FRAME_HPP_
+#define FRAME_HPP_
+
+#include <string>
+
+#include <boost/spirit/include/phoenix.hpp>
+#include <boost/spirit/include/qi.hpp>
+
+namespace wandbox {
+	// parses the "<command> <length>:<data>\n" frame at `ite' and moves `ite' past it.
+	// false if the frame is not complete yet; data is left encoded.
+	template <typename Iterator>
+	bool parse_frame(Iterator &ite, Iterator end, std::string &command, std::string &data) {
+		namespace phx = boost::phoenix;
+		namespace qi = boost::spirit::qi;
+		int len = 0;
+		return qi::parse(ite, end, +(qi::char_ - qi::space) >> qi::omit[*qi::space] >> qi::omit[qi::int_[phx::ref(len) = qi::_1]] >> qi::omit[':'] >> qi::repeat(phx::ref(len))[qi::char_] >> qi::omit[qi::eol], command, data);
+	}
+}
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef HANDLER_ARENA_HPP_
+#define HANDLER_ARENA_HPP_
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace wandbox {
+	// memory for the asio operations of one connection. each of the operations a connection has in
+	// flight at once keeps a block that is handed out again to the next one, so after the first round
+	// of reads and writes a completion allocates nothing. only used from the io_service thread.
+	class handler_arena {
+	public:
+		handler_arena(): blocks() { }
+		handler_arena(const handler_arena &) = delete;
+		handler_arena &operator =(const handler_arena &) = delete;
+		~handler_arena() {
+			for (auto &b: blocks) ::operator delete(b.p);
+		}
+
+		void *allocate(std::size_t size) {
+			block *fit = nullptr;
+			for (auto &b: blocks) {
+				if (b.used) continue;
+				if (b.size >= size) {
+					b.used = true;
+					return b.p;
+				}
+				if (!fit) fit = &b;
+			}
+			// more operations in flight than there are blocks
+			if (!fit) return ::operator new(size);
+			void *const p = ::operator new(size);
+			::operator delete(fit->p);
+			fit->p = p;
+			fit->size = size;
+			fit->used = true;
+			return fit->p;
+		}
+		void deallocate(void *p) {
+			for (auto &b: blocks) {
+				if (b.p == p) {
+					b.used = false;
+					return;
+				}
+			}
+			::operator delete(p);
+		}
+	private:
+		struct block {
+			block(): p(nullptr), size(0), used(false) { }
+			void *p;
+			std::size_t size;
+			bool used;
+		};
+		std::array<block, 8> blocks;
+	};
+
+	template <typename T>
+	struct arena_allocator {
+		typedef T value_type;
+		explicit arena_allocator(handler_arena &arena) noexcept: arena(&arena) { }
+		template <typename U>
+		arena_allocator(const arena_allocator<U> &other) noexcept: arena(other.arena) { }
+		T *allocate(std::size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T))); }
+		void deallocate(T *p, std::size_t) { arena->deallocate(p); }
+		template <typename U>
+		bool operator ==(const arena_allocator<U> &other) const noexcept { return arena == other.arena; }
+		template <typename U>
+		bool operator !=(const arena_allocator<U> &other) const noexcept { return arena != other.arena; }
+		handler_arena *arena;
+	};
+
+	// `handler' with its operation allocated from `arena', which it keeps alive until the operation is freed
+	template <typename Handler>
+	struct arena_handler {
+		typedef arena_allocator<void> allocator_type;
+		typedef void result_type;
+		arena_handler(std::shared_ptr<handler_arena> arena, Handler handler)
+			 : arena(std::move(arena)),
+			   handler(std::move(handler))
+		{ }
+		allocator_type get_allocator() const noexcept { return allocator_type(*arena); }
+		template <typename ...Args>
+		void operator ()(Args &&...args) { handler(std::forward<Args>(args)...); }
+
+		std::shared_ptr<handler_arena> arena;
+		Handler handler;
+	};
+
+	template <typename Handler>
+	arena_handler<typename std::decay<Handler>::type> in_arena(std::shared_ptr<handler_arena> arena, Handler &&handler) {
+		return arena_handler<typename std::decay<Handler>::type>(std::move(arena), std::forward<Handler>(handler));
+	}
+
+	// the state of one request, resumed by each of its asio operations. their handlers hold a plain pointer
+	// and take their memory from `arena', and the session keeps itself alive until the last handler it gave
+	// out is called. created with std::make_shared; a handler that is never called keeps it forever.
+	template <typename Derived>
+	class session: public std::enable_shared_from_this<Derived> {
+	public:
+		struct step_handler {
+			typedef arena_allocator<void> allocator_type;
+			typedef void result_type;
+			allocator_type get_allocator() const noexcept { return allocator_type(*static_cast<session &>(*self).arena); }
+			template <typename ...Args>
+			void operator ()(Args &&...args) {
+				const auto keep = static_cast<session &>(*self).resumed();
+				(*self)(std::forward<Args>(args)...);
+			}
+			Derived *self;
+		};
+		session(const session &) = delete;
+		session &operator =(const session &) = delete;
+	protected:
+		explicit session(std::shared_ptr<handler_arena> arena): arena(std::move(arena)), self(), outstanding(0) { }
+		// the handler of the next operation; small enough to be kept in a std::function without allocating
+		step_handler step() {
+			if (outstanding++ == 0) self = this->shared_from_this();
+			return step_handler{ static_cast<Derived *>(this) };
+		}
+		std::shared_ptr<handler_arena> arena;
+	private:
+		std::shared_ptr<Derived> resumed() {
+			const auto keep = self;
+			if (--outstanding == 0) self.reset();
+			return keep;
+		}
+		std::shared_ptr<Derived> self;
+		std::size_t outstanding;
+	};
+}
+
+#endif
@@ -0,0 +1,406 @@
+#include "http_api.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+namespace wandbox {
+	namespace {
+		struct json {
+			enum kind { null, boolean, number, string, object, array };
+			kind type = null;
+			bool b = false;
+			double num = 0;
+			std::string str;
+			std::vector<std::pair<std::string, json>> members;
+			std::vector<json> items;
+
+			const json *find(const std::string &key) const {
+				for (const auto &m: members) if (m.first == key) return &m.second;
+				return nullptr;
+			}
+		};
+
+		// just enough of json for request bodies; nesting is limited so that a body cannot exhaust the stack
+		struct json_reader {
+			json_reader(const std::string &s): p(s.data()), end(s.data() + s.size()) { }
+			bool read_document(json &v) {
+				if (!read(v, 0)) return false;
+				skip_space();
+				return p == end;
+			}
+		private:
+			void skip_space() {
+				while (p != end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) ++p;
+			}
+			bool literal(const char *s, std::size_t n) {
+				if (static_cast<std::size_t>(end - p) < n || !std::equal(s, s + n, p)) return false;
+				p += n;
+				return true;
+			}
+			bool read(json &v, int depth) {
+				if (depth > 32) return false;
+				skip_space();
+				if (p == end) return false;
+				switch (*p) {
+				case '{':
+					++p;
+					v.type = json::object;
+					skip_space();
+					if (p != end && *p == '}') return ++p, true;
+					while (true) {
+						std::string key;
+						json value;
+						skip_space();
+						if (!read_string(key)) return false;
+						skip_space();
+						if (p == end || *p++ != ':') return false;
+						if (!read(value, depth + 1)) return false;
+						v.members.emplace_back(std::move(key), std::move(value));
+						skip_space();
+						if (p == end) return false;
+						if (*p == '}') return ++p, true;
+						if (*p++ != ',') return false;
+					}
+				case '[':
+					++p;
+					v.type = json::array;
+					skip_space();
+					if (p != end && *p == ']') return ++p, true;
+					while (true) {
+						json value;
+						if (!read(value, depth + 1)) return false;
+						v.items.push_back(std::move(value));
+						skip_space();
+						if (p == end) return false;
+						if (*p == ']') return ++p, true;
+						if (*p++ != ',') return false;
+					}
+				case '"':
+					v.type = json::string;
+					return read_string(v.str);
+				case 't':
+					v.type = json::boolean;
+					v.b = true;
+					return literal("true", 4);
+				case 'f':
+					v.type = json::boolean;
+					return literal("false", 5);
+				case 'n':
+					return literal("null", 4);
+				default: {
+					const std::string rest(p, std::min<std::size_t>(end - p, 64));
+					char *e;
+					v.type = json::number;
+					v.num = std::strtod(rest.c_str(), &e);
+					if (e == rest.c_str()) return false;
+					p += e - rest.c_str();
+					return true;
+				}
+				}
+			}
+			bool hex4(unsigned &u) {
+				if (end - p < 4) return false;
+				u = 0;
+				for (int i = 0; i < 4; ++i) {
+					const char c = *p++;
+					if (!std::isxdigit(static_cast<unsigned char>(c))) return false;
+					u = u * 16 + (std::isdigit(static_cast<unsigned char>(c)) ? c - '0' : (std::tolower(c) - 'a' + 10));
+				}
+				return true;
+			}
+			bool read_string(std::string &s) {
+				if (p == end || *p++ != '"') return false;
+				while (p != end) {
+					const char c = *p++;
+					if (c == '"') return true;
+					if (c != '\\') {
+						s += c;
+						continue;
+					}
+					if (p == end) return false;
+					switch (*p++) {
+					case '"': s += '"'; break;
+					case '\\': s += '\\'; break;
+					case '/': s += '/'; break;
+					case 'b': s += '\b'; break;
+					case 'f': s += '\f'; break;
+					case 'n': s += '\n'; break;
+					case 'r': s += '\r'; break;
+					case 't': s += '\t'; break;
+					case 'u': {
+						unsigned u;
+						if (!hex4(u)) return false;
+						if (0xd800 <= u && u < 0xdc00) {
+							unsigned lo;
+							if (!literal("\\u", 2) || !hex4(lo) || lo < 0xdc00 || 0xe000 <= lo) return false;
+							u = 0x10000 + ((u - 0xd800) << 10) + (lo - 0xdc00);
+						}
+						if (u < 0x80) {
+							s += static_cast<char>(u);
+						} else if (u < 0x800) {
+							s += static_cast<char>(0xc0 | (u >> 6));
+							s += static_cast<char>(0x80 | (u & 0x3f));
+						} else if (u < 0x10000) {
+							s += static_cast<char>(0xe0 | (u >> 12));
+							s += static_cast<char>(0x80 | ((u >> 6) & 0x3f));
+							s += static_cast<char>(0x80 | (u & 0x3f));
+						} else {
+							s += static_cast<char>(0xf0 | (u >> 18));
+							s += static_cast<char>(0x80 | ((u >> 12) & 0x3f));
+							s += static_cast<char>(0x80 | ((u >> 6) & 0x3f));
+							s += static_cast<char>(0x80 | (u & 0x3f));
+						}
+						break;
+					}
+					default:
+						return false;
+					}
+				}
+				return false;
+			}
+
+			const char *p;
+			const char *end;
+		};
+
+		std::string quote(const std::string &s) {
+			std::string ret = "\"";
+			for (const char c: s) {
+				switch (c) {
+				case '"': ret += "\\\""; break;
+				case '\\': ret += "\\\\"; break;
+				case '\n': ret += "\\n"; break;
+				case '\r': ret += "\\r"; break;
+				case '\t': ret += "\\t"; break;
+				default:
+					if (static_cast<unsigned char>(c) < 0x20) {
+						char buf[8];
+						std::snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned char>(c));
+						ret += buf;
+					} else {
+						ret += c;
+					}
+				}
+			}
+			return ret + "\"";
+		}
+
+		const char *reason(int status) {
+			switch (status) {
+			case 200: return "OK";
+			case 400: return "Bad Request";
+			case 404: return "Not Found";
+			case 413: return "Payload Too Large";
+			case 431: return "Request Header Fields Too Large";
+			case 503: return "Service Unavailable";
+			default: return "Unknown";
+			}
+		}
+
+		// the keys of kennel's result, in the order they are first sent
+		class compile_json_encoder: public frame_encoder {
+		public:
+			compile_json_encoder(): kept(0) { }
+			std::string encode(const std::string &cmd, std::string data) {
+				if (cmd == "CompilerMessageS") {
+					append("compiler_output", data);
+					append("compiler_message", data);
+				} else if (cmd == "CompilerMessageE") {
+					append("compiler_error", data);
+					append("compiler_message", data);
+				} else if (cmd == "StdOut") {
+					append("program_output", data);
+					append("program_message", data);
+				} else if (cmd == "StdErr") {
+					append("program_error", data);
+					append("program_message", data);
+				} else if (cmd == "ExitCode") {
+					append("status", data);
+				} else if (cmd == "Signal") {
+					append("signal", data);
+				} else if (cmd == "BuildStatus") {
+					append("build_status", data);
+				} else if (cmd == "BuildSession") {
+					append("build_session", data);
+				} else if (cmd == "Rejected") {
+					append("rejected", data);
+				} else if (cmd == "Cached") {
+					raw.emplace_back("cached", "true");
+				} else if (cmd == "BenchmarkResult") {
+					kept += data.size();
+					raw.emplace_back("benchmark", std::move(data));
+				} else if (cmd == "CompileTrace") {
+					const auto pos = data.find('\n');
+					traces.push_back("{\"name\":" + quote(data.substr(0, pos)) + ",\"trace\":" + quote(pos == std::string::npos ? std::string() : data.substr(pos + 1)) + "}");
+					kept += traces.back().size();
+				} else if (cmd == "Control" && data == "Finish") {
+					return finish();
+				}
+				return std::string();
+			}
+			std::size_t buffered() const {
+				return kept;
+			}
+		private:
+			void append(const char *key, const std::string &data) {
+				auto it = std::find_if(strings.begin(), strings.end(), [key](const std::pair<std::string, std::string> &x) { return x.first == key; });
+				if (it == strings.end()) it = strings.insert(strings.end(), std::make_pair(std::string(key), std::string()));
+				it->second += data;
+				kept += data.size();
+			}
+			std::string finish() {
+				std::string body;
+				int status = 200;
+				for (const auto &s: strings) {
+					body += (body.empty() ? "{" : ",") + quote(s.first) + ":" + quote(s.second);
+					if (s.first == "rejected") status = 503;
+				}
+				for (const auto &r: raw) body += (body.empty() ? "{" : ",") + quote(r.first) + ":" + r.second;
+				if (!traces.empty()) {
+					body += (body.empty() ? "{" : ",") + std::string("\"compile_traces\":[");
+					for (const auto &t: traces) body += (&t == &traces.front() ? "" : ",") + t;
+					body += "]";
+				}
+				strings.clear();
+				raw.clear();
+				traces.clear();
+				kept = 0;
+				return http_response(status, "application/json", (body.empty() ? "{" : body) + "}");
+			}
+
+			std::vector<std::pair<std::string, std::string>> strings;
+			std::vector<std::pair<std::string, std::string>> raw;
+			std::vector<std::string> traces;
+			std::size_t kept;
+		};
+
+		class event_stream_encoder: public frame_encoder {
+		public:
+			event_stream_encoder(): started(false) { }
+			std::string encode(const std::string &cmd, std::string data) {
+				std::string ret;
+				if (!started) {
+					started = true;
+					ret = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\nConnection: close\r\n\r\n";
+				}
+				// a line break starts a new data field, which the client joins with a line break again
+				ret += "data: " + cmd + ":";
+				for (std::size_t i = 0; i < data.size(); ++i) {
+					if (data[i] == '\r' && i + 1 < data.size() && data[i+1] == '\n') ++i;
+					if (data[i] == '\r' || data[i] == '\n') ret += "\ndata:";
+					else ret += data[i];
+				}
+				return ret + "\n\n";
+			}
+		private:
+			bool started;
+		};
+
+		class list_encoder: public frame_encoder {
+		public:
+			std::string encode(const std::string &cmd, std::string data) {
+				if (cmd != "VersionResult") return std::string();
+				return http_response(200, "application/json", data);
+			}
+		};
+	}
+
+	bool http_request::parse(const std::string &head, http_request &req) {
+		auto eol = head.find("\r\n");
+		const auto line = head.substr(0, eol);
+		const auto sp1 = line.find(' ');
+		const auto sp2 = line.find(' ', sp1 == std::string::npos ? sp1 : sp1 + 1);
+		if (sp1 == std::string::npos || sp2 == std::string::npos || line.compare(sp2 + 1, 7, "HTTP/1.") != 0) return false;
+		req.method = line.substr(0, sp1);
+		req.target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+		// the query is not used by any endpoint
+		req.target = req.target.substr(0, req.target.find('?'));
+		req.headers.clear();
+		req.content_length = 0;
+		while (eol != std::string::npos) {
+			const auto begin = eol + 2;
+			eol = head.find("\r\n", begin);
+			const auto field = head.substr(begin, eol == std::string::npos ? std::string::npos : eol - begin);
+			const auto colon = field.find(':');
+			if (colon == std::string::npos || colon == 0) return false;
+			auto name = field.substr(0, colon);
+			std::transform(name.begin(), name.end(), name.begin(), [](char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+			auto value = field.substr(colon + 1);
+			value.erase(0, value.find_first_not_of(" \t"));
+			value.erase(value.find_last_not_of(" \t") + 1);
+			req.headers[name] = value;
+		}
+		const auto cl = req.headers.find("content-length");
+		if (cl != req.headers.end()) {
+			if (cl->second.empty() || cl->second.find_first_not_of("0123456789") != std::string::npos || cl->second.size() > 12) return false;
+			req.content_length = std::strtoull(cl->second.c_str(), nullptr, 10);
+		}
+		// there is no chunked request body to read
+		return req.headers.count("transfer-encoding") == 0;
+	}
+
+	std::string http_response(int status, const std::string &content_type, const std::string &body, const std::string &extra_headers) {
+		return "HTTP/1.1 " + std::to_string(status) + " " + reason(status) + "\r\nContent-Type: " + content_type + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n" + extra_headers + "\r\n" + body;
+	}
+
+	std::string http_error(int status, const std::string &message) {
+		return http_response(status, "application/json", "{\"error\":" + quote(message) + "}");
+	}
+
+	bool parse_compile_request(const std::string &body, std::unordered_map<std::string, std::string> &received, std::string &code, std::string &error) {
+		json v;
+		if (!json_reader(body).read_document(v) || v.type != json::object) {
+			error = "the body is not a json object";
+			return false;
+		}
+		const auto str = [&v](const char *key) {
+			const auto x = v.find(key);
+			return x && x->type == json::string ? x->str : std::string();
+		};
+		if (str("compiler").empty()) {
+			error = "compiler is not given";
+			return false;
+		}
+		const auto save = v.find("save");
+		if (save && save->type == json::boolean && save->b) {
+			error = "permlinks are saved by kennel";
+			return false;
+		}
+		received["Control"] = "compiler=" + str("compiler");
+		received["StdIn"] = str("stdin");
+		received["CompilerOptionRaw"] = str("compiler-option-raw");
+		received["RuntimeOptionRaw"] = str("runtime-option-raw");
+		received["CompilerOption"] = str("options");
+		code = str("code");
+		const auto session = v.find("build-session");
+		if (session && session->type == json::string) received["BuildSession"] = session->str;
+		const auto cache = v.find("cache-output");
+		if (cache && cache->type == json::boolean && cache->b) received["CacheOutput"] = "";
+		const auto bench = v.find("benchmark");
+		if (bench && bench->type == json::object) {
+			const auto num = [bench](const char *key, int def) {
+				const auto x = bench->find(key);
+				return x && x->type == json::number ? static_cast<int>(x->num) : def;
+			};
+			const auto perf = bench->find("perf");
+			received["Benchmark"] = "runs=" + std::to_string(num("runs", 10)) + ",warmup=" + std::to_string(num("warmup", 1)) + (perf && perf->type == json::boolean && perf->b ? ",perf" : "");
+		}
+		return true;
+	}
+
+	std::shared_ptr<frame_encoder> make_compile_json_encoder() {
+		return std::make_shared<compile_json_encoder>();
+	}
+
+	std::shared_ptr<frame_encoder> make_event_stream_encoder() {
+		return std::make_shared<event_stream_encoder>();
+	}
+
+	std::shared_ptr<frame_encoder> make_list_encoder() {
+		return std::make_shared<list_encoder>();
+	}
+}
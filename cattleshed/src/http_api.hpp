@@ -0,0 +1,46 @@
+#ifndef HTTP_API_HPP_
+#define HTTP_API_HPP_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace wandbox {
+	// the request line and headers of an http/1.1 request; header names are in lower case
+	struct http_request {
+		std::string method;
+		std::string target;
+		std::unordered_map<std::string, std::string> headers;
+		std::size_t content_length;
+
+		// `head' is everything before the empty line
+		static bool parse(const std::string &head, http_request &req);
+	};
+
+	// a complete response with `Connection: close'; the body is a json {"error":`message'} unless given
+	std::string http_response(int status, const std::string &content_type, const std::string &body, const std::string &extra_headers = std::string());
+	std::string http_error(int status, const std::string &message);
+
+	// the frames kennel would send for the json body of /api/compile.json: `received' holds them by
+	// Content-Specifier and `code' the Source. false with `error' set when the body is not such a request.
+	bool parse_compile_request(const std::string &body, std::unordered_map<std::string, std::string> &received, std::string &code, std::string &error);
+
+	// turns output frames into what is written to the client instead of the frames themselves
+	class frame_encoder {
+	public:
+		virtual ~frame_encoder() { }
+		virtual std::string encode(const std::string &cmd, std::string data) = 0;
+		// octets of the frames kept to be written with a later one
+		virtual std::size_t buffered() const { return 0; }
+	};
+
+	// the result of /api/compile.json, sent as one response on `Control Finish'
+	std::shared_ptr<frame_encoder> make_compile_json_encoder();
+	// every frame as a server-sent event `data: <Content-Specifier>:<content>', like kennel's /compile
+	std::shared_ptr<frame_encoder> make_event_stream_encoder();
+	// the VersionResult as the response of /api/list.json
+	std::shared_ptr<frame_encoder> make_list_encoder();
+}
+
+#endif
@@ -1,7 +1,9 @@
 #include "load_config.hpp"
 
+#include <limits>
 #include <map>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 #include <unordered_map>
@@ -30,7 +32,7 @@ namespace cfg {
 		std::string,
 		std::vector<boost::recursive_variant_>,
 		std::unordered_map<std::string, boost::recursive_variant_>,
-		int,
+		long long,
 		bool
 	>::type value;
 	typedef std::string string;
@@ -44,7 +46,7 @@ namespace cfg {
 		config_grammar(): qi::grammar<Iter, value(), qi::space_type>(top) {
 			namespace phx = boost::phoenix;
 			top %= (obj | arr) > qi::eoi;
-			val %= obj | arr | str | qi::int_ | qi::bool_;
+			val %= obj | arr | str | qi::long_long | qi::bool_;
 			pair %= str > ':' > val;
 			obj %= '{' > (((pair % ',') > -qi::lit(',')) | qi::eps) > '}';
 			arr %= '[' > (((val % ',') > -qi::lit(',')) | qi::eps) > ']';
@@ -94,7 +96,7 @@ namespace cfg {
 			os << "]";
 			return os;
 		}
-		std::ostream &operator ()(const int &i) const {
+		std::ostream &operator ()(const long long &i) const {
 			return os << i;
 		}
 		std::ostream &operator ()(const bool& bool_) const {
@@ -124,10 +126,16 @@ namespace cfg {
 			if (const auto &v = find(x, key)) return boost::get<cfg::string>(*v);
 			return {};
 		};
-		inline int get_int(const cfg::object &x, const cfg::string &key) {
-			if (const auto &v = find(x, key)) return boost::get<int>(*v);
+		// for sizes in octets, which may not fit in an int
+		inline long long get_int64(const cfg::object &x, const cfg::string &key) {
+			if (const auto &v = find(x, key)) return boost::get<long long>(*v);
 			return 0;
 		}
+		inline int get_int(const cfg::object &x, const cfg::string &key) {
+			const auto i = get_int64(x, key);
+			if (i < std::numeric_limits<int>::min() || std::numeric_limits<int>::max() < i) throw std::out_of_range("config value '" + key + "' is out of range");
+			return static_cast<int>(i);
+		}
 		inline bool get_bool(const cfg::object &x, const cfg::string &key) {
 			if (const auto &v = find(x, key)) return boost::get<bool>(*v);
 			return false;
@@ -141,6 +149,13 @@ namespace cfg {
 			}
 			return {};
 		}
+		inline std::vector<int> get_int_array(const cfg::object &x, const cfg::string &key) {
+			std::vector<int> ret;
+			if (const auto &v = find(x, key)) {
+				for (const auto &i: boost::get<cfg::array>(*v)) ret.push_back(static_cast<int>(boost::get<long long>(i)));
+			}
+			return ret;
+		}
 	}
 
 	compiler_set load_compiler_trait(const cfg::value &o) {
@@ -155,6 +170,23 @@ namespace cfg {
 			t.compile_command = get_str_array(y, "compile-command");
 			t.version_command = get_str_array(y, "version-command");
 			t.run_command = get_str_array(y, "run-command");
+			t.object_command = get_str_array(y, "object-command");
+			t.link_command = get_str_array(y, "link-command");
+			if (const auto &v = find(y, "stages")) {
+				for (const auto &s: boost::get<cfg::array>(*v)) {
+					const auto &z = boost::get<cfg::object>(s);
+					stage_trait st;
+					st.name = get_str(z, "name");
+					st.command = get_str_array(z, "command");
+					st.jail_name = get_str(z, "jail-name");
+					st.time_limit = get_int(z, "time-limit");
+					st.program_output = get_str(z, "output") == "program" || (st.name == "run" && get_str(z, "output").empty());
+					st.use_stdin = find(z, "stdin") ? get_bool(z, "stdin") : st.name == "run";
+					st.skip_if_exists = get_str(z, "skip-if-exists");
+					st.skip_unless_switch = get_str(z, "skip-unless-switch");
+					t.stages.push_back(std::move(st));
+				}
+			}
 			t.output_file = get_str(y, "output-file");
 			t.display_name = get_str(y, "display-name");
 			t.display_compile_command = get_str(y, "display-compile-command");
@@ -162,6 +194,7 @@ namespace cfg {
 			t.displayable = get_bool(y, "displayable");
 			t.compiler_option_raw = get_bool(y, "compiler-option-raw");
 			t.runtime_option_raw = get_bool(y, "runtime-option-raw");
+			t.cache_output = get_bool(y, "cache-output");
 			t.switches = get_str_array(y, "switches");
 			for (auto &x: get_str_array(y, "initial-checked")) t.initial_checked.insert(std::move(x));
 			const auto inherits = get_str_array(y, "inherits");
@@ -183,6 +216,9 @@ namespace cfg {
 				if (sub.compile_command.empty()) sub.compile_command = x.compile_command;
 				if (sub.version_command.empty()) sub.version_command = x.version_command;
 				if (sub.run_command.empty()) sub.run_command = x.run_command;
+				if (sub.object_command.empty()) sub.object_command = x.object_command;
+				if (sub.link_command.empty()) sub.link_command = x.link_command;
+				if (sub.stages.empty()) sub.stages = x.stages;
 				if (sub.output_file.empty()) sub.output_file = x.output_file;
 				if (sub.display_name.empty()) sub.display_name = x.display_name;
 				if (sub.display_compile_command.empty()) sub.display_compile_command = x.display_compile_command;
@@ -192,13 +228,23 @@ namespace cfg {
 			}
 			inherit_map.erase(sub.name);
 		}
+		// compilers without stages compile and run
+		for (auto ite = ret.begin(); ite != ret.end(); ++ite) {
+			if (!ite->stages.empty()) continue;
+			auto t = *ite;
+			t.stages = {
+				{ "compile", t.compile_command, "", 0, false, false, "", "" },
+				{ "run", t.run_command, "", 0, true, true, "", "" },
+			};
+			ret.replace(ite, t);
+		}
 		return ret;
 	}
 
 	system_config load_system_config(const cfg::value &values) {
 		using namespace detail;
 		const auto &o = boost::get<cfg::object>(boost::get<cfg::object>(values).at("system"));
-		return { get_int(o, "listen-port"), get_int(o, "max-connections"), get_str(o, "basedir"), get_str(o, "storedir") };
+		return { get_int(o, "listen-port"), get_int(o, "max-connections"), get_int(o, "max-queue"), get_str(o, "basedir"), get_str(o, "storedir"), get_str(o, "tracedir"), get_int(o, "trace-sample-rate"), get_int(o, "trace-slow-threshold"), get_str(o, "build-cache-dir"), get_int(o, "build-cache-ttl"), get_str(o, "output-cache-dir"), get_int(o, "output-cache-ttl"), get_str(o, "artifact-dir"), get_int(o, "artifact-ttl"), get_int64(o, "artifact-size-limit"), get_int64(o, "artifact-quota"), get_str(o, "capture-file"), get_int(o, "benchmark-max-runs"), get_int_array(o, "benchmark-cpus"), get_int64(o, "memory-budget"), get_int(o, "memory-wait"), get_str(o, "source-store-dir"), get_int(o, "source-store-ttl"), get_int(o, "http-port"), get_int(o, "raw-pipe-size"), get_int(o, "http-max-connections"), get_int(o, "http-max-queue"), get_int(o, "http-read-timeout") };
 	}
 
 	 std::unordered_map<std::string, jail_config> load_jail_config(const cfg::value &values) {
@@ -232,6 +278,7 @@ namespace cfg {
 			x.conflicts = get_str_array(s, "conflicts");
 			x.runtime = get_bool(s, "runtime");
 			x.insert_position = get_int(s, "insert-position");
+			x.collect = get_str_array(s, "collect");
 			ret[a.first] = std::move(x);
 		}
 		return ret;
@@ -392,7 +439,17 @@ namespace cfg {
 			os.insert(os.end(), x.begin(), x.end());
 		}
 		const auto o = merge_cfgs(os);
-		return { load_system_config(o), load_jail_config(o), load_compiler_trait(o), load_switches(o) };
+		server_config config{ load_system_config(o), load_jail_config(o), load_compiler_trait(o), load_switches(o) };
+		// every jail a run may be put in has to exist before the first run does
+		const auto check_jail = [&](const compiler_trait &c, const std::string &stage, const std::string &jail) {
+			if (config.jails.count(jail) != 0) return;
+			throw std::runtime_error("compiler '" + c.name + "'" + (stage.empty() ? "" : " stage '" + stage + "'") + " names unknown jail '" + jail + "'");
+		};
+		for (const auto &c: config.compilers) {
+			check_jail(c, "", c.jail_name);
+			for (const auto &s: c.stages) if (!s.jail_name.empty()) check_jail(c, s.name, s.jail_name);
+		}
+		return config;
 	}
 
 	template <typename Iter>
@@ -559,6 +616,7 @@ namespace cfg {
 				"\"display-compile-command\":\"" + json_stringize(compiler.display_compile_command) + "\","
 				"\"compiler-option-raw\":" + (compiler.compiler_option_raw ? "true" : "false") + ","
 				"\"runtime-option-raw\":" + (compiler.runtime_option_raw ? "true" : "false") + ","
+				"\"incremental-build\":" + (!compiler.object_command.empty() && !compiler.link_command.empty() ? "true" : "false") + ","
 				"\"switches\":[" + boost::algorithm::join(swlist, ",") + "]"
 			"}";
 	}
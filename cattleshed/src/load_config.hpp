@@ -24,6 +24,17 @@ namespace wandbox {
 		std::vector<std::string> conflicts;
 		bool runtime;
 		int insert_position;
+		std::vector<std::string> collect;
+	};
+	struct stage_trait {
+		std::string name;
+		std::vector<std::string> command;
+		std::string jail_name;
+		int time_limit;
+		bool program_output;
+		bool use_stdin;
+		std::string skip_if_exists;
+		std::string skip_unless_switch;
 	};
 	struct compiler_trait {
 		std::string name;
@@ -31,6 +42,9 @@ namespace wandbox {
 		std::vector<std::string> compile_command;
 		std::vector<std::string> version_command;
 		std::vector<std::string> run_command;
+		std::vector<std::string> object_command;
+		std::vector<std::string> link_command;
+		std::vector<stage_trait> stages;
 		std::string output_file;
 		std::string display_name;
 		std::string display_compile_command;
@@ -40,14 +54,39 @@ namespace wandbox {
 		bool displayable;
 		bool compiler_option_raw;
 		bool runtime_option_raw;
+		bool cache_output;
 	};
 	typedef mendex::multi_index_container<compiler_trait, mendex::indexed_by<mendex::sequenced<>, mendex::hashed_unique<mendex::member<compiler_trait, std::string, &compiler_trait::name>>>> compiler_set;
 
 	struct system_config {
 		int listen_port;
 		int max_connections;
+		int max_queue;
 		std::string basedir;
 		std::string storedir;
+		std::string tracedir;
+		int trace_sample_rate;
+		int trace_slow_threshold;
+		std::string build_cache_dir;
+		int build_cache_ttl;
+		std::string output_cache_dir;
+		int output_cache_ttl;
+		std::string artifact_dir;
+		int artifact_ttl;
+		long long artifact_size_limit;
+		long long artifact_quota;
+		std::string capture_file;
+		int benchmark_max_runs;
+		std::vector<int> benchmark_cpus;
+		long long memory_budget;
+		int memory_wait;
+		std::string source_store_dir;
+		int source_store_ttl;
+		int http_port;
+		int raw_pipe_size;
+		int http_max_connections;
+		int http_max_queue;
+		int http_read_timeout;
 	};
 
 	struct jail_config {
@@ -0,0 +1,64 @@
+#ifndef MEMORY_BUDGET_HPP_
+#define MEMORY_BUDGET_HPP_
+
+#include <atomic>
+#include <cstddef>
+
+namespace wandbox {
+	// octets held by the request and output buffers of the whole server; a limit of 0 is no limit
+	class memory_budget {
+	public:
+		memory_budget(): held(0), max(0) { }
+		memory_budget(const memory_budget &) = delete;
+		memory_budget &operator =(const memory_budget &) = delete;
+
+		void set_limit(std::size_t limit) { max = limit; }
+		std::size_t limit() const { return max; }
+		std::size_t used() const { return held; }
+		bool exhausted() const { return max != 0 && held >= max; }
+
+		// takes `n' octets if they fit
+		bool try_take(std::size_t n) {
+			auto cur = held.load();
+			do {
+				if (max != 0 && cur + n > max) return false;
+			} while (!held.compare_exchange_weak(cur, cur + n));
+			return true;
+		}
+		// takes `n' octets even if they do not fit, for data that is already there
+		void take(std::size_t n) { held += n; }
+		void give_back(std::size_t n) { held -= n; }
+	private:
+		std::atomic<std::size_t> held;
+		std::size_t max;
+	};
+
+	// octets one buffer took from a budget, given back when it is destroyed
+	class memory_lease {
+	public:
+		explicit memory_lease(memory_budget &budget): budget(budget), held(0) { }
+		memory_lease(const memory_lease &) = delete;
+		memory_lease &operator =(const memory_lease &) = delete;
+		~memory_lease() { budget.give_back(held); }
+
+		bool try_grow(std::size_t n) {
+			if (!budget.try_take(n)) return false;
+			held += n;
+			return true;
+		}
+		void grow(std::size_t n) {
+			budget.take(n);
+			held += n;
+		}
+		void shrink(std::size_t n) {
+			budget.give_back(n);
+			held -= n;
+		}
+		std::size_t size() const { return held; }
+	private:
+		memory_budget &budget;
+		std::size_t held;
+	};
+}
+
+#endif
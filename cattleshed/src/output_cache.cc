@@ -0,0 +1,90 @@
+#include "output_cache.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <fstream>
+
+#include "posixapi.hpp"
+#include "sha256.hpp"
+
+namespace wandbox {
+	output_cache::output_cache(const std::string &dir, int ttl)
+		 : dir(dir),
+		   ttl(ttl)
+	{
+	}
+
+	std::string output_cache::key(const std::shared_ptr<DIR> &workdir, const std::vector<std::string> &args, const std::string &input) const {
+		// the cache is shared by every client, so nobody may craft a run with the key of someone else's
+		sha256 h;
+		h.field(std::to_string(args.size()));
+		for (const auto &a: args) h.field(a);
+		h.field(input);
+
+		std::vector<std::string> files;
+		list_files_at(workdir, "store", files);
+		std::sort(files.begin(), files.end());
+		for (auto f: files) {
+			h.field(f);
+			f = "store/" + f;
+			struct ::stat st;
+			if (::fstatat(::dirfd(workdir.get()), f.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) throw_system_error(errno);
+			h.field(std::to_string(st.st_mode));
+			if (S_ISLNK(st.st_mode)) {
+				std::vector<char> buf(PATH_MAX);
+				const auto r = ::readlinkat(::dirfd(workdir.get()), f.c_str(), buf.data(), buf.size());
+				if (r == -1) throw_system_error(errno);
+				h.field(std::string(buf.data(), r));
+				continue;
+			}
+			if (!S_ISREG(st.st_mode)) continue;
+			unique_fd fd(::openat(::dirfd(workdir.get()), f.c_str(), O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK));
+			if (!fd) throw_system_error(errno);
+			sha256 content;
+			char buf[BUFSIZ];
+			while (true) {
+				const auto r = ::read(fd.get(), buf, sizeof(buf));
+				if (r == -1 && errno == EINTR) continue;
+				if (r == -1) throw_system_error(errno);
+				if (r == 0) break;
+				content.update(buf, r);
+			}
+			h.field(content.hex_digest());
+		}
+		return h.hex_digest();
+	}
+
+	bool output_cache::load(const std::string &key, recorded_frames &frames, int &status) const {
+		const auto path = dir + "/" + key;
+		struct ::stat st;
+		if (::stat(path.c_str(), &st) == -1) return false;
+		if (ttl > 0 && ::time(nullptr) - st.st_mtime > ttl) {
+			::unlink(path.c_str());
+			return false;
+		}
+		std::ifstream is(path, std::ios::binary);
+		if (!(is >> status) || is.get() != '\n') return false;
+		frames.clear();
+		std::string command;
+		std::size_t len;
+		while (is >> command >> len && is.get() == '\n') {
+			std::string data(len, '\0');
+			if (!is.read(&data[0], len)) return false;
+			frames.emplace_back(std::move(command), std::move(data));
+		}
+		return is.eof();
+	}
+
+	void output_cache::save(const std::string &key, const recorded_frames &frames, int status) const {
+		remove_files_older_than(dir, ttl);
+		write_file_atomically(dir + "/" + key, [&frames, status](std::ostream &os) {
+			os << status << '\n';
+			for (const auto &f: frames) {
+				os << f.first << ' ' << f.second.size() << '\n';
+				os.write(f.second.data(), f.second.size());
+			}
+		});
+	}
+
+}
@@ -0,0 +1,32 @@
+#ifndef OUTPUT_CACHE_HPP_
+#define OUTPUT_CACHE_HPP_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+
+namespace wandbox {
+	typedef std::vector<std::pair<std::string, std::string>> recorded_frames;
+
+	// output frames and exit status of deterministic runs, keyed by the files the program runs from,
+	// its command line and stdin.
+	class output_cache {
+	public:
+		output_cache(const std::string &dir, int ttl);
+		output_cache(const output_cache &) = delete;
+		output_cache &operator =(const output_cache &) = delete;
+
+		std::string key(const std::shared_ptr<DIR> &workdir, const std::vector<std::string> &args, const std::string &input) const;
+		bool load(const std::string &key, recorded_frames &frames, int &status) const;
+		void save(const std::string &key, const recorded_frames &frames, int status) const;
+	private:
+
+		std::string dir;
+		int ttl;
+	};
+}
+
+#endif
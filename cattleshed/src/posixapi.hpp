@@ -1,14 +1,25 @@
 #ifndef POSIXAPI_HPP_
 #define POSIXAPI_HPP_
 
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <memory>
+#include <string>
 #include <system_error>
 #include <vector>
 
+#include <boost/algorithm/string/classification.hpp>
+#include <boost/algorithm/string/split.hpp>
+
 #include <dirent.h>
 #include <fcntl.h>
 #include <libgen.h>
 #include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -137,18 +148,20 @@ namespace wandbox {
 	}
 
 	struct unique_child_pid {
-		explicit unique_child_pid(pid_t pid = 0): pid(pid), st(0), waited(false) { }
+		explicit unique_child_pid(pid_t pid = 0): pid(pid), st(0), waited(false), ru() { }
 		unique_child_pid(const unique_child_pid &) = delete;
-		unique_child_pid(unique_child_pid &&other): pid(0), st(0), waited(false) {
+		unique_child_pid(unique_child_pid &&other): pid(0), st(0), waited(false), ru() {
 			std::swap(pid, other.pid);
 			std::swap(st, other.st);
 			std::swap(waited, other.waited);
+			std::swap(ru, other.ru);
 		}
 		unique_child_pid &operator =(const unique_child_pid &) = delete;
 		unique_child_pid &operator =(unique_child_pid &&other) {
 			std::swap(pid, other.pid);
 			std::swap(st, other.st);
 			std::swap(waited, other.waited);
+			std::swap(ru, other.ru);
 			if (pid != other.pid) other.do_wait();
 			other.pid = 0;
 			other.st = 0;
@@ -167,19 +180,233 @@ namespace wandbox {
 		pid_t get() const noexcept { return pid; }
 		bool finished() const noexcept { return waited; }
 		bool empty() const noexcept { return pid == 0; }
+		// resources used by the child and the descendants it waited for, once it finished
+		const ::rusage &usage() const noexcept { return ru; }
 	private:
 		int do_wait(int flag = 0) {
 			if (waited) return st;
 			if (pid == 0) return 0;
-			if (::waitpid(pid, &st, flag) <= 0) return 0;
+			if (::wait4(pid, &st, flag, &ru) <= 0) return 0;
 			waited = true;
 			return st;
 		}
 		pid_t pid;
 		int st;
 		bool waited;
+		::rusage ru;
 	};
 
+	// passes `fds' to the process at the other end of the unix socket `sock', in one message
+	inline void send_fds(int sock, const std::vector<int> &fds) {
+		char byte = 0;
+		::iovec iov = { &byte, 1 };
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+		::msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		const auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+		std::memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+		if (::sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) throw_system_error(errno);
+	}
+	// the descriptors of a message sent by send_fds(), at least one and at most `max' of them
+	inline std::vector<unique_fd> receive_fds(int sock, std::size_t max) {
+		char byte;
+		::iovec iov = { &byte, 1 };
+		std::vector<char> control(CMSG_SPACE(sizeof(int) * max));
+		::msghdr msg = {};
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.data();
+		msg.msg_controllen = control.size();
+		const auto n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (n == -1) throw_system_error(errno);
+		const auto cmsg = CMSG_FIRSTHDR(&msg);
+		if (n == 0 || !cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len < CMSG_LEN(sizeof(int))) throw_system_error(EPROTO);
+		std::vector<unique_fd> fds;
+		for (std::size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(cmsg) + sizeof(int) * i, sizeof(int));
+			fds.emplace_back(fd);
+		}
+		// more descriptors than there was room for are closed by the kernel
+		if (msg.msg_flags & MSG_CTRUNC) throw_system_error(EPROTO);
+		return fds;
+	}
+
+	// regular files and links below `dir', relative to it
+	inline void list_files_at(const std::shared_ptr<DIR> &at, const std::string &dir, std::vector<std::string> &files, const std::string &prefix = std::string()) {
+		const auto d = opendirat(at, prefix.empty() ? dir : dir + "/" + prefix);
+		while (const auto ent = ::readdir(d.get())) {
+			const std::string name = ent->d_name;
+			if (name == "." || name == "..") continue;
+			const auto file = prefix.empty() ? name : prefix + "/" + name;
+			struct ::stat st;
+			if (::fstatat(::dirfd(d.get()), name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) throw_system_error(errno);
+			if (S_ISDIR(st.st_mode)) list_files_at(at, dir, files, file);
+			else files.push_back(file);
+		}
+	}
+
+	// entries of `dir' of file type `type' (S_IFREG, S_IFDIR, ...) last modified more than `ttl' seconds ago
+	inline std::vector<std::string> entries_older_than(const std::shared_ptr<DIR> &dir, ::mode_t type, std::time_t ttl) {
+		const auto now = ::time(nullptr);
+		std::vector<std::string> names;
+		::rewinddir(dir.get());
+		while (const auto ent = ::readdir(dir.get())) {
+			const std::string n = ent->d_name;
+			if (n == "." || n == "..") continue;
+			struct ::stat st;
+			if (::fstatat(::dirfd(dir.get()), n.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1 || (st.st_mode & S_IFMT) != type) continue;
+			if (now - st.st_mtime > ttl) names.push_back(n);
+		}
+		return names;
+	}
+
+	// removes the regular files of `dir' older than `ttl' seconds; `dir' is looked through at most once every `ttl' seconds
+	inline void remove_files_older_than(const std::string &dir, std::time_t ttl) {
+		static std::map<std::string, std::time_t> last_sweep;
+		const auto now = ::time(nullptr);
+		if (ttl <= 0 || now - last_sweep[dir] < ttl) return;
+		last_sweep[dir] = now;
+		try {
+			const auto d = opendir(dir);
+			for (const auto &n: entries_older_than(d, S_IFREG, ttl)) ::unlinkat(::dirfd(d.get()), n.c_str(), 0);
+		} catch (std::system_error &) {
+		}
+	}
+
+	// writes `path' by way of a temporary file renamed over it, so that a reader sees the whole of it or nothing
+	inline bool write_file_atomically(const std::string &path, const std::function<void (std::ostream &)> &write) {
+		const auto tmp = path + ".tmp" + std::to_string(::getpid());
+		{
+			std::ofstream os(tmp, std::ios::binary);
+			write(os);
+			os.close();
+			if (!os) {
+				::unlink(tmp.c_str());
+				return false;
+			}
+		}
+		if (::rename(tmp.c_str(), path.c_str()) == -1) {
+			::unlink(tmp.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	inline int recursive_link_at(int from_at, const std::string &from, int at, const std::string &filename, int dirmode) {
+		if (filename[0] == '/') return -1;
+
+		std::vector<std::string> dirs;
+		boost::algorithm::split(dirs, filename, boost::is_any_of("/"));
+
+		if (dirs.empty()) return -1;
+
+		const auto targetfile = std::move(dirs.back());
+		dirs.pop_back();
+
+		std::vector<int> dirfds;
+		const auto closeall = [&dirfds]() {
+			for (int fd: dirfds) ::close(fd);
+			dirfds.clear();
+		};
+		for (auto &&x: dirs) {
+			if (x == "") continue;
+			if (x == ".") continue;
+			if (x == "..") {
+				if (dirfds.empty()) return -1;
+				::close(dirfds.back());
+				dirfds.pop_back();
+			} else {
+				::mkdirat(dirfds.empty() ? at : dirfds.back(), x.c_str(), dirmode);
+				int dirfd = ::openat(dirfds.empty() ? at : dirfds.back(), x.c_str(), O_DIRECTORY|O_PATH|O_RDWR);
+				if (dirfd == -1) return closeall(), -1;
+				dirfds.push_back(dirfd);
+			}
+		}
+
+		errno = 0;
+		const int r = ::linkat(from_at, from.c_str(), dirfds.empty() ? at : dirfds.back(), targetfile.c_str(), 0);
+		const int e = errno;
+		closeall();
+		errno = e;
+		return r;
+	}
+
+	inline int recursive_create_open_at(int at, const std::string &filename, int flags, int dirmode, int filemode) {
+		// FIXME: must canonicalize invalid UTF-8 sequence in `filename'
+		if (filename[0] == '/') return -1;
+
+		std::vector<int> dirfds;
+		const auto closeall = [&dirfds]() {
+			for (int fd: dirfds) ::close(fd);
+			dirfds.clear();
+		};
+
+		std::vector<std::string> dirs;
+		boost::algorithm::split(dirs, filename, boost::is_any_of("/"));
+
+		if (dirs.empty()) return -1;
+
+		const auto targetfile = std::move(dirs.back());
+		dirs.pop_back();
+		errno = 0;
+		if (dirs.empty()) return ::openat(at, targetfile.c_str(), flags, filemode);
+
+		dirfds.reserve(dirs.size());
+
+		for (auto &&x: dirs) {
+			if (x == "") continue;
+			if (x == ".") continue;
+			if (x == "..") {
+				if (dirfds.empty()) return -1;
+				int fd = dirfds.back();
+				dirfds.pop_back();
+				::close(fd);
+			} else {
+				errno = 0;
+				::mkdirat(dirfds.empty() ? at : dirfds.back(), x.c_str(), dirmode);
+				int dirfd = ::openat(dirfds.empty() ? at : dirfds.back(), x.c_str(), O_DIRECTORY|O_PATH|O_RDWR);
+				if (dirfd == -1) return closeall(), -1;
+				dirfds.push_back(dirfd);
+			}
+		}
+
+		errno = 0;
+		int newfd = ::openat(dirfds.empty() ? at : dirfds.back(), targetfile.c_str(), flags, filemode);
+		closeall();
+		return newfd;
+	}
+
+	// a copy of the regular file `from' with its permission bits, creating the directories of `filename'
+	inline int recursive_copy_at(int from_at, const std::string &from, int at, const std::string &filename, int dirmode) {
+		unique_fd in(::openat(from_at, from.c_str(), O_RDONLY|O_CLOEXEC|O_NOFOLLOW));
+		if (!in) return -1;
+		struct ::stat st;
+		if (::fstat(in.get(), &st) == -1) return -1;
+		if (!S_ISREG(st.st_mode)) return errno = EINVAL, -1;
+		unique_fd out(recursive_create_open_at(at, filename, O_WRONLY|O_CLOEXEC|O_CREAT|O_EXCL, dirmode, st.st_mode & 0777));
+		if (!out) return -1;
+		char buf[BUFSIZ];
+		while (true) {
+			const auto r = ::read(in.get(), buf, sizeof(buf));
+			if (r == -1 && errno == EINTR) continue;
+			if (r == -1) return -1;
+			if (r == 0) return 0;
+			for (ssize_t done = 0; done < r; ) {
+				const auto w = ::write(out.get(), buf + done, r - done);
+				if (w == -1 && errno == EINTR) continue;
+				if (w == -1) return -1;
+				done += w;
+			}
+		}
+	}
+
 	struct child_process {
 		unique_child_pid pid;
 		unique_fd fd_stdin;
@@ -187,12 +414,23 @@ namespace wandbox {
 		unique_fd fd_stderr;
 	};
 
-	inline child_process piped_spawn(const std::shared_ptr<DIR> &workdir, const std::vector<std::string> &argv) {
+	// `before_exec', if given, is called with the pid of the child, which does not exec until it returned
+	inline child_process piped_spawn(const std::shared_ptr<DIR> &workdir, const std::vector<std::string> &argv, const std::function<void (pid_t)> &before_exec = nullptr) {
 		auto pipe_stdin = pipe();
 		auto pipe_stdout = pipe();
 		auto pipe_stderr = pipe();
+		auto gate = before_exec ? pipe() : unique_pipe{ unique_fd(-1), unique_fd(-1) };
 		if (const auto pid = fork()) {
-			return { unique_child_pid(pid), std::move(pipe_stdin.w), std::move(pipe_stdout.r), std::move(pipe_stderr.r) };
+			child_process c = { unique_child_pid(pid), std::move(pipe_stdin.w), std::move(pipe_stdout.r), std::move(pipe_stderr.r) };
+			gate.r.reset();
+			if (before_exec) try {
+				before_exec(pid);
+			} catch (...) {
+				gate.w.reset();
+				throw;
+			}
+			// closing the gate lets the child go on
+			return c;
 		} else try {
 			chdir(workdir);
 			dup2(pipe_stdin.r, 0);
@@ -204,6 +442,12 @@ namespace wandbox {
 			pipe_stdout.w.reset();
 			pipe_stderr.r.reset();
 			pipe_stderr.w.reset();
+			if (before_exec) {
+				char c;
+				gate.w.reset();
+				while (::read(gate.r.get(), &c, 1) == -1 && errno == EINTR) ;
+				gate.r.reset();
+			}
 			execv(argv);
 		} catch (...) {
 			std::terminate();
@@ -1,6 +1,5 @@
 #include <boost/spirit/include/qi.hpp>
 #include <boost/spirit/include/phoenix.hpp>
-#include <boost/spirit/include/karma.hpp>
 
 #include "quoted_printable.hpp"
 
@@ -8,19 +7,34 @@ namespace wandbox {
 namespace quoted_printable {
 
 	namespace qi = boost::spirit::qi;
-	namespace karma = boost::spirit::karma;
 
 	std::string decode(const std::string &r) {
 		auto ite = r.begin();
 		std::string ret;
-		qi::parse(ite, r.end(), *(qi::omit[qi::lit('\n')] | (qi::char_ - '=') | (qi::lit("=\n")) | (qi::lit('=') > qi::uint_parser<char, 16, 2, 2>())), ret);
+		qi::parse(ite, r.end(), *(qi::omit[qi::lit('\n')] | (qi::char_ - '=') | (qi::lit("=\n")) | (qi::lit('=') > qi::uint_parser<unsigned char, 16, 2, 2>())), ret);
 		return ret;
 	}
 	std::string encode(const std::string &r) {
-		if (r.begin() == r.end()) return {};
 		std::string ret;
-		karma::generate(back_inserter(ret), karma::repeat(1, 76)[&karma::char_('=') << "=3D" | karma::print | ('=' << karma::upper[karma::right_align(2, '0')[karma::uint_generator<unsigned char, 16>()]])] % "=\n", r);
+		encode(r.data(), r.size(), ret);
 		return ret;
 	}
+	// by hand rather than with karma, whose right_align allocates a buffer for every escaped octet
+	void encode(const char *data, std::size_t len, std::string &out) {
+		static const char hex[] = "0123456789ABCDEF";
+		out.reserve(out.size() + len + len / 76 * 2);
+		for (std::size_t i = 0; i < len; ++i) {
+			// a soft line break after every 76 input octets
+			if (i != 0 && i % 76 == 0) out += "=\n";
+			const unsigned char c = data[i];
+			if (c != '=' && ' ' <= c && c <= '~') {
+				out += static_cast<char>(c);
+			} else {
+				out += '=';
+				out += hex[c >> 4];
+				out += hex[c & 0xf];
+			}
+		}
+	}
 }
 }
@@ -1,12 +1,15 @@
 #ifndef QUOTED_PRINTABLE_HPP_
 #define QUOTED_PRINTABLE_HPP_
 
+#include <cstddef>
 #include <string>
 
 namespace wandbox {
 namespace quoted_printable {
 	std::string decode(const std::string &r);
 	std::string encode(const std::string &r);
+	// appends the encoding of [data, data+len) to `out', so a buffer reused across calls stops allocating
+	void encode(const char *data, std::size_t len, std::string &out);
 }
 }
 
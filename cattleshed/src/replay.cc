@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+#include <sys/socket.h>
+
+#include "capture.hpp"
+#include "client.hpp"
+#include "quoted_printable.hpp"
+
+namespace wandbox {
+	namespace {
+		typedef std::chrono::steady_clock steady;
+
+		struct outcome {
+			std::string compiler;
+			double latency;
+			std::string error;
+		};
+
+		// name of the compiler the request selects, as cattleshed reads it from the Control frames
+		std::string request_label(const std::string &frames) {
+			std::size_t pos = 0;
+			std::string command, data;
+			while (next_frame(frames, pos, command, data)) {
+				if (command == "Version") return "(version)";
+				data = quoted_printable::decode(data);
+				if (command == "Control" && data.compare(0, 9, "compiler=") == 0) return data.substr(9);
+				if (command == "Control" && data.compare(0, 8, "execute ") == 0) return "(execute)";
+			}
+			return "(unknown)";
+		}
+
+		// sends the request and reads until the untagged Control Finish (or VersionResult)
+		std::string replay_one(const std::string &host, const std::string &port, int timeout, const std::string &frames) {
+			try {
+				const auto fd = connect_to(host, port, timeout);
+				const auto error = send_all(fd.get(), frames);
+				if (!error.empty()) return error;
+				std::string received;
+				std::size_t pos = 0;
+				std::string command, data;
+				char buf[BUFSIZ];
+				while (true) {
+					while (next_frame(received, pos, command, data)) {
+						if (command == "VersionResult" || (command == "Control" && data == "Finish")) return {};
+					}
+					const auto r = ::recv(fd.get(), buf, sizeof(buf), 0);
+					if (r == -1 && errno == EINTR) continue;
+					if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return "timed out";
+					if (r == -1) return std::string("recv: ") + std::strerror(errno);
+					if (r == 0) return "connection closed before Finish";
+					received.append(buf, r);
+				}
+			} catch (std::exception &e) {
+				return std::string("connect: ") + e.what();
+			}
+		}
+
+		double percentile(std::vector<double> &v, double p) {
+			if (v.empty()) return 0;
+			std::sort(v.begin(), v.end());
+			const auto n = static_cast<std::size_t>(p / 100 * (v.size() - 1) + 0.5);
+			return v[std::min(n, v.size() - 1)];
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	using namespace wandbox;
+	namespace po = boost::program_options;
+
+	std::string capture_file;
+	std::string host = "127.0.0.1";
+	std::string port = "2012";
+	double speed = 1;
+	int concurrency = 64;
+	int timeout = 120;
+	{
+		po::options_description opt("options");
+		opt.add_options()
+			("help,h", "show this help")
+			("host", po::value<std::string>(&host), "cattleshed host (default: 127.0.0.1)")
+			("port,p", po::value<std::string>(&port), "cattleshed port (default: 2012)")
+			("speed,s", po::value<double>(&speed), "replay at this multiple of the captured arrival rate, 0 for as fast as possible (default: 1)")
+			("concurrency,j", po::value<int>(&concurrency), "maximum requests in flight (default: 64)")
+			("timeout,t", po::value<int>(&timeout), "seconds to wait for a reply (default: 120)")
+			("capture", po::value<std::string>(&capture_file), "capture file written by cattleshed (capture-file)")
+		;
+		po::positional_options_description pos;
+		pos.add("capture", 1);
+
+		po::variables_map vm;
+		po::store(po::command_line_parser(argc, argv).options(opt).positional(pos).run(), vm);
+		po::notify(vm);
+
+		if (vm.count("help") || capture_file.empty() || concurrency <= 0 || speed < 0) {
+			std::cout << "usage: cattleshed-replay [options] capture-file" << std::endl << opt << std::endl;
+			return vm.count("help") ? 0 : 1;
+		}
+	}
+
+	std::vector<capture_record> records;
+	{
+		std::ifstream is(capture_file, std::ios::binary);
+		if (!is) {
+			std::cerr << "failed to open " << capture_file << std::endl;
+			return 1;
+		}
+		capture_record r;
+		while (read_capture_record(is, r)) records.push_back(r);
+	}
+	if (records.empty()) {
+		std::cerr << "no requests in " << capture_file << std::endl;
+		return 1;
+	}
+	std::stable_sort(records.begin(), records.end(), [](const capture_record &a, const capture_record &b) { return a.arrival < b.arrival; });
+
+	std::vector<outcome> outcomes(records.size());
+	std::atomic<std::size_t> next(0);
+	const auto started = steady::now();
+	const auto first_arrival = records.front().arrival;
+	std::vector<std::thread> workers;
+	for (int i = 0; i < concurrency; ++i) workers.emplace_back([&] {
+		while (true) {
+			const auto n = next++;
+			if (n >= records.size()) return;
+			if (speed > 0) std::this_thread::sleep_until(started + std::chrono::microseconds(static_cast<std::int64_t>((records[n].arrival - first_arrival) / speed)));
+			const auto begin = steady::now();
+			auto error = replay_one(host, port, timeout, records[n].frames);
+			outcomes[n] = { request_label(records[n].frames), std::chrono::duration<double, std::milli>(steady::now() - begin).count(), std::move(error) };
+		}
+	});
+	for (auto &w: workers) w.join();
+	const auto elapsed = std::chrono::duration<double>(steady::now() - started).count();
+
+	std::map<std::string, std::vector<double>> latencies;
+	std::map<std::string, std::size_t> errors;
+	std::map<std::string, std::size_t> error_kinds;
+	for (const auto &o: outcomes) {
+		if (o.error.empty()) {
+			latencies[o.compiler].push_back(o.latency);
+		} else {
+			++errors[o.compiler];
+			++error_kinds[o.error];
+		}
+	}
+	std::size_t total_errors = 0;
+	for (const auto &e: errors) total_errors += e.second;
+
+	std::printf("requests: %zu in %.3f s, %.2f req/s, errors: %zu\n", records.size(), elapsed, records.size() / elapsed, total_errors);
+	std::printf("%-32s %8s %8s %10s %10s %10s %10s\n", "compiler", "ok", "errors", "p50 ms", "p90 ms", "p99 ms", "max ms");
+	std::map<std::string, bool> labels;
+	for (const auto &l: latencies) labels[l.first] = true;
+	for (const auto &e: errors) labels[e.first] = true;
+	for (const auto &l: labels) {
+		auto &v = latencies[l.first];
+		std::printf("%-32s %8zu %8zu %10.1f %10.1f %10.1f %10.1f\n", l.first.c_str(), v.size(), errors[l.first], percentile(v, 50), percentile(v, 90), percentile(v, 99), percentile(v, 100));
+	}
+	for (const auto &e: error_kinds) std::printf("error: %s (%zu)\n", e.first.c_str(), e.second);
+	return total_errors == 0 ? 0 : 2;
+}
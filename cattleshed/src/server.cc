@@ -1,4 +1,5 @@
 #include <array>
+#include <chrono>
 #include <deque>
 #include <functional>
 #include <mutex>
@@ -13,19 +14,31 @@
 #include <boost/asio.hpp>
 #include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <boost/fusion/include/std_pair.hpp>
-#include <boost/spirit/include/phoenix.hpp>
 #include <boost/spirit/include/qi.hpp>
 #include <boost/program_options.hpp>
 #include <boost/system/system_error.hpp>
 
 #include <aio.h>
+#include <fnmatch.h>
 #include <syslog.h>
 #include <sys/eventfd.h>
+#include <sys/ioctl.h>
 
+#include "artifact_store.hpp"
+#include "benchmark.hpp"
+#include "build_cache.hpp"
+#include "capture.hpp"
+#include "frame.hpp"
 #include "quoted_printable.hpp"
 #include "load_config.hpp"
+#include "memory_budget.hpp"
+#include "output_cache.hpp"
+#include "http_api.hpp"
+#include "socket_write_buffer.hpp"
+#include "source_store.hpp"
 #include "posixapi.hpp"
 #include "syslogstream.hpp"
+#include "trace.hpp"
 #include "yield.hpp"
 
 #define PROTECT_FROM_MOVE(member) const auto member = this->member
@@ -38,7 +51,6 @@
 namespace wandbox {
 	namespace asio = boost::asio;
 	namespace ptime = boost::posix_time;
-	namespace phx = boost::phoenix;
 	namespace qi = boost::spirit::qi;
 
 	using std::size_t;
@@ -53,10 +65,14 @@ namespace wandbox {
 
 	server_config config;
 	bool be_verbose;
+	memory_budget memory;
 
 	struct counting_semaphore {
 		counting_semaphore(asio::io_service &aio, unsigned count)
-			 : aio(aio),
+			 : capacity(count),
+			   running(0),
+			   queued(0),
+			   aio(aio),
 			   des(std::make_shared<asio::posix::stream_descriptor>(aio))
 		{
 			const int fd = ::eventfd(count, EFD_CLOEXEC|EFD_NONBLOCK|EFD_SEMAPHORE);
@@ -94,86 +110,113 @@ namespace wandbox {
 		std::shared_ptr<void> async_signal(F &&f) {
 			return std::make_shared<semaphore_object>(aio, des, std::forward<F>(f));
 		}
+		template <typename F>
+		struct counted_handler {
+			void operator ()() {
+				--sem->queued;
+				++sem->running;
+				*acquired = true;
+				f();
+			}
+			F f;
+			counting_semaphore *sem;
+			std::shared_ptr<bool> acquired;
+		};
+		// like async_signal, but counted in `queued' until the slot is taken and in `running' while it is held
+		template <typename F>
+		std::shared_ptr<void> async_acquire(F &&f) {
+			const auto acquired = std::make_shared<bool>(false);
+			++queued;
+			const auto slot = async_signal(counted_handler<typename std::decay<F>::type>{ std::forward<F>(f), this, acquired });
+			return std::shared_ptr<void>(slot.get(), [this, acquired, slot](void *) {
+				if (*acquired) --running;
+				else --queued;
+			});
+		}
+		const unsigned capacity;
+		unsigned running;
+		unsigned queued;
 	private:
 		asio::io_service &aio;
 		std::shared_ptr<asio::posix::stream_descriptor> des;
 	};
 
-	struct socket_write_buffer: std::enable_shared_from_this<socket_write_buffer> {
-		socket_write_buffer(std::shared_ptr<tcp::socket> sock)
-			 : sock(move(sock)),
-			   front_handlers(),
-			   back_handlers(),
-			   front_buf(),
-			   back_buf(),
-			   writing(false),
-			   mtx()
-		{ }
-		template <typename Handler>
-		void async_write_command(std::string cmd, std::string data, Handler &&handler) {
-			std::unique_lock<std::recursive_mutex> l(mtx);
-			data = quoted_printable::encode(move(data));
-			back_buf.emplace_back(cmd + " " + std::to_string(data.length()) + ":" + data + "\n");
-			back_handlers.emplace_back(std::forward<Handler>(handler));
-			flush();
-		}
-		void on_wrote() {
-			std::unique_lock<std::recursive_mutex> l(mtx);
-			for (const auto &x: front_handlers) x();
-			writing = false;
-			front_buf.clear();
-			front_handlers.clear();
-			if (!back_handlers.empty()) flush();
-		}
-		void flush() {
-			std::unique_lock<std::recursive_mutex> l(mtx);
-			if (!writing) {
-				std::swap(front_handlers, back_handlers);
-				std::swap(front_buf, back_buf);
-				std::vector<asio::const_buffer> b;
-				for (const auto &x: front_buf) {
-					b.push_back(asio::buffer(x));
-				}
-				async_write(*sock, b, std::bind<void>(std::mem_fn(&socket_write_buffer::on_wrote), shared_from_this()));
-				back_buf = {};
-				back_handlers = {};
-				writing = true;
-			}
-		}
+	struct batch_state {
+		explicit batch_state(size_t remaining): remaining(remaining) { }
+		size_t remaining;
+	};
+
+	// the runs of a Benchmark request: `warmup' unmeasured runs, then `runs' measured ones
+	struct benchmark_state {
+		benchmark_options opts;
+		std::shared_ptr<int> cpu;
+		int started;
+		std::unique_ptr<perf_counters> counters;
+		std::vector<benchmark_sample> samples;
+		std::vector<std::string> unavailable;
+	};
+
+	struct batch_job {
+		std::string id;
+		compiler_trait target_compiler;
+		std::unordered_map<std::string, std::string> received;
+		bool precompiled;
+	};
 
+	// what the stages of one connection share: the socket, the frames queued for it, and the signals, the
+	// slots and the trace of the server
+	struct connection {
+		connection(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, std::shared_ptr<asio::signal_set> sigs, std::shared_ptr<counting_semaphore> sem, std::shared_ptr<trace_recorder> trace)
+			 : aio(move(aio)),
+			   sock(move(sock)),
+			   sockbuf(std::make_shared<socket_write_buffer>(this->sock, memory)),
+			   sigs(move(sigs)),
+			   sem(move(sem)),
+			   trace(move(trace))
+		{
+		}
+		connection(const connection &) = delete;
+		connection &operator =(const connection &) = delete;
+		std::shared_ptr<asio::io_service> aio;
 		std::shared_ptr<tcp::socket> sock;
-		std::vector<std::function<void()>> front_handlers;
-		std::vector<std::function<void()>> back_handlers;
-		std::vector<std::string> front_buf;
-		std::vector<std::string> back_buf;
-		bool writing;
-		std::recursive_mutex mtx;
+		// its arena holds the operations of every stage
+		std::shared_ptr<socket_write_buffer> sockbuf;
+		std::shared_ptr<asio::signal_set> sigs;
+		std::shared_ptr<counting_semaphore> sem;
+		std::shared_ptr<trace_recorder> trace;
 	};
 
-	struct program_runner: private coroutine {
+	struct program_runner: session<program_runner>, private coroutine {
 		typedef void result_type;
 		struct command_type {
+			std::string name;
 			std::vector<std::string> arguments;
 			std::string stdin_command;
 			std::string stdout_command;
 			std::string stderr_command;
 			int soft_kill_wait;
+			std::string cache_key;
+			std::string object_file;
+			std::string skip_if_exists;
 		};
 		struct pipe_forwarder_base: boost::noncopyable {
 			virtual bool closed() const noexcept = 0;
 			virtual void async_forward(std::function<void ()>) noexcept = 0;
 		};
 		struct status_forwarder: pipe_forwarder_base {
-			status_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<asio::signal_set> sigs, unique_child_pid &&pid)
+			status_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<asio::signal_set> sigs, std::shared_ptr<handler_arena> arena, unique_child_pid &&pid)
 				 : aio(move(aio)),
 				   sigs(move(sigs)),
-				   pid(move(pid))
+				   arena(move(arena)),
+				   pid(move(pid)),
+				   started(std::chrono::steady_clock::now()),
+				   finished()
 			{ }
 			bool closed() const noexcept override {
 				return pid.finished();
 			}
 			void async_forward(std::function<void ()> handler) noexcept override {
-				sigs->async_wait(std::bind<void>(&status_forwarder::wait_handler, ref(*this), handler));
+				sigs->async_wait(in_arena(arena, std::bind<void>(&status_forwarder::wait_handler, ref(*this), handler)));
 			}
 			int get_status() noexcept {
 				return pid.wait_nonblock();
@@ -183,16 +226,28 @@ namespace wandbox {
 			}
 			void wait_handler(std::function<void ()> handler) {
 				pid.wait_nonblock();
-				if (not pid.finished()) async_forward(handler);
-				else handler();
+				if (not pid.finished()) return async_forward(handler);
+				finished = std::chrono::steady_clock::now();
+				handler();
+			}
+			// seconds from the start until the process was reaped
+			double wall() const noexcept {
+				return std::chrono::duration<double>(finished - started).count();
+			}
+			const ::rusage &usage() const noexcept {
+				return pid.usage();
 			}
 			std::shared_ptr<asio::io_service> aio;
 			std::shared_ptr<asio::signal_set> sigs;
+			std::shared_ptr<handler_arena> arena;
 			unique_child_pid pid;
+			std::chrono::steady_clock::time_point started;
+			std::chrono::steady_clock::time_point finished;
 		};
 		struct input_forwarder: pipe_forwarder_base {
-			input_forwarder(std::shared_ptr<asio::io_service> aio, unique_fd &&fd, std::string input)
+			input_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<handler_arena> arena, unique_fd &&fd, std::string input)
 				 : aio(move(aio)),
+				   arena(move(arena)),
 				   pipe(*this->aio),
 				   input(move(input))
 			{
@@ -203,13 +258,14 @@ namespace wandbox {
 				return !pipe.is_open();
 			}
 			void async_forward(std::function<void ()> handler) noexcept override {
-				async_write(pipe, asio::buffer(input), std::bind<void>(&input_forwarder::on_wrote, ref(*this), handler));
+				async_write(pipe, asio::buffer(input), in_arena(arena, std::bind<void>(&input_forwarder::on_wrote, ref(*this), handler)));
 			}
 			void on_wrote(std::function<void ()> handler) {
 				pipe.close();
 				handler();
 			}
 			std::shared_ptr<asio::io_service> aio;
+			std::shared_ptr<handler_arena> arena;
 			asio::posix::stream_descriptor pipe;
 			std::string input;
 		};
@@ -232,13 +288,15 @@ namespace wandbox {
 			std::weak_ptr<status_forwarder> proc;
 		};
 		struct output_forwarder: pipe_forwarder_base, private coroutine {
-			output_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, unique_fd &&fd, std::string command, std::shared_ptr<write_limit_counter> limit)
+			output_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<socket_write_buffer> sockbuf, unique_fd &&fd, std::string command, std::shared_ptr<write_limit_counter> limit, std::shared_ptr<std::string> captured = nullptr, std::shared_ptr<recorded_frames> recording = nullptr)
 				 : aio(move(aio)),
-				   sockbuf(std::make_shared<socket_write_buffer>(move(sock))),
+				   sockbuf(move(sockbuf)),
 				   pipe(*this->aio),
 				   command(move(command)),
 				   buf(),
-				   limit(move(limit))
+				   limit(move(limit)),
+				   captured(move(captured)),
+				   recording(move(recording))
 			{
 				pipe.assign(fd.get());
 				fd.release();
@@ -253,16 +311,25 @@ namespace wandbox {
 			void operator ()(error_code ec = error_code(), size_t len = 0) {
 				reenter (this) while (true) {
 					buf.resize(BUFSIZ);
-					yield pipe.async_read_some(asio::buffer(buf), ref(*this));
+					yield pipe.async_read_some(asio::buffer(buf), in_arena(sockbuf->arena, ref(*this)));
 					if (ec) {
 						pipe.close();
-						if (handler) aio->post(move(handler));
+						if (handler) aio->post(in_arena(sockbuf->arena, move(handler)));
 						handler = {};
 						yield break;
 					}
+					if (captured) {
+						captured->append(buf.begin(), buf.begin() + len);
+						if (auto l = limit.lock()) l->add(len);
+						continue;
+					}
 					yield {
-						std::string t(buf.begin(), buf.begin() + len);
-						sockbuf->async_write_command(command, move(t), ref(*this));
+						if (recording) {
+							const auto kind = command.substr(0, command.find('@'));
+							if (!recording->empty() && recording->back().first == kind) recording->back().second.append(buf.data(), len);
+							else recording->emplace_back(kind, std::string(buf.data(), len));
+						}
+						sockbuf->async_write_command(command, buf.data(), len, ref(*this));
 						if (auto l = limit.lock()) l->add(len);
 					}
 				}
@@ -274,42 +341,114 @@ namespace wandbox {
 			std::vector<char> buf;
 			std::function<void ()> handler;
 			std::weak_ptr<write_limit_counter> limit;
+			std::shared_ptr<std::string> captured;
+			std::shared_ptr<recorded_frames> recording;
 		};
 
-		program_runner(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, std::unordered_map<std::string, std::string> received, std::shared_ptr<asio::signal_set> sigs, std::shared_ptr<DIR> workdir, compiler_trait target_compiler,std::shared_ptr<void> semaphore)
-			 : aio(move(aio)),
-			   strand(std::make_shared<asio::io_service::strand>(*this->aio)),
-			   sock(move(sock)),
-			   sockbuf(std::make_shared<socket_write_buffer>(this->sock)),
+		// the output of the program as it is, moved from the pipe to the socket by the kernel without being read
+		struct raw_output_forwarder: pipe_forwarder_base, private coroutine {
+			raw_output_forwarder(std::shared_ptr<asio::io_service> aio, std::shared_ptr<socket_write_buffer> sockbuf, unique_fd &&fd, std::string command, std::shared_ptr<write_limit_counter> limit)
+				 : aio(move(aio)),
+				   sockbuf(move(sockbuf)),
+				   pipe(*this->aio),
+				   command(move(command)),
+				   available(0),
+				   limit(move(limit))
+			{
+				pipe.assign(fd.get());
+				fd.release();
+				// the program runs ahead of a slow client for longer, and each splice moves more
+				if (config.system.raw_pipe_size > 0) ::fcntl(pipe.native_handle(), F_SETPIPE_SZ, config.system.raw_pipe_size);
+			}
+			bool closed() const noexcept override {
+				return !pipe.is_open();
+			}
+			void async_forward(std::function<void ()> handler) noexcept override {
+				this->handler = move(handler);
+				(*this)();
+			}
+			void operator ()(error_code ec = error_code()) {
+				reenter (this) while (true) {
+					yield pipe.async_wait(asio::posix::stream_descriptor::wait_read, in_arena(sockbuf->arena, ref(*this)));
+					// readable with nothing to read is the end of the output
+					if (ec || ::ioctl(pipe.native_handle(), FIONREAD, &available) == -1 || available <= 0) {
+						pipe.close();
+						if (handler) aio->post(in_arena(sockbuf->arena, move(handler)));
+						handler = {};
+						yield break;
+					}
+					yield {
+						sockbuf->async_splice_command(command, pipe.native_handle(), available, ref(*this));
+						if (auto l = limit.lock()) l->add(available);
+					}
+				}
+			}
+			std::shared_ptr<asio::io_service> aio;
+			std::shared_ptr<socket_write_buffer> sockbuf;
+			asio::posix::stream_descriptor pipe;
+			std::string command;
+			int available;
+			std::function<void ()> handler;
+			std::weak_ptr<write_limit_counter> limit;
+		};
+
+		// `channel', `lane', `batch', `precompiled', `cases' and `prepare' are set before it is started
+		program_runner(std::shared_ptr<connection> conn, std::unordered_map<std::string, std::string> received, std::shared_ptr<DIR> workdir, compiler_trait target_compiler, std::shared_ptr<void> semaphore)
+			 : session(conn->sockbuf->arena),
+			   conn(move(conn)),
 			   received(move(received)),
-			   sigs(move(sigs)),
 			   workdir(move(workdir)),
 			   pipes(),
-			   kill_timer(std::make_shared<asio::deadline_timer>(*this->aio)),
+			   open_pipes(0),
+			   kill_timer(std::make_shared<asio::deadline_timer>(*this->conn->aio)),
 			   jail(config.jails.at(target_compiler.jail_name)),
 			   limitter(std::make_shared<write_limit_counter>(jail.output_limit_warn, jail.output_limit_kill)),
-			   target_compiler(target_compiler),
+			   target_compiler(move(target_compiler)),
 			   laststatus(0),
-			   semaphore(move(semaphore))
+			   semaphore(move(semaphore)),
+			   command_span(0),
+			   channel(),
+			   lane(0),
+			   batch(),
+			   precompiled(false),
+			   cases(),
+			   prepare(false),
+			   handle(),
+			   captured_stdout(),
+			   captured_stderr(),
+			   build(),
+			   build_status(),
+			   outputs(),
+			   output_key(),
+			   recording(),
+			   replay(),
+			   replayed(0),
+			   bench(),
+			   collect_patterns(),
+			   sources(),
+			   collected(),
+			   sent_files(0)
 		{
 		}
-		program_runner(const program_runner &) = default;
-		program_runner &operator =(const program_runner &) = default;
-		program_runner(program_runner &&) = default;
-		program_runner &operator =(program_runner &&) = default;
 
 		void operator ()(error_code ec = error_code(), size_t = 0) {
 			reenter (this) {
-				std::clog << "[" << sock.get() << "]" << "running program with '" << target_compiler.name << "' [" << this << "]" << std::endl;
+				std::clog << "[" << conn->sock.get() << "]" << "running program with '" << target_compiler.name << "'" << (channel.empty() ? "" : " for batch " + channel) << " [" << this << "]" << std::endl;
 				{
 					namespace qi = boost::spirit::qi;
 
-					auto ccargs = target_compiler.compile_command;
-					auto progargs = target_compiler.run_command;
+					// compiler options go to the compile stage, runtime options to the run stage
+					const auto stage_command = [this](const std::string &name) {
+						for (const auto &s: target_compiler.stages) if (s.name == name) return s.command;
+						return std::vector<std::string>();
+					};
+					auto ccargs = stage_command("compile");
+					auto progargs = stage_command("run");
+					std::vector<std::string> ccflags;
 
+					std::unordered_set<std::string> selected_switches;
 					const auto it = received.find("CompilerOption");
 					if (it != received.end()) {
-						std::unordered_set<std::string> selected_switches;
 						{
 							auto ite = it->second.begin();
 							qi::parse(ite, it->second.end(), qi::as_string[+(qi::char_-','-'\n')] % ',', selected_switches);
@@ -323,10 +462,12 @@ namespace wandbox {
 								if (ite->second.insert_position == 0) {
 									args.insert(args.end(), ite->second.flags.begin(), ite->second.flags.end());
 								} else {
-									args.insert(args.begin() + ite->second.insert_position, ite->second.flags.begin(), ite->second.flags.end());
+									args.insert(args.begin() + std::min<std::size_t>(ite->second.insert_position, args.size()), ite->second.flags.begin(), ite->second.flags.end());
 								}
 							};
 							f(ite->second.runtime ? progargs : ccargs);
+							if (!ite->second.runtime) ccflags.insert(ccflags.end(), ite->second.flags.begin(), ite->second.flags.end());
+							if (!precompiled) collect_patterns.insert(collect_patterns.end(), ite->second.collect.begin(), ite->second.collect.end());
 						}
 					}
 
@@ -341,122 +482,424 @@ namespace wandbox {
 								s.pop_back();
 							}
 							x.second->insert(x.second->end(), s.begin(), s.end());
+							if (x.second == &ccargs) ccflags.insert(ccflags.end(), s.begin(), s.end());
 						}
 					}
 
-					ccargs.insert(ccargs.begin(), jail.jail_command.begin(), jail.jail_command.end());
-					progargs.insert(progargs.begin(), jail.jail_command.begin(), jail.jail_command.end());
-					commands = {
-						{ move(ccargs), "", "CompilerMessageS", "CompilerMessageE", jail.compile_time_limit },
-						{ move(progargs), "StdIn", "StdOut", "StdErr", jail.program_duration }
-					};
+					commands.clear();
+					for (const auto &s: target_compiler.stages) {
+						// stages without a command (e.g. compiling an interpreted language) do not start a jail at all
+						if (s.command.empty()) continue;
+						if (!s.skip_unless_switch.empty() && selected_switches.count(s.skip_unless_switch) == 0) continue;
+						auto args = s.name == "compile" ? move(ccargs) : s.name == "run" ? move(progargs) : s.command;
+						const auto &j = s.jail_name.empty() ? jail : config.jails.at(s.jail_name);
+						args.insert(args.begin(), j.jail_command.begin(), j.jail_command.end());
+						const auto limit = s.time_limit != 0 ? s.time_limit : s.program_output ? j.program_duration : j.compile_time_limit;
+						commands.push_back({ s.name, move(args), s.use_stdin ? "StdIn" : "", tagged(s.program_output ? "StdOut" : "CompilerMessageS"), tagged(s.program_output ? "StdErr" : "CompilerMessageE"), limit, "", "", s.skip_if_exists });
+					}
+					if (!precompiled && received.count("BuildSession") != 0 && !config.system.build_cache_dir.empty() && !target_compiler.object_command.empty() && !target_compiler.link_command.empty()) {
+						try {
+							plan_incremental_build(move(ccflags));
+						} catch (std::system_error &e) {
+							std::clog << "[" << conn->sock.get() << "]" << "incremental build is not available: " << e.what() << " [" << this << "]" << std::endl;
+						}
+					}
+					if (!collect_patterns.empty()) try {
+						list_files_at(workdir, "store", sources);
+					} catch (std::system_error &e) {
+						std::clog << "[" << conn->sock.get() << "]" << "failed to list source files: " << e.what() << " [" << this << "]" << std::endl;
+						collect_patterns.clear();
+					}
+					// test cases are compiled here once and run by runners of their own
+					const auto is_run = [](const command_type &c) { return c.name == "run"; };
+					if (!cases.empty() || prepare) commands.erase(std::remove_if(commands.begin(), commands.end(), is_run), commands.end());
+					if (precompiled) commands.erase(std::remove_if(commands.begin(), commands.end(), [&](const command_type &c) { return !is_run(c); }), commands.end());
+					const auto run = std::find_if(commands.begin(), commands.end(), is_run);
+					if (received.count("Benchmark") != 0 && config.system.benchmark_max_runs > 0 && !batch && run != commands.end()) {
+						bench = std::make_shared<benchmark_state>();
+						bench->opts = benchmark_options::parse(received["Benchmark"], config.system.benchmark_max_runs);
+						bench->started = 0;
+						commands.insert(std::next(run), bench->opts.warmup + bench->opts.runs - 1, *run);
+					}
+					if (received.count("ExpectedOutput") != 0) {
+						captured_stdout = std::make_shared<std::string>();
+						captured_stderr = std::make_shared<std::string>();
+					} else if (!bench && !config.system.output_cache_dir.empty() && (target_compiler.cache_output || received.count("CacheOutput") != 0)) {
+						outputs = std::make_shared<output_cache>(config.system.output_cache_dir, config.system.output_cache_ttl);
+					}
 				}
 
-				yield {
-					PROTECT_FROM_MOVE(strand);
-					PROTECT_FROM_MOVE(sockbuf);
-					sockbuf->async_write_command("Control", "Start", strand->wrap(move(*this)));
-				}
+				yield conn->sockbuf->async_write_command(tagged("Control"), "Start", step());
+				if (!build_status.empty()) yield conn->sockbuf->async_write_command(tagged("BuildSession"), build->session(), step());
+				if (!build_status.empty()) yield conn->sockbuf->async_write_command(tagged("BuildStatus"), build_status, step());
 
 				while (!commands.empty()) {
+					// the socket is closed once a write to the client failed; nobody is left to read what the rest would send
+					if (!conn->sock->is_open()) {
+						std::clog << "[" << conn->sock.get() << "]" << "the client is gone, skipping " << commands.size() << " commands [" << this << "]" << std::endl;
+						break;
+					}
 					current = move(commands.front());
 					commands.pop_front();
+					if (!current.skip_if_exists.empty() && ::faccessat(::dirfd(workdir.get()), ("store/" + current.skip_if_exists).c_str(), F_OK, AT_SYMLINK_NOFOLLOW) == 0) continue;
+					if (outputs && current.name == "run") {
+						try {
+							output_key = outputs->key(workdir, current.arguments, received["StdIn"]);
+						} catch (std::system_error &e) {
+							std::clog << "[" << conn->sock.get() << "]" << "output is not cached: " << e.what() << " [" << this << "]" << std::endl;
+							outputs.reset();
+						}
+					}
+					if (outputs && current.name == "run" && outputs->load(output_key, replay, laststatus)) {
+						yield conn->sockbuf->async_write_command(tagged("Cached"), output_key, step());
+						for (replayed = 0; replayed < replay.size(); ++replayed) yield conn->sockbuf->async_write_command(tagged(replay[replayed].first), replay[replayed].second, step());
+						continue;
+					}
+					if (outputs && current.name == "run") recording = std::make_shared<recorded_frames>();
 					{
-						auto c = piped_spawn(workdir, current.arguments);
+						command_span = conn->trace->begin(current.name, lane);
+						const bool measured = bench && current.name == "run";
+						auto c = piped_spawn(workdir, current.arguments, measured ? start_benchmark_run() : nullptr);
+						// only the first run of a benchmark sends its output, and the output limits apply to each run
+						const auto discarded = measured && bench->started > 1 ? std::make_shared<std::string>() : nullptr;
+						if (measured) limitter->current = 0;
 
+						// output that is only passed on can go to the client unencoded
+						std::shared_ptr<pipe_forwarder_base> out;
+						if (received.count("RawOutput") != 0 && current.stdout_command == "StdOut" && !conn->sockbuf->encoder && !discarded && !(current.name == "run" && (captured_stdout || recording))) {
+							out = std::make_shared<raw_output_forwarder>(conn->aio, conn->sockbuf, move(c.fd_stdout), "StdOutRaw", limitter);
+						} else {
+							out = std::make_shared<output_forwarder>(conn->aio, conn->sockbuf, move(c.fd_stdout), current.stdout_command, limitter, discarded ? discarded : current.name == "run" ? captured_stdout : nullptr, current.name == "run" ? recording : nullptr);
+						}
 						pipes = {
-							std::make_shared<input_forwarder>(aio, move(c.fd_stdin), received[current.stdin_command]),
-							std::make_shared<output_forwarder>(aio, sock, move(c.fd_stdout), current.stdout_command, limitter),
-							std::make_shared<output_forwarder>(aio, sock, move(c.fd_stderr), current.stderr_command, limitter),
-							std::make_shared<status_forwarder>(aio, sigs, move(c.pid)),
+							std::make_shared<input_forwarder>(conn->aio, arena, move(c.fd_stdin), received[current.stdin_command]),
+							out,
+							std::make_shared<output_forwarder>(conn->aio, conn->sockbuf, move(c.fd_stderr), current.stderr_command, limitter, discarded ? discarded : current.name == "run" ? captured_stderr : nullptr, current.name == "run" ? recording : nullptr),
+							std::make_shared<status_forwarder>(conn->aio, conn->sigs, arena, move(c.pid)),
 						};
 						limitter->set_process(std::static_pointer_cast<status_forwarder>(pipes[3]));
 					}
-					fork pipes[0]->async_forward(strand->wrap(*this));
-					if (is_child()) goto wait_process_killed;
-					fork pipes[1]->async_forward(strand->wrap(*this));
-					if (is_child()) goto wait_process_killed;
-					fork pipes[2]->async_forward(strand->wrap(*this));
-					if (is_child()) goto wait_process_killed;
-					fork pipes[3]->async_forward(strand->wrap(*this));
-					if (is_child()) goto wait_process_killed;
-
-					kill_timer->expires_from_now(ptime::seconds(current.soft_kill_wait));
-					yield {
-						PROTECT_FROM_MOVE(strand);
-						PROTECT_FROM_MOVE(kill_timer);
-						kill_timer->async_wait(strand->wrap(move(*this)));
-					}
-					if (ec) yield break;
-					std::static_pointer_cast<status_forwarder>(pipes[3])->kill(SIGXCPU);
-
-					kill_timer->expires_from_now(ptime::seconds(jail.kill_wait));
-					yield {
-						PROTECT_FROM_MOVE(strand);
-						PROTECT_FROM_MOVE(kill_timer);
-						kill_timer->async_wait(strand->wrap(move(*this)));
-					}
-					if (ec) yield break;
-					std::static_pointer_cast<status_forwarder>(pipes[3])->kill(SIGKILL);
-
-					yield break;
-
-				wait_process_killed:
-					if (not std::all_of(pipes.begin(), pipes.end(), [](std::shared_ptr<pipe_forwarder_base> p) { return p->closed(); })) yield break;
+					for (const auto &p: pipes) p->async_forward(step());
+					start_kill_timer(current.soft_kill_wait);
+					// every forwarder resumes the runner once, when its pipe is closed or its process is reaped
+					for (open_pipes = pipes.size(); open_pipes != 0; --open_pipes) yield;
 					kill_timer->cancel(ec);
+					conn->trace->end(command_span);
 					laststatus = std::static_pointer_cast<status_forwarder>(pipes[3])->get_status();
+					if (bench && current.name == "run") record_benchmark_run();
+					// before the program runs, so that files it writes are not taken for the compiler's
+					if (!collect_patterns.empty() && !commands.empty() && commands.front().name == "run") collect_files();
+					if (!current.cache_key.empty() && WIFEXITED(laststatus) && (WEXITSTATUS(laststatus) == 0)) build->store(current.cache_key, workdir, current.object_file);
+					// runs stopped by a limit depend on timing, so only complete runs are cached
+					if (recording && current.name == "run" && WIFEXITED(laststatus) && limitter->current <= limitter->soft_limit) outputs->save(output_key, *recording, laststatus);
 					if (!WIFEXITED(laststatus) || (WEXITSTATUS(laststatus) != 0)) break;
 				}
-				if (WIFEXITED(laststatus)) yield {
-					PROTECT_FROM_MOVE(strand);
-					PROTECT_FROM_MOVE(sockbuf);
-					sockbuf->async_write_command("ExitCode", std::to_string(WEXITSTATUS(laststatus)), strand->wrap(move(*this)));
+				if (!cases.empty() && WIFEXITED(laststatus) && WEXITSTATUS(laststatus) == 0) {
+					return launch_cases();
 				}
-				if (WIFSIGNALED(laststatus)) yield {
-					PROTECT_FROM_MOVE(strand);
-					PROTECT_FROM_MOVE(sockbuf);
-					sockbuf->async_write_command("Signal", ::strsignal(WTERMSIG(laststatus)), strand->wrap(move(*this)));
+				if (prepare && WIFEXITED(laststatus) && WEXITSTATUS(laststatus) == 0) keep_artifact();
+				if (bench && bench->started != 0) yield {
+					const auto data = benchmark_result(bench->opts, bench->cpu ? *bench->cpu : -1, bench->samples, bench->unavailable);
+					bench->cpu.reset();
+					conn->sockbuf->async_write_command(tagged("BenchmarkResult"), data, step());
 				}
-				std::clog << "[" << sock.get() << "]" << "finished [" << this << "]" << std::endl;
-				yield {
-					PROTECT_FROM_MOVE(strand);
-					PROTECT_FROM_MOVE(sockbuf);
-					sockbuf->async_write_command("Control", "Finish", strand->wrap(move(*this)));
+				if (!collect_patterns.empty()) collect_files();
+				for (sent_files = 0; sent_files < collected.size(); ++sent_files) yield conn->sockbuf->async_write_command(tagged("CompileTrace"), collected[sent_files].first + "\n" + collected[sent_files].second, step());
+				if (!handle.empty()) yield conn->sockbuf->async_write_command("Handle", handle, step());
+				if (WIFEXITED(laststatus)) yield conn->sockbuf->async_write_command(tagged("ExitCode"), std::to_string(WEXITSTATUS(laststatus)), step());
+				if (WIFSIGNALED(laststatus)) yield conn->sockbuf->async_write_command(tagged("Signal"), ::strsignal(WTERMSIG(laststatus)), step());
+				if (captured_stdout) {
+					// the output of a test case is only sent when it is not accepted
+					if (verdict() != "Accepted") {
+						if (!captured_stdout->empty()) yield conn->sockbuf->async_write_command(tagged("StdOut"), *captured_stdout, step());
+						if (!captured_stderr->empty()) yield conn->sockbuf->async_write_command(tagged("StdErr"), *captured_stderr, step());
+					}
+					yield conn->sockbuf->async_write_command(tagged("Verdict"), verdict(), step());
 				}
+				std::clog << "[" << conn->sock.get() << "]" << "finished [" << this << "]" << std::endl;
+				yield conn->sockbuf->async_write_command(tagged("Control"), "Finish", step());
+				if (batch && --batch->remaining == 0) yield conn->sockbuf->async_write_command("Control", "Finish", step());
 			}
 		}
 
-		std::shared_ptr<asio::io_service> aio;
-		std::shared_ptr<asio::io_service::strand> strand;
-		std::shared_ptr<tcp::socket> sock;
-		std::shared_ptr<socket_write_buffer> sockbuf;
+		std::string tagged(const std::string &command) const {
+			if (channel.empty()) return command;
+			return command + "@" + channel;
+		}
+		std::string verdict() const {
+			if (!WIFEXITED(laststatus) || (WEXITSTATUS(laststatus) != 0)) return "RuntimeError";
+			// trailing whitespace is not significant
+			const auto trimmed = [](const std::string &s) { return s.substr(0, s.find_last_not_of(" \t\r\n") + 1); };
+			return trimmed(*captured_stdout) == trimmed(received.at("ExpectedOutput")) ? "Accepted" : "WrongAnswer";
+		}
+		void launch_cases();
+		// SIGXCPU when the command is still running after `soft_kill_wait' seconds, SIGKILL kill-wait seconds later.
+		// the timer is cancelled when the command is finished, and its handler holds nothing of the runner.
+		void start_kill_timer(int soft_kill_wait) {
+			const auto proc = std::static_pointer_cast<status_forwarder>(pipes[3]);
+			const auto timer = kill_timer;
+			const auto arena = this->arena;
+			const auto kill_wait = jail.kill_wait;
+			kill_timer->expires_from_now(ptime::seconds(soft_kill_wait));
+			kill_timer->async_wait(in_arena(arena, [proc, timer, arena, kill_wait](error_code ec) {
+				if (ec) return;
+				proc->kill(SIGXCPU);
+				timer->expires_from_now(ptime::seconds(kill_wait));
+				timer->async_wait(in_arena(arena, [proc](error_code ec) { if (!ec) proc->kill(SIGKILL); }));
+			}));
+		}
+		// the cpu is reserved for the first run and kept until the result is sent
+		std::function<void (pid_t)> start_benchmark_run() {
+			if (bench->started++ == 0) bench->cpu = reserve_cpu(config.system.benchmark_cpus);
+			bench->counters.reset(bench->opts.perf ? new perf_counters() : nullptr);
+			const auto b = bench;
+			const auto s = conn->sock;
+			return [b, s](pid_t pid) {
+				if (b->cpu) try {
+					pin_to_cpu(pid, *b->cpu);
+				} catch (std::system_error &e) {
+					std::clog << "[" << s.get() << "]" << "benchmark runs are not pinned to cpu " << *b->cpu << ": " << e.what() << std::endl;
+					b->cpu.reset();
+				}
+				if (b->counters) b->counters->open(pid);
+			};
+		}
+		// files the compiler added to the store matching the `collect' patterns of the selected switches
+		void collect_files() {
+			std::vector<std::string> files;
+			try {
+				list_files_at(workdir, "store", files);
+			} catch (std::system_error &e) {
+				std::clog << "[" << conn->sock.get() << "]" << "failed to list compiled files: " << e.what() << " [" << this << "]" << std::endl;
+				return collect_patterns.clear();
+			}
+			for (const auto &f: files) {
+				if (std::find(sources.begin(), sources.end(), f) != sources.end()) continue;
+				if (std::none_of(collect_patterns.begin(), collect_patterns.end(), [&f](const std::string &p) { return ::fnmatch(p.c_str(), f.c_str(), 0) == 0; })) continue;
+				unique_fd fd(::openat(::dirfd(workdir.get()), ("store/" + f).c_str(), O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK));
+				struct ::stat st;
+				if (!fd || ::fstat(fd.get(), &st) == -1 || !S_ISREG(st.st_mode)) continue;
+				if (static_cast<std::size_t>(st.st_size) > static_cast<std::size_t>(jail.output_limit_kill)) {
+					std::clog << "[" << conn->sock.get() << "]" << "'" << f << "' is too large to send [" << this << "]" << std::endl;
+					continue;
+				}
+				std::string data;
+				char buf[BUFSIZ];
+				for (ssize_t r; (r = ::read(fd.get(), buf, sizeof(buf))) > 0; ) data.append(buf, r);
+				collected.emplace_back(f, move(data));
+			}
+			collect_patterns.clear();
+		}
+		void record_benchmark_run() {
+			const auto proc = std::static_pointer_cast<status_forwarder>(pipes[3]);
+			const auto seconds = [](const ::timeval &tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+			if (bench->counters) bench->unavailable = bench->counters->unavailable();
+			// warmups and failed runs are not measured
+			if (bench->started > bench->opts.warmup && WIFEXITED(laststatus) && WEXITSTATUS(laststatus) == 0) {
+				const auto &ru = proc->usage();
+				bench->samples.push_back({ proc->wall(), seconds(ru.ru_utime), seconds(ru.ru_stime), ru.ru_maxrss, bench->counters ? bench->counters->read() : std::vector<std::pair<std::string, double>>() });
+			}
+			bench->counters.reset();
+		}
+		void keep_artifact() {
+			if (config.system.artifact_dir.empty()) return;
+			try {
+				handle = artifact_store(config.system.artifact_dir, config.system.artifact_ttl, config.system.artifact_size_limit, config.system.artifact_quota).keep(workdir, target_compiler.name);
+				if (handle.empty()) std::clog << "[" << conn->sock.get() << "]" << "compiled files are too large to keep [" << this << "]" << std::endl;
+			} catch (std::system_error &e) {
+				std::clog << "[" << conn->sock.get() << "]" << "failed to keep compiled files: " << e.what() << " [" << this << "]" << std::endl;
+			}
+		}
+		void plan_incremental_build(std::vector<std::string> flags) {
+			const auto compile = std::find_if(commands.begin(), commands.end(), [](const command_type &c) { return c.name == "compile"; });
+			if (compile == commands.end()) return;
+			build = std::make_shared<build_cache>(config.system.build_cache_dir, received["BuildSession"], config.system.build_cache_ttl);
+
+			// sources given in the compiler options are translation units of their own, linker flags only go to the link
+			std::vector<std::string> units = { target_compiler.output_file };
+			std::vector<std::string> objflags;
+			std::vector<std::string> linkflags;
+			for (auto &f: flags) {
+				const auto unit = build_cache::normalize(f);
+				struct ::stat st;
+				if (!unit.empty() && f[0] != '-' && ::fstatat(::dirfd(workdir.get()), ("store/" + unit).c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+					if (std::find(units.begin(), units.end(), unit) == units.end()) units.push_back(unit);
+					continue;
+				}
+				linkflags.push_back(f);
+				if (f.compare(0, 2, "-l") != 0 && f.compare(0, 2, "-L") != 0 && f.compare(0, 4, "-Wl,") != 0) objflags.push_back(move(f));
+			}
+
+			std::deque<command_type> steps;
+			std::vector<std::string> objects;
+			for (const auto &unit: units) {
+				const auto object = unit + ".o";
+				auto args = target_compiler.object_command;
+				args.insert(args.end(), objflags.begin(), objflags.end());
+				const auto key = build->key(workdir, unit, args);
+				args.insert(args.end(), { "-o", object, unit });
+				args.insert(args.begin(), jail.jail_command.begin(), jail.jail_command.end());
+				objects.push_back(object);
+				if (build->fetch(key, workdir, object)) {
+					build_status += unit + ": cached\n";
+				} else {
+					build_status += unit + ": compiled\n";
+					steps.push_back({ "compile", move(args), "", tagged("CompilerMessageS"), tagged("CompilerMessageE"), jail.compile_time_limit, key, object, "" });
+				}
+			}
+			// objects go right after the linker, so that libraries in the link command can resolve them
+			auto args = target_compiler.link_command;
+			args.insert(args.begin() + 1, objects.begin(), objects.end());
+			args.insert(args.end(), linkflags.begin(), linkflags.end());
+			args.insert(args.begin(), jail.jail_command.begin(), jail.jail_command.end());
+			steps.push_back({ "link", move(args), "", tagged("CompilerMessageS"), tagged("CompilerMessageE"), jail.compile_time_limit, "", "", "" });
+
+			commands.insert(commands.erase(compile), steps.begin(), steps.end());
+		}
+
+		std::shared_ptr<connection> conn;
 		std::unordered_map<std::string, std::string> received;
-		std::shared_ptr<asio::signal_set> sigs;
 		std::shared_ptr<DIR> workdir;
 		std::deque<command_type> commands;
 		command_type current;
 		std::vector<std::shared_ptr<pipe_forwarder_base>> pipes;
+		size_t open_pipes;
 		std::shared_ptr<asio::deadline_timer> kill_timer;
 		jail_config jail;
 		std::shared_ptr<write_limit_counter> limitter;
 		compiler_trait target_compiler;
 		int laststatus;
 		std::shared_ptr<void> semaphore;
+		std::size_t command_span;
+		std::string channel;
+		int lane;
+		std::shared_ptr<batch_state> batch;
+		bool precompiled;
+		std::vector<batch_job> cases;
+		bool prepare;
+		std::string handle;
+		std::shared_ptr<std::string> captured_stdout;
+		std::shared_ptr<std::string> captured_stderr;
+		std::shared_ptr<build_cache> build;
+		std::string build_status;
+		std::shared_ptr<output_cache> outputs;
+		std::string output_key;
+		std::shared_ptr<recorded_frames> recording;
+		recorded_frames replay;
+		size_t replayed;
+		std::shared_ptr<benchmark_state> bench;
+		std::vector<std::string> collect_patterns;
+		std::vector<std::string> sources;
+		recorded_frames collected;
+		size_t sent_files;
 	};
 
-	struct program_writer: private coroutine {
+	struct batch_launcher: session<batch_launcher>, private coroutine {
 		typedef void result_type;
-		program_writer(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, std::shared_ptr<asio::signal_set> sigs, std::unordered_map<std::string, std::string> received, std::unordered_map<std::string, std::string> sources, compiler_trait target_compiler, std::shared_ptr<void> semaphore)
-			 : aio(move(aio)),
-			   sock(move(sock)),
-			   file(std::make_shared<asio::posix::stream_descriptor>(*this->aio)),
-			   sigs(move(sigs)),
+		batch_launcher(std::shared_ptr<connection> conn, std::shared_ptr<DIR> workdir, std::vector<std::pair<std::string, std::string>> written, std::unordered_map<std::string, std::string> received, std::vector<batch_job> jobs, std::shared_ptr<void> semaphore)
+			 : session(conn->sockbuf->arena),
+			   conn(move(conn)),
+			   workdir(move(workdir)),
+			   written(move(written)),
+			   received(move(received)),
+			   jobs(move(jobs)),
+			   state(std::make_shared<batch_state>(this->jobs.size())),
+			   semaphore(move(semaphore)),
+			   pending(),
+			   dirs(),
+			   next(0)
+		{
+		}
+		void operator ()() {
+			reenter (this) {
+				std::clog << "[" << conn->sock.get() << "]" << "launching " << jobs.size() << " runs [" << this << "]" << std::endl;
+				// every other run gets copies of the files before the first one starts, so that no program can change
+				// what a sibling compiles or runs
+				try {
+					for (size_t n = 1; n < jobs.size(); ++n) dirs.push_back(copy_workdir(jobs[n]));
+				} catch (std::system_error &e) {
+					std::clog << "[" << conn->sock.get() << "]" << "failed to prepare batch: " << e.what() << std::endl;
+					error_code ec;
+					return (void)conn->sock->close(ec);
+				}
+				// the first run uses the slot of the connection itself, the others wait for their own slot
+				for (next = 0; next < jobs.size(); ++next) {
+					if (next != 0) yield pending = conn->sem->async_acquire(step());
+					launch(next, next == 0 ? move(semaphore) : move(pending));
+				}
+			}
+		}
+		void launch(size_t n, std::shared_ptr<void> slot) {
+			const auto &job = jobs[n];
+			auto dir = (n == 0) ? workdir : move(dirs[n - 1]);
+			auto r = received;
+			for (const auto &kv: job.received) r[kv.first] = kv.second;
+			const auto runner = std::make_shared<program_runner>(conn, move(r), move(dir), job.target_compiler, move(slot));
+			runner->channel = job.id;
+			runner->lane = static_cast<int>(n) + 1;
+			runner->batch = state;
+			runner->precompiled = job.precompiled;
+			(*runner)();
+		}
+		std::shared_ptr<DIR> copy_workdir(const batch_job &job) const {
+			std::string unique_name;
+			std::shared_ptr<DIR> dir;
+			while (unique_name.empty() || !dir) try {
+				unique_name = mkdtemp("wandboxXXXXXX");
+				dir = opendir(unique_name);
+			} catch (std::system_error &e) {
+				if (e.code().value() != ENOTDIR) throw;
+			}
+			for (const auto &f: written) {
+				const auto &target = f.first.empty() ? job.target_compiler.output_file : f.first;
+				if (recursive_copy_at(::dirfd(workdir.get()), "store/" + f.second, ::dirfd(dir.get()), "store/" + target, 0700) == -1) throw_system_error(errno);
+			}
+			return dir;
+		}
+
+		std::shared_ptr<connection> conn;
+		std::shared_ptr<DIR> workdir;
+		std::vector<std::pair<std::string, std::string>> written;
+		std::unordered_map<std::string, std::string> received;
+		std::vector<batch_job> jobs;
+		std::shared_ptr<batch_state> state;
+		std::shared_ptr<void> semaphore;
+		std::shared_ptr<void> pending;
+		std::vector<std::shared_ptr<DIR>> dirs;
+		size_t next;
+	};
+
+	void program_runner::launch_cases() {
+		std::vector<std::pair<std::string, std::string>> files;
+		try {
+			std::vector<std::string> compiled;
+			list_files_at(workdir, "store", compiled);
+			for (const auto &f: compiled) files.emplace_back(f, f);
+		} catch (std::system_error &e) {
+			std::clog << "[" << conn->sock.get() << "]" << "failed to list compiled files: " << e.what() << std::endl;
+			error_code ec;
+			return (void)conn->sock->close(ec);
+		}
+		for (auto &c: cases) c.precompiled = true;
+		(*std::make_shared<batch_launcher>(conn, workdir, move(files), move(received), move(cases), move(semaphore)))();
+	}
+
+	struct program_writer: session<program_writer>, private coroutine {
+		typedef void result_type;
+		// `batch', `cases' and `prepare' are set before it is started
+		program_writer(std::shared_ptr<connection> conn, std::unordered_map<std::string, std::string> received, std::unordered_map<std::string, std::string> sources, compiler_trait target_compiler, std::shared_ptr<void> semaphore)
+			 : session(conn->sockbuf->arena),
+			   conn(move(conn)),
 			   unique_name(),
 			   workdir(),
 			   received(move(received)),
-			   aiocb(std::make_shared<struct aiocb>()),
-			   target_compiler(target_compiler),
-			   semaphore(move(semaphore))
+			   aiocb(),
+			   target_compiler(move(target_compiler)),
+			   semaphore(move(semaphore)),
+			   write_span(0),
+			   batch(),
+			   cases(),
+			   prepare(false)
 		{
 			for (auto&& t: sources) this->sources.emplace_back(std::move(t.first), t.second);
 
@@ -467,74 +910,83 @@ namespace wandbox {
 				if (e.code().value() != ENOTDIR) throw;
 			}
 		}
-		program_writer(const program_writer &) = default;
-		program_writer &operator =(const program_writer &) = default;
-		program_writer(program_writer &&) = default;
-		program_writer &operator =(program_writer &&) = default;
 		void operator ()(error_code = error_code(), size_t = 0) {
 			reenter (this) {
+				write_span = conn->trace->begin("write");
 				while (!sources.empty()) {
 					current_source = std::move(sources.front());
 					sources.pop_front();
+					written.emplace_back(current_source.filename, current_source.filename.empty() ? target_compiler.output_file : current_source.filename);
 					if (current_source.filename.empty()) {
 						current_source.filename = target_compiler.output_file;
 					}
-					std::clog << "[" << sock.get() << "]" << "write file '" << current_source.filename << "' [" << this << "]" << std::endl;
+					std::clog << "[" << conn->sock.get() << "]" << "write file '" << current_source.filename << "' [" << this << "]" << std::endl;
 
 					{
-						::memset(aiocb.get(), 0, sizeof(*aiocb.get()));
+						::memset(&aiocb, 0, sizeof(aiocb));
 						while (true) {
-							aiocb->aio_fildes = recursive_create_open_at(::dirfd(workdir.get()), "store/" + current_source.filename, O_WRONLY|O_CLOEXEC|O_CREAT|O_TRUNC|O_EXCL|O_NOATIME, 0700, 0600);
-							if (aiocb->aio_fildes == -1) {
-								if (errno == EAGAIN || errno == EMFILE || errno == EWOULDBLOCK) yield sigs->async_wait(move(*this));
+							aiocb.aio_fildes = recursive_create_open_at(::dirfd(workdir.get()), "store/" + current_source.filename, O_WRONLY|O_CLOEXEC|O_CREAT|O_TRUNC|O_EXCL|O_NOATIME, 0700, 0600);
+							if (aiocb.aio_fildes == -1) {
+								if (errno == EAGAIN || errno == EMFILE || errno == EWOULDBLOCK) yield conn->sigs->async_wait(step());
 								else yield break;
 							} else {
 								break;
 							}
 						}
-						aiocb->aio_buf = const_cast<volatile void *>(static_cast<const volatile void *>(current_source.source.c_str()));
-						aiocb->aio_nbytes = current_source.source.length();
-						aiocb->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-						aiocb->aio_sigevent.sigev_signo = SIGHUP;
-						::aio_write(aiocb.get());
+						aiocb.aio_buf = const_cast<volatile void *>(static_cast<const volatile void *>(current_source.source.c_str()));
+						aiocb.aio_nbytes = current_source.source.length();
+						aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+						aiocb.aio_sigevent.sigev_signo = SIGHUP;
+						::aio_write(&aiocb);
 						do {
-							yield sigs->async_wait(move(*this));
-						} while (::aio_error(aiocb.get()) == EINPROGRESS) ;
-						::close(aiocb->aio_fildes);
+							yield conn->sigs->async_wait(step());
+						} while (::aio_error(&aiocb) == EINPROGRESS) ;
+						::close(aiocb.aio_fildes);
 					} {
-						::memset(aiocb.get(), 0, sizeof(*aiocb.get()));
+						::memset(&aiocb, 0, sizeof(aiocb));
 						{
 							auto d = opendir(config.system.storedir);
-							aiocb->aio_fildes = recursive_create_open_at(::dirfd(d.get()), unique_name + "/" + current_source.filename, O_WRONLY|O_CLOEXEC|O_CREAT|O_TRUNC|O_EXCL|O_NOATIME, 0700, 0600);
+							aiocb.aio_fildes = recursive_create_open_at(::dirfd(d.get()), unique_name + "/" + current_source.filename, O_WRONLY|O_CLOEXEC|O_CREAT|O_TRUNC|O_EXCL|O_NOATIME, 0700, 0600);
 						}
-						if (aiocb->aio_fildes == -1) {
-							std::clog << "[" << sock.get() << "]" << "failed to write run log '" << unique_name << "' [" << this << "]" << std::endl;
+						if (aiocb.aio_fildes == -1) {
+							std::clog << "[" << conn->sock.get() << "]" << "failed to write run log '" << unique_name << "' [" << this << "]" << std::endl;
 						} else {
-							aiocb->aio_buf = const_cast<volatile void *>(static_cast<const volatile void *>(current_source.source.c_str()));
-							aiocb->aio_nbytes = current_source.source.length();
-							aiocb->aio_sigevent.sigev_notify = SIGEV_SIGNAL;
-							aiocb->aio_sigevent.sigev_signo = SIGHUP;
-							::aio_write(aiocb.get());
+							aiocb.aio_buf = const_cast<volatile void *>(static_cast<const volatile void *>(current_source.source.c_str()));
+							aiocb.aio_nbytes = current_source.source.length();
+							aiocb.aio_sigevent.sigev_notify = SIGEV_SIGNAL;
+							aiocb.aio_sigevent.sigev_signo = SIGHUP;
+							::aio_write(&aiocb);
 							do {
-								yield sigs->async_wait(move(*this));
-							} while (::aio_error(aiocb.get()) == EINPROGRESS) ;
-							::close(aiocb->aio_fildes);
+								yield conn->sigs->async_wait(step());
+							} while (::aio_error(&aiocb) == EINPROGRESS) ;
+							::close(aiocb.aio_fildes);
 						}
 					}
 				}
-				return program_runner(aio, move(sock), move(received), move(sigs), move(workdir), move(target_compiler), move(semaphore))();
+				conn->trace->end(write_span);
+				if (!batch.empty()) {
+					return (*std::make_shared<batch_launcher>(conn, move(workdir), move(written), move(received), move(batch), move(semaphore)))();
+				}
+				{
+					const auto runner = std::make_shared<program_runner>(conn, move(received), move(workdir), move(target_compiler), move(semaphore));
+					runner->cases = move(cases);
+					runner->prepare = prepare;
+					(*runner)();
+				}
 			}
 		}
-		std::shared_ptr<asio::io_service> aio;
-		std::shared_ptr<tcp::socket> sock;
-		std::shared_ptr<asio::posix::stream_descriptor> file;
-		std::shared_ptr<asio::signal_set> sigs;
+		std::shared_ptr<connection> conn;
 		std::string unique_name;
 		std::shared_ptr<DIR> workdir;
 		std::unordered_map<std::string, std::string> received;
-		std::shared_ptr<struct aiocb> aiocb;
+		struct aiocb aiocb;
 		compiler_trait target_compiler;
 		std::shared_ptr<void> semaphore;
+		std::size_t write_span;
+		std::vector<batch_job> batch;
+		std::vector<batch_job> cases;
+		bool prepare;
+		std::vector<std::pair<std::string, std::string>> written;
 
 		struct source_file_t {
 			std::string filename;
@@ -551,68 +1003,24 @@ namespace wandbox {
 		};
 		std::deque<source_file_t> sources;
 		source_file_t current_source;
-
-	private:
-		static int recursive_create_open_at(int at, const std::string &filename, int flags, int dirmode, int filemode) {
-			// FIXME: must canonicalize invalid UTF-8 sequence in `filename'
-			if (filename[0] == '/') return -1;
-
-			std::vector<int> dirfds;
-			const auto closeall = [&dirfds]() {
-				for (int fd: dirfds) ::close(fd);
-				dirfds.clear();
-			};
-
-			std::vector<std::string> dirs;
-			boost::algorithm::split(dirs, filename, boost::is_any_of("/"));
-
-			if (dirs.empty()) return -1;
-
-			const auto targetfile = std::move(dirs.back());
-			dirs.pop_back();
-			errno = 0;
-			if (dirs.empty()) return ::openat(at, targetfile.c_str(), flags, filemode);
-
-			dirfds.reserve(dirs.size());
-
-			for (auto &&x: dirs) {
-				if (x == "") continue;
-				if (x == ".") continue;
-				if (x == "..") {
-					if (dirfds.empty()) return -1;
-					int fd = dirfds.back();
-					dirfds.pop_back();
-					::close(fd);
-				} else {
-					errno = 0;
-					::mkdirat(dirfds.empty() ? at : dirfds.back(), x.c_str(), dirmode);
-					int dirfd = ::openat(dirfds.empty() ? at : dirfds.back(), x.c_str(), O_DIRECTORY|O_PATH|O_RDWR);
-					if (dirfd == -1) return closeall(), -1;
-					dirfds.push_back(dirfd);
-				}
-			}
-
-			errno = 0;
-			int newfd = ::openat(dirfds.empty() ? at : dirfds.back(), targetfile.c_str(), flags, filemode);
-			closeall();
-			return newfd;
-		}
-
 	};
 
 	struct version_sender: private coroutine {
 		typedef void result_type;
-		version_sender(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, std::shared_ptr<asio::signal_set> sigs, std::shared_ptr<void> semaphore)
-			 : aio(move(aio)),
-			   sock(move(sock)),
-			   sockbuf(std::make_shared<socket_write_buffer>(this->sock)),
+		version_sender(const connection &conn, std::shared_ptr<void> semaphore)
+			 : aio(conn.aio),
+			   sock(conn.sock),
+			   sockbuf(conn.sockbuf),
 			   pipe_stdout(nullptr),
-			   sigs(move(sigs)),
+			   sigs(conn.sigs),
 			   commands(),
 			   current(),
 			   child(nullptr),
 			   buf(nullptr),
-			   semaphore(move(semaphore))
+			   semaphore(move(semaphore)),
+			   trace(conn.trace),
+			   version_span(0),
+			   versions_held(std::make_shared<memory_lease>(memory))
 		{
 			for (const auto &c: config.compilers) commands.push_back(c);
 		}
@@ -623,6 +1031,7 @@ namespace wandbox {
 		void operator ()(error_code = error_code(), size_t = 0) {
 			reenter (this) {
 				std::clog << "[" << sock.get() << "]" << "building compiler list" << std::endl;
+				version_span = trace->begin("version");
 				while (!commands.empty()) {
 					current = move(commands.front());
 					commands.pop_front();
@@ -655,8 +1064,10 @@ namespace wandbox {
 						std::string ver;
 						if (!getline(is, ver)) continue;
 						versions.emplace_back(generate_displaying_compiler_config(move(current), ver, config.switches));
+						versions_held->grow(versions.back().size());
 					}
 				}
+				trace->end(version_span);
 				yield {
 					auto s = "[" + boost::algorithm::join(move(versions), ",") + "]";
 					sockbuf->async_write_command("VersionResult", move(s), move(*this));
@@ -674,99 +1085,517 @@ namespace wandbox {
 		std::vector<std::string> versions;
 		std::shared_ptr<asio::streambuf> buf;
 		std::shared_ptr<void> semaphore;
+		std::shared_ptr<trace_recorder> trace;
+		std::size_t version_span;
+		std::shared_ptr<memory_lease> versions_held;
 	};
 
-	struct compiler_bridge: private coroutine {
+	struct compiler_bridge: session<compiler_bridge>, private coroutine {
 		typedef void result_type;
-		compiler_bridge(std::shared_ptr<asio::io_service> aio, std::shared_ptr<tcp::socket> sock, std::shared_ptr<asio::signal_set> sigs, std::shared_ptr<void> semaphore)
-			 : aio(move(aio)),
-			   sock(move(sock)),
-			   buf(std::make_shared<std::vector<char>>()),
-			   sigs(move(sigs)),
+		compiler_bridge(std::shared_ptr<connection> conn, std::shared_ptr<void> semaphore)
+			 : session(conn->sockbuf->arena),
+			   conn(move(conn)),
+			   buf(),
 			   received(),
-			   semaphore(move(semaphore))
+			   semaphore(move(semaphore)),
+			   pending(),
+			   receive_span(this->conn->trace->begin("receive")),
+			   arrival(capture_clock()),
+			   envelope(),
+			   request(),
+			   held(std::make_shared<memory_lease>(memory)),
+			   timer(*this->conn->aio),
+			   waited(0)
 		{
 		}
-		compiler_bridge(const compiler_bridge &) = default;
-		compiler_bridge &operator =(const compiler_bridge &) = default;
-		compiler_bridge(compiler_bridge &&) = default;
-		compiler_bridge &operator =(compiler_bridge &&) = default;
 		void operator ()(error_code ec = error_code(), size_t len = 0) {
-			reenter (this) while (true) {
-				yield {
-					const auto offset = buf->size();
-					buf->resize(offset + BUFSIZ);
-					PROTECT_FROM_MOVE(buf);
-					PROTECT_FROM_MOVE(sock);
-					sock->async_read_some(asio::buffer(asio::buffer(*buf) + offset), move(*this));
-				}
-				if (ec) return (void)sock->close(ec);
-				buf->erase(buf->end()-(BUFSIZ-len), buf->end());
+			reenter (this) {
+				while (request.empty()) {
+					// the request is read on while the memory budget holds it, waiting up to memory-wait seconds
+					for (waited = 0; !held->try_grow(BUFSIZ); ++waited) {
+						if (held->size() + BUFSIZ > memory.limit() || waited >= config.system.memory_wait * 10) return reject();
+						timer.expires_from_now(ptime::milliseconds(100));
+						yield timer.async_wait(step());
+					}
+					yield {
+						const auto offset = buf.size();
+						buf.resize(offset + BUFSIZ);
+						conn->sock->async_read_some(asio::buffer(asio::buffer(buf) + offset), step());
+					}
+					if (ec) return (void)conn->sock->close(ec);
+					buf.erase(buf.end()-(BUFSIZ-len), buf.end());
+					held->shrink(BUFSIZ-len);
 
-				auto ite = buf->begin();
-				while (true) {
-					std::string command;
-					int len = 0;
-					std::string data;
-					if (!qi::parse(ite, buf->end(), +(qi::char_ - qi::space) >> qi::omit[*qi::space] >> qi::omit[qi::int_[phx::ref(len) = qi::_1]] >> qi::omit[':'] >> qi::repeat(phx::ref(len))[qi::char_] >> qi::omit[qi::eol], command, data)) break;
-					if (command == "Control" && data == "run") {
-						std::string ccname;
-						const auto &s = received["Control"];
-						{
-							auto ite = s.begin();
-							qi::parse(ite, s.end(), "compiler=" >> *qi::char_, ccname);
-						}
-						const auto c = config.compilers.get<1>().find(ccname);
-						if (c == config.compilers.get<1>().end()) {
-							std::clog << "[" << sock.get() << "]" << "selected compiler '" << ccname << "' is not configured" << std::endl;
-							return (void)sock->close(ec);
+					auto ite = buf.begin();
+					while (true) {
+						std::string command;
+						std::string data;
+						if (!parse_frame(ite, buf.end(), command, data)) break;
+						if (command == "Version" || (command == "Control" && is_request(quoted_printable::decode(data)))) {
+							conn->trace->end(receive_span);
+							capture(ite);
+							request = command == "Version" ? command : quoted_printable::decode(move(data));
+							break;
+						} else if (command == "Status") {
+							return send_status();
+						} else if (command == "Control" && quoted_printable::decode(data) == "check-sources") {
+							return check_sources();
+						} else if (command == "BatchId" || command == "TestCase") {
+							current_batch = quoted_printable::decode(move(data));
+							const auto it = std::find_if(batch.begin(), batch.end(), [this](const std::pair<std::string, std::unordered_map<std::string, std::string>> &b) { return b.first == current_batch; });
+							if (it == batch.end()) batch.emplace_back(current_batch, std::unordered_map<std::string, std::string>());
+						} else if (command == "TraceId") {
+							conn->trace->set_id(quoted_printable::decode(move(data)));
+						} else if (command == "SourceFileName") {
+							current_filename = quoted_printable::decode(move(data));
+						} else if (command == "Source") {
+							sources[current_filename] += quoted_printable::decode(move(data));
+						} else if (command == "SourceHash") {
+							hashes.emplace_back(current_filename, quoted_printable::decode(move(data)));
+						} else if (!batch.empty()) {
+							const auto it = std::find_if(batch.begin(), batch.end(), [this](const std::pair<std::string, std::unordered_map<std::string, std::string>> &b) { return b.first == current_batch; });
+							it->second[command] += quoted_printable::decode(move(data));
+						} else {
+							received[command] += quoted_printable::decode(move(data));
 						}
-						return program_writer(move(aio), move(sock), move(sigs), move(received), move(sources), *c, move(semaphore))();
-					} else if (command == "Version") {
-						return version_sender(move(aio), move(sock), move(sigs), move(semaphore))();
-					} else if (command == "SourceFileName") {
-						current_filename = quoted_printable::decode(move(data));
-					} else if (command == "Source") {
-						sources[current_filename] += quoted_printable::decode(move(data));
-					} else {
-						received[command] += quoted_printable::decode(move(data));
 					}
+					if (!config.system.capture_file.empty() && request.empty()) envelope.append(buf.begin(), ite);
+					buf.erase(buf.begin(), ite);
 				}
-				buf->erase(buf->begin(), ite);
+				if (!resolve_sources()) return;
+				// the connection was accepted with a slot of max-queue; the request waits for one of max-connections
+				yield pending = conn->sem->async_acquire(step());
+				semaphore = std::make_shared<std::pair<std::shared_ptr<void>, std::shared_ptr<void>>>(move(semaphore), move(pending));
+				// the request is held in memory until it is finished
+				semaphore = std::make_shared<std::pair<std::shared_ptr<void>, std::shared_ptr<void>>>(move(semaphore), move(held));
+				start();
 			}
 		}
-		std::shared_ptr<asio::io_service> aio;
-		std::shared_ptr<tcp::socket> sock;
-		std::shared_ptr<std::vector<char>> buf;
-		std::shared_ptr<asio::signal_set> sigs;
+		// runs `request' with what was filled in instead of reading frames
+		void submit(std::string request) {
+			conn->trace->end(receive_span);
+			this->request = move(request);
+			(*this)();
+		}
+		static bool is_request(const std::string &control) {
+			return control == "run" || control == "prepare" || control == "run-batch" || control == "run-cases" || control.compare(0, 15, "execute handle=") == 0;
+		}
+		void start() {
+			error_code ec;
+			if (request == "run" || request == "prepare") {
+				const auto c = find_compiler(received["Control"]);
+				if (!c) return (void)conn->sock->close(ec);
+				const auto writer = std::make_shared<program_writer>(conn, move(received), move(sources), *c, move(semaphore));
+				writer->prepare = request == "prepare";
+				return (*writer)();
+			} else if (request.compare(0, 15, "execute handle=") == 0) {
+				return execute(request.substr(15));
+			} else if (request == "run-batch") {
+				std::vector<batch_job> jobs;
+				for (auto &b: batch) {
+					const auto c = find_compiler(b.second["Control"]);
+					if (!c) return (void)conn->sock->close(ec);
+					jobs.push_back({ b.first, *c, move(b.second), false });
+				}
+				if (jobs.empty()) {
+					std::clog << "[" << conn->sock.get() << "]" << "empty batch" << std::endl;
+					return (void)conn->sock->close(ec);
+				}
+				const auto writer = std::make_shared<program_writer>(conn, move(received), move(sources), jobs.front().target_compiler, move(semaphore));
+				writer->batch = move(jobs);
+				return (*writer)();
+			} else if (request == "run-cases") {
+				const auto c = find_compiler(received["Control"]);
+				if (!c) return (void)conn->sock->close(ec);
+				std::vector<batch_job> cases;
+				for (auto &b: batch) cases.push_back({ b.first, *c, move(b.second), false });
+				if (cases.empty()) {
+					std::clog << "[" << conn->sock.get() << "]" << "no test cases" << std::endl;
+					return (void)conn->sock->close(ec);
+				}
+				const auto writer = std::make_shared<program_writer>(conn, move(received), move(sources), *c, move(semaphore));
+				writer->cases = move(cases);
+				return (*writer)();
+			} else if (request == "Version") {
+				return version_sender(*conn, move(semaphore))();
+			}
+		}
+		// answered at once, without waiting for a slot, so that a client can see how busy the server is
+		void send_status() {
+			const auto &sem = conn->sem;
+			conn->sockbuf->async_write_command("StatusResult", "{\"running\":" + std::to_string(sem->running) + ",\"queued\":" + std::to_string(sem->queued) + ",\"max-connections\":" + std::to_string(sem->capacity) + "}", [] {});
+		}
+		// answered at once like Status, with the hashes of the SourceHash frames the store does not hold
+		void check_sources() {
+			const source_store store(config.system.source_store_dir, config.system.source_store_ttl);
+			const auto &sockbuf = conn->sockbuf;
+			for (const auto &h: hashes) {
+				if (config.system.source_store_dir.empty() || !store.contains(h.second)) sockbuf->async_write_command("SourceMissing", h.second, [] {});
+			}
+			sockbuf->async_write_command("Control", "Finish", [] {});
+		}
+		// keeps the sources sent in full and fills in those sent as SourceHash; when one of them is not
+		// in the store, the request is answered with SourceMissing and the client has to send it again
+		bool resolve_sources() {
+			std::vector<std::string> missing;
+			if (config.system.source_store_dir.empty()) {
+				for (const auto &h: hashes) missing.push_back(h.second);
+			} else {
+				const source_store store(config.system.source_store_dir, config.system.source_store_ttl);
+				for (const auto &s: sources) store.save(s.second);
+				for (const auto &h: hashes) {
+					std::string content;
+					if (!store.load(h.second, content)) {
+						missing.push_back(h.second);
+						continue;
+					}
+					held->grow(content.size());
+					sources[h.first] = move(content);
+				}
+			}
+			if (missing.empty()) return true;
+			std::clog << "[" << conn->sock.get() << "]" << missing.size() << " of " << hashes.size() << " sources sent as hash are not in the store" << std::endl;
+			const auto &sockbuf = conn->sockbuf;
+			for (const auto &m: missing) sockbuf->async_write_command("SourceMissing", m, [] {});
+			sockbuf->async_write_command("Control", "Finish", [] {});
+			return false;
+		}
+		void reject() {
+			std::clog << "[" << conn->sock.get() << "]" << "rejected, the memory budget is exhausted (" << memory.used() << " of " << memory.limit() << " octets in use, " << held->size() << " by this request)" << std::endl;
+			const auto &sockbuf = conn->sockbuf;
+			sockbuf->async_write_command("Rejected", "memory budget exhausted", [] {});
+			sockbuf->async_write_command("Control", "Finish", [] {});
+		}
+		void capture(std::vector<char>::const_iterator end) const {
+			if (config.system.capture_file.empty()) return;
+			try {
+				capture_writer(config.system.capture_file).record({ arrival, envelope + std::string(buf.cbegin(), end) });
+			} catch (std::system_error &e) {
+				std::clog << "[" << conn->sock.get() << "]" << "failed to capture the request: " << e.what() << std::endl;
+			}
+		}
+		void execute(const std::string &handle) {
+			std::shared_ptr<DIR> workdir;
+			std::string ccname;
+			try {
+				if (!config.system.artifact_dir.empty()) workdir = artifact_store(config.system.artifact_dir, config.system.artifact_ttl, config.system.artifact_size_limit, config.system.artifact_quota).checkout(handle, ccname);
+			} catch (std::system_error &e) {
+				std::clog << "[" << conn->sock.get() << "]" << "failed to check out '" << handle << "': " << e.what() << std::endl;
+				error_code ec;
+				return (void)conn->sock->close(ec);
+			}
+			const auto c = config.compilers.get<1>().find(ccname);
+			if (!workdir || c == config.compilers.get<1>().end()) {
+				std::clog << "[" << conn->sock.get() << "]" << "handle '" << handle << "' is expired" << std::endl;
+				const auto &sockbuf = conn->sockbuf;
+				sockbuf->async_write_command("HandleExpired", handle, [] {});
+				return sockbuf->async_write_command("Control", "Finish", [] {});
+			}
+			std::clog << "[" << conn->sock.get() << "]" << "executing '" << handle << "'" << std::endl;
+			const auto runner = std::make_shared<program_runner>(conn, move(received), move(workdir), *c, move(semaphore));
+			runner->precompiled = true;
+			(*runner)();
+		}
+		const compiler_trait *find_compiler(const std::string &control) const {
+			std::string ccname;
+			{
+				auto ite = control.begin();
+				qi::parse(ite, control.end(), "compiler=" >> *qi::char_, ccname);
+			}
+			const auto c = config.compilers.get<1>().find(ccname);
+			if (c == config.compilers.get<1>().end()) {
+				std::clog << "[" << conn->sock.get() << "]" << "selected compiler '" << ccname << "' is not configured" << std::endl;
+				return nullptr;
+			}
+			return &*c;
+		}
+		std::shared_ptr<connection> conn;
+		std::vector<char> buf;
 		std::unordered_map<std::string, std::string> received;
 		std::unordered_map<std::string, std::string> sources;
 		std::string current_filename;
+		std::vector<std::pair<std::string, std::string>> hashes;
+		std::vector<std::pair<std::string, std::unordered_map<std::string, std::string>>> batch;
+		std::string current_batch;
 		std::shared_ptr<void> semaphore;
+		std::shared_ptr<void> pending;
+		std::size_t receive_span;
+		std::int64_t arrival;
+		std::string envelope;
+		std::string request;
+		std::shared_ptr<memory_lease> held;
+		asio::deadline_timer timer;
+		int waited;
 	};
 
+	// One request of the http api per connection: GET /api/list.json, POST /api/compile.json and POST /compile
+	// (an event stream), answered like kennel answers them. The request is run by a compiler_bridge that writes
+	// its output frames through an encoder instead of as frames.
+	struct http_bridge: private coroutine {
+		typedef void result_type;
+		http_bridge(std::shared_ptr<connection> conn, std::shared_ptr<void> semaphore)
+			 : conn(move(conn)),
+			   sock(this->conn->sock),
+			   buf(std::make_shared<std::string>()),
+			   semaphore(move(semaphore)),
+			   req(std::make_shared<http_request>()),
+			   body_offset(std::string::npos),
+			   held(std::make_shared<memory_lease>(memory)),
+			   deadline(std::make_shared<asio::deadline_timer>(*this->conn->aio)),
+			   timer(std::make_shared<asio::deadline_timer>(*this->conn->aio)),
+			   waited(0)
+		{
+		}
+		http_bridge(const http_bridge &) = default;
+		http_bridge &operator =(const http_bridge &) = default;
+		http_bridge(http_bridge &&) = default;
+		http_bridge &operator =(http_bridge &&) = default;
+		void operator ()(error_code ec = error_code(), size_t len = 0) {
+			reenter (this) {
+				// a client that is slow to send its request has the connection closed instead of holding it
+				if (config.system.http_read_timeout > 0) {
+					deadline->expires_from_now(ptime::seconds(config.system.http_read_timeout));
+					const std::weak_ptr<tcp::socket> weak = sock;
+					deadline->async_wait([weak](error_code ec) {
+						const auto sock = weak.lock();
+						if (ec || !sock) return;
+						std::clog << "[" << sock.get() << "]" << "http request not received in time" << std::endl;
+						sock->close(ec);
+					});
+				}
+				while (body_offset == std::string::npos || buf->size() - body_offset < req->content_length) {
+					// as a request of kennel's protocol, waiting up to memory-wait seconds for the memory budget
+					for (waited = 0; !held->try_grow(BUFSIZ); ++waited) {
+						if (held->size() + BUFSIZ > memory.limit() || waited >= config.system.memory_wait * 10) return reject();
+						yield {
+							PROTECT_FROM_MOVE(timer);
+							timer->expires_from_now(ptime::milliseconds(100));
+							timer->async_wait(in_arena(conn->sockbuf->arena, move(*this)));
+						}
+					}
+					yield {
+						const auto offset = buf->size();
+						buf->resize(offset + BUFSIZ);
+						PROTECT_FROM_MOVE(buf);
+						PROTECT_FROM_MOVE(sock);
+						sock->async_read_some(asio::buffer(&(*buf)[offset], BUFSIZ), in_arena(conn->sockbuf->arena, move(*this)));
+					}
+					if (ec) return (void)sock->close(ec);
+					buf->resize(buf->size() - (BUFSIZ - len));
+					held->shrink(BUFSIZ - len);
+					if (body_offset == std::string::npos) {
+						const auto pos = buf->find("\r\n\r\n");
+						if (pos == std::string::npos) {
+							if (buf->size() > max_head) return respond(http_error(431, "the request header is too large"));
+							continue;
+						}
+						if (!http_request::parse(buf->substr(0, pos), *req)) return respond(http_error(400, "malformed request"));
+						body_offset = pos + 4;
+						if (memory.limit() != 0 && req->content_length > memory.limit()) return respond(http_error(413, "the request is larger than the memory budget"));
+						if (req->headers["expect"] == "100-continue" && buf->size() - body_offset < req->content_length) respond("HTTP/1.1 100 Continue\r\n\r\n");
+					}
+				}
+				route();
+			}
+		}
+	private:
+		static const std::size_t max_head = 65536;
+
+		void route() {
+			deadline->cancel();
+			std::clog << "[" << sock.get() << "]" << "http " << req->method << " " << req->target << std::endl;
+			// the request is held in memory until it is finished
+			auto held_semaphore = std::make_shared<std::pair<std::shared_ptr<void>, std::shared_ptr<void>>>(move(semaphore), move(held));
+			if (req->target == "/api/list.json" && req->method == "GET") {
+				conn->sockbuf->encoder = make_list_encoder();
+				return std::make_shared<compiler_bridge>(conn, move(held_semaphore))->submit("Version");
+			}
+			if ((req->target == "/api/compile.json" || req->target == "/compile") && req->method == "POST") {
+				std::unordered_map<std::string, std::string> received;
+				std::string code;
+				std::string error;
+				if (!parse_compile_request(buf->substr(body_offset, req->content_length), received, code, error)) return respond(http_error(400, error));
+				if (config.compilers.get<1>().count(received["Control"].substr(9)) == 0) return respond(http_error(400, "unknown compiler"));
+				conn->sockbuf->encoder = req->target == "/compile" ? make_event_stream_encoder() : make_compile_json_encoder();
+				const auto bridge = std::make_shared<compiler_bridge>(conn, move(held_semaphore));
+				bridge->received = move(received);
+				bridge->sources[""] = move(code);
+				return bridge->submit("run");
+			}
+			respond(http_error(404, "no such endpoint"));
+		}
+		void reject() const {
+			std::clog << "[" << sock.get() << "]" << "rejected, the memory budget is exhausted (" << memory.used() << " of " << memory.limit() << " octets in use, " << held->size() << " by this request)" << std::endl;
+			respond(http_error(503, "memory budget exhausted"));
+		}
+		void respond(std::string response) const {
+			const auto data = std::make_shared<std::string>(move(response));
+			const auto sock = this->sock;
+			asio::async_write(*sock, asio::buffer(*data), [sock, data](error_code, size_t) { });
+		}
+
+		std::shared_ptr<connection> conn;
+		std::shared_ptr<tcp::socket> sock;
+		std::shared_ptr<std::string> buf;
+		std::shared_ptr<void> semaphore;
+		std::shared_ptr<http_request> req;
+		std::size_t body_offset;
+		std::shared_ptr<memory_lease> held;
+		std::shared_ptr<asio::deadline_timer> deadline;
+		std::shared_ptr<asio::deadline_timer> timer;
+		int waited;
+	};
+
+	// Hands the listening sockets over to a new process connecting to `path', then stops accepting and stops
+	// the server once the connections in progress are finished.
+	struct handoff_server: private coroutine {
+		typedef void result_type;
+		handoff_server(std::shared_ptr<asio::io_service> aio, const std::string &path, std::shared_ptr<tcp::acceptor> acc, std::shared_ptr<int> connections, std::shared_ptr<tcp::acceptor> http_acc = nullptr)
+			 : aio(move(aio)),
+			   acc(move(acc)),
+			   http_acc(move(http_acc)),
+			   connections(move(connections)),
+			   local_acc(std::make_shared<asio::local::stream_protocol::acceptor>(*this->aio)),
+			   peer(),
+			   timer(std::make_shared<asio::deadline_timer>(*this->aio)),
+			   drain_limit(0),
+			   waited(0)
+		{
+			// a request running when the sockets are handed over is killed by then at the latest
+			for (const auto &j: config.jails) drain_limit = std::max(drain_limit, std::max(j.second.program_duration, j.second.compile_time_limit) + j.second.kill_wait);
+			// whoever can connect takes the listening sockets, so the socket is created accessible to this user only
+			const asio::local::stream_protocol::endpoint ep(path);
+			local_acc->open(ep.protocol());
+			const auto mask = ::umask(077);
+			error_code ec;
+			local_acc->bind(ep, ec);
+			::umask(mask);
+			if (ec) throw boost::system::system_error(ec);
+			local_acc->listen();
+			std::clog << "accepting handoff at " << path << std::endl;
+		}
+		handoff_server(const handoff_server &) = default;
+		handoff_server &operator =(const handoff_server &) = default;
+		handoff_server(handoff_server &&) = default;
+		handoff_server &operator =(handoff_server &&) = default;
+		void operator ()(error_code ec = error_code()) {
+			reenter (this) {
+				while (true) {
+					peer = std::make_shared<asio::local::stream_protocol::socket>(*aio);
+					yield {
+						PROTECT_FROM_MOVE(peer);
+						PROTECT_FROM_MOVE(local_acc);
+						local_acc->async_accept(*peer, move(*this));
+					}
+					if (ec) {
+						std::clog << "failed to accept handoff: " << ec.message() << std::endl;
+						return;
+					}
+					try {
+						if (http_acc) send_fds(peer->native_handle(), { acc->native_handle(), http_acc->native_handle() });
+						else send_fds(peer->native_handle(), { acc->native_handle() });
+						break;
+					} catch (std::system_error &e) {
+						std::clog << "failed to hand the listening sockets over: " << e.what() << std::endl;
+					}
+				}
+				// the new process accepts from the same sockets from now on, so no connection is refused meanwhile
+				acc->close(ec);
+				if (http_acc) http_acc->close(ec);
+				local_acc->close(ec);
+				std::clog << "handed the listening sockets over, draining " << *connections << " connections" << std::endl;
+				for (waited = 0; *connections != 0 && waited <= drain_limit; ++waited) {
+					yield {
+						PROTECT_FROM_MOVE(timer);
+						timer->expires_from_now(ptime::seconds(1));
+						timer->async_wait(move(*this));
+					}
+				}
+				if (*connections != 0) std::clog << "gave up draining " << *connections << " connections after " << waited << " seconds, exiting" << std::endl;
+				else std::clog << "drained, exiting" << std::endl;
+				aio->stop();
+			}
+		}
+	private:
+		std::shared_ptr<asio::io_service> aio;
+		std::shared_ptr<tcp::acceptor> acc;
+		std::shared_ptr<tcp::acceptor> http_acc;
+		std::shared_ptr<int> connections;
+		std::shared_ptr<asio::local::stream_protocol::acceptor> local_acc;
+		std::shared_ptr<asio::local::stream_protocol::socket> peer;
+		std::shared_ptr<asio::deadline_timer> timer;
+		int drain_limit;
+		int waited;
+	};
+
+	// the listening sockets handed over by the process accepting handoff at `path': that of the server, then
+	// that of the http api when the process serves it; none when there is no such process
+	std::vector<unique_fd> receive_listening_sockets(asio::io_service &aio, const std::string &path) {
+		asio::local::stream_protocol::socket sock(aio);
+		error_code ec;
+		sock.connect(asio::local::stream_protocol::endpoint(path), ec);
+		if (ec) {
+			if (ec != boost::system::errc::no_such_file_or_directory && ec != boost::system::errc::connection_refused) std::clog << "failed to connect to " << path << ": " << ec.message() << std::endl;
+			::unlink(path.c_str());
+			return {};
+		}
+		auto fds = receive_fds(sock.native_handle(), 2);
+		::unlink(path.c_str());
+		std::clog << "took over " << fds.size() << " listening sockets from " << path << std::endl;
+		return fds;
+	}
+
 	struct listener: private coroutine {
 		typedef void result_type;
-		void operator ()(error_code = error_code()) {
+		void operator ()(error_code ec = error_code()) {
 			reenter (this) while (true) {
+				// new connections wait in the backlog while the memory budget is exhausted
+				if (memory.exhausted()) std::clog << "memory budget exhausted (" << memory.used() << " of " << memory.limit() << " octets in use), deferring new connections" << std::endl;
+				while (memory.exhausted()) yield {
+					timer->expires_from_now(ptime::milliseconds(100));
+					PROTECT_FROM_MOVE(timer);
+					timer->async_wait(move(*this));
+				}
 				sock = std::make_shared<tcp::socket>(*aio);
 				yield {
 					PROTECT_FROM_MOVE(sock);
 					PROTECT_FROM_MOVE(acc);
 					acc->async_accept(*sock, move(*this));
 				}
-				std::clog << "[" << sock.get() << "]" << "connection established from " << sock->remote_endpoint() << std::endl;
-				yield compiler_bridge(aio, move(sock), sigs, sem->async_signal(*this))();
+				if (ec) {
+					// closed when the listening socket was handed over
+					if (!acc->is_open()) return;
+					std::clog << "failed to accept: " << ec.message() << std::endl;
+					continue;
+				}
+				{
+					// counted until the last handler holding the connection is gone
+					const auto accepted = sock;
+					const auto connections = this->connections;
+					++*connections;
+					sock = std::shared_ptr<tcp::socket>(accepted.get(), [accepted, connections](tcp::socket *) { --*connections; });
+				}
+				std::clog << "[" << sock.get() << "]" << "connection established from " << sock->remote_endpoint(ec) << std::endl;
+				yield {
+					auto trace = std::make_shared<trace_recorder>(config.system.tracedir, config.system.trace_sample_rate, config.system.trace_slow_threshold);
+					const auto conn = std::make_shared<connection>(aio, move(sock), sigs, sem, move(trace));
+					if (http) http_bridge(conn, conns->async_signal(*this))();
+					else (*std::make_shared<compiler_bridge>(conn, conns->async_signal(*this)))();
+				}
 			}
 		}
-		template <typename ...Args>
-		listener(std::shared_ptr<asio::io_service> aio, Args &&...args)
+		// listens on `ep', or on `listen_fd' when one was handed over
+		listener(std::shared_ptr<asio::io_service> aio, tcp::endpoint ep, int listen_fd = -1)
 			 : aio(move(aio)),
-			   ep(std::forward<Args>(args)...),
-			   acc(std::make_shared<tcp::acceptor>(*this->aio, this->ep)),
+			   ep(move(ep)),
+			   acc(listen_fd == -1 ? std::make_shared<tcp::acceptor>(*this->aio, this->ep) : std::make_shared<tcp::acceptor>(*this->aio, this->ep.protocol(), listen_fd)),
 			   sigs(std::make_shared<asio::signal_set>(*this->aio, SIGCHLD, SIGHUP)),
 			   sock(),
-			   sem(std::make_shared<counting_semaphore>(*this->aio, config.system.max_connections-1))
+			   conns(std::make_shared<counting_semaphore>(*this->aio, config.system.max_connections+config.system.max_queue-1)),
+			   sem(std::make_shared<counting_semaphore>(*this->aio, config.system.max_connections)),
+			   connections(std::make_shared<int>(0)),
+			   timer(std::make_shared<asio::deadline_timer>(*this->aio)),
+			   http(false)
 		{
 			std::clog << "start listening at " << this->ep << std::endl;
 			try {
@@ -792,6 +1621,36 @@ namespace wandbox {
 		listener &operator =(const listener &) = default;
 		listener(listener &&) = default;
 		listener &operator =(listener &&) = default;
+		// a listener for the http api at `ep', or on `listen_fd' when one was handed over, sharing the connection
+		// count with this one; it has slots and a queue of its own so that http clients cannot take those of kennel
+		listener serve_http(tcp::endpoint ep, int listen_fd = -1) {
+			typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
+			listener l(*this);
+			l.ep = move(ep);
+			if (listen_fd != -1) {
+				l.acc = std::make_shared<tcp::acceptor>(*aio, l.ep.protocol(), listen_fd);
+			} else {
+				// a process handing over no http socket may still be listening on the port
+				l.acc = std::make_shared<tcp::acceptor>(*aio);
+				l.acc->open(l.ep.protocol());
+				l.acc->set_option(tcp::acceptor::reuse_address(true));
+				l.acc->set_option(reuse_port(true));
+				l.acc->bind(l.ep);
+				l.acc->listen();
+			}
+			const auto slots = config.system.http_max_connections > 0 ? config.system.http_max_connections : config.system.max_connections;
+			const auto queue = config.system.http_max_queue > 0 ? config.system.http_max_queue : config.system.max_queue;
+			l.conns = std::make_shared<counting_semaphore>(*aio, slots+queue-1);
+			l.sem = std::make_shared<counting_semaphore>(*aio, slots);
+			l.timer = std::make_shared<asio::deadline_timer>(*aio);
+			l.http = true;
+			http_acc = l.acc;
+			std::clog << "start serving http at " << l.ep << std::endl;
+			return l;
+		}
+		void accept_handoff(const std::string &path) {
+			handoff_server(aio, path, acc, connections, http_acc)();
+		}
 	private:
 		std::shared_ptr<asio::io_service> aio;
 		tcp::endpoint ep;
@@ -799,7 +1658,12 @@ namespace wandbox {
 		std::shared_ptr<asio::signal_set> sigs;
 		std::shared_ptr<DIR> basedir;
 		std::shared_ptr<tcp::socket> sock;
+		std::shared_ptr<counting_semaphore> conns;
 		std::shared_ptr<counting_semaphore> sem;
+		std::shared_ptr<int> connections;
+		std::shared_ptr<asio::deadline_timer> timer;
+		bool http;
+		std::shared_ptr<tcp::acceptor> http_acc;
 	};
 
 }
@@ -807,6 +1671,7 @@ int main(int argc, char **argv) {
 	using namespace wandbox;
 
 	std::shared_ptr<std::streambuf> logbuf(std::clog.rdbuf(), [](void*){});
+	std::string handoff;
 
 	{
 		namespace po = boost::program_options;
@@ -818,6 +1683,7 @@ int main(int argc, char **argv) {
 				("help,h", "show this help")
 				("config,c", po::value<std::vector<std::string>>(&config_files), "specify config file")
 				("syslog", "use syslog for trace")
+				("handoff", po::value<std::string>(&handoff), "take the listening socket over from the server accepting handoff at this unix socket, and accept handoff there")
 				("verbose", "be verbose")
 			;
 
@@ -842,8 +1708,12 @@ int main(int argc, char **argv) {
 			throw;
 		}
 	}
+	memory.set_limit(config.system.memory_budget);
 	auto aio = std::make_shared<asio::io_service>();
-	listener s(aio, boost::asio::ip::tcp::v4(), config.system.listen_port);
+	auto handed = handoff.empty() ? std::vector<unique_fd>() : receive_listening_sockets(*aio, handoff);
+	listener s(aio, tcp::endpoint(tcp::v4(), config.system.listen_port), handed.size() > 0 ? handed[0].release() : -1);
+	if (config.system.http_port != 0) s.serve_http(tcp::endpoint(tcp::v4(), config.system.http_port), handed.size() > 1 ? handed[1].release() : -1)();
+	if (!handoff.empty()) s.accept_handoff(handoff);
 	s();
 	aio->run();
 }
@@ -0,0 +1,95 @@
+#ifndef SHA256_HPP_
+#define SHA256_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace wandbox {
+	// sha-256, for names that must not collide even when whoever chooses the contents wants them to
+	class sha256 {
+	public:
+		sha256(): h{ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 }, len(0), fill(0) { }
+
+		void update(const char *p, std::size_t n) {
+			len += n;
+			while (n != 0) {
+				const auto k = std::min(n, sizeof(buf) - fill);
+				std::memcpy(buf + fill, p, k);
+				fill += k;
+				p += k;
+				n -= k;
+				if (fill == sizeof(buf)) {
+					block(buf);
+					fill = 0;
+				}
+			}
+		}
+		void update(const std::string &s) { update(s.data(), s.size()); }
+		// `s' with its length in front, so that a run of fields hashes differently from any other run
+		void field(const std::string &s) {
+			const auto n = static_cast<std::uint64_t>(s.size());
+			char size[8];
+			for (int i = 0; i < 8; ++i) size[i] = static_cast<char>(n >> (56 - i * 8));
+			update(size, sizeof(size));
+			update(s);
+		}
+		// lower case hex of the digest; the object is used up
+		std::string hex_digest() {
+			const std::uint64_t bits = len * 8;
+			const char pad = '\x80';
+			update(&pad, 1);
+			const char zero = '\0';
+			while (fill != 56) update(&zero, 1);
+			char size[8];
+			for (int i = 0; i < 8; ++i) size[i] = static_cast<char>(bits >> (56 - i * 8));
+			update(size, sizeof(size));
+			static const char hex[] = "0123456789abcdef";
+			std::string ret;
+			for (const auto x: h) for (int i = 28; i >= 0; i -= 4) ret += hex[(x >> i) & 0xf];
+			return ret;
+		}
+		static std::string hex_digest(const std::string &s) {
+			sha256 d;
+			d.update(s);
+			return d.hex_digest();
+		}
+	private:
+		static std::uint32_t rotr(std::uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+		void block(const unsigned char *p) {
+			static const std::uint32_t k[64] = {
+				0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+				0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+				0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+				0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+				0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+				0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+				0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+				0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+			};
+			std::uint32_t w[64];
+			for (int i = 0; i < 16; ++i) w[i] = std::uint32_t(p[i*4]) << 24 | std::uint32_t(p[i*4+1]) << 16 | std::uint32_t(p[i*4+2]) << 8 | p[i*4+3];
+			for (int i = 16; i < 64; ++i) {
+				const auto s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+				const auto s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+				w[i] = w[i-16] + s0 + w[i-7] + s1;
+			}
+			std::uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+			for (int i = 0; i < 64; ++i) {
+				const auto t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+				const auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+				hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+			}
+			h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+		}
+
+		std::uint32_t h[8];
+		std::uint64_t len;
+		std::size_t fill;
+		unsigned char buf[64];
+	};
+}
+
+#endif
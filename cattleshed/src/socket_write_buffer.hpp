@@ -0,0 +1,195 @@
+#ifndef SOCKET_WRITE_BUFFER_HPP_
+#define SOCKET_WRITE_BUFFER_HPP_
+
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "handler_arena.hpp"
+#include "http_api.hpp"
+#include "memory_budget.hpp"
+#include "quoted_printable.hpp"
+
+namespace wandbox {
+	// the frames sent to one client. frames queued while a write is in progress go out together in the
+	// next one; both buffers keep their capacity, so a steady stream of output allocates nothing.
+	// a frame whose data is spliced from a pipe ends the next write, and frames queued after it wait in `tail'.
+	// only used from the io_service thread, so the handlers are called without holding anything.
+	struct socket_write_buffer: std::enable_shared_from_this<socket_write_buffer> {
+		// frames are written as they are, or turned into an http response by `encoder'
+		socket_write_buffer(std::shared_ptr<boost::asio::ip::tcp::socket> sock, memory_budget &budget, std::shared_ptr<frame_encoder> encoder = nullptr)
+			 : sock(std::move(sock)),
+			   encoder(std::move(encoder)),
+			   arena(std::make_shared<handler_arena>()),
+			   front_handlers(),
+			   back_handlers(),
+			   front_buf(),
+			   back_buf(),
+			   tail_handlers(),
+			   tail_buf(),
+			   front_splice_fd(-1),
+			   front_splice_len(0),
+			   back_splice_fd(-1),
+			   back_splice_len(0),
+			   encoded(),
+			   writing(false),
+			   held(budget),
+			   encoder_held(0)
+		{ }
+		template <typename Handler>
+		void async_write_command(const std::string &cmd, const std::string &data, Handler &&handler) {
+			async_write_command(cmd, data.data(), data.size(), std::forward<Handler>(handler));
+		}
+		// `data' is encoded straight into the buffer being filled and need not outlive the call
+		template <typename Handler>
+		void async_write_command(const std::string &cmd, const char *data, std::size_t len, Handler &&handler) {
+			auto &buf = back_splice_len != 0 ? tail_buf : back_buf;
+			const auto before = buf.size();
+			if (encoder) {
+				buf += encoder->encode(cmd, std::string(data, len));
+				// what the encoder keeps for a later frame is held like the output waiting in the buffers
+				const auto kept = encoder->buffered();
+				if (kept > encoder_held) held.grow(kept - encoder_held);
+				else held.shrink(encoder_held - kept);
+				encoder_held = kept;
+			} else {
+				encoded.clear();
+				quoted_printable::encode(data, len, encoded);
+				buf += cmd;
+				buf += ' ';
+				buf += std::to_string(encoded.size());
+				buf += ':';
+				buf += encoded;
+				buf += '\n';
+			}
+			// already in memory; a slow client makes the other buffers wait instead
+			held.grow(buf.size() - before);
+			(back_splice_len != 0 ? tail_handlers : back_handlers).emplace_back(std::forward<Handler>(handler));
+			flush();
+		}
+		// a frame whose data is the next `len' octets of the pipe `fd' as they are, moved to the socket by the
+		// kernel. `fd' must stay open until `handler' is called, and only one such frame may be queued at a time.
+		template <typename Handler>
+		void async_splice_command(const std::string &cmd, int fd, std::size_t len, Handler &&handler) {
+			const auto before = back_buf.size();
+			back_buf += cmd;
+			back_buf += ' ';
+			back_buf += std::to_string(len);
+			back_buf += ':';
+			tail_buf += '\n';
+			held.grow(back_buf.size() - before + 1);
+			back_splice_fd = fd;
+			back_splice_len = len;
+			back_handlers.emplace_back(std::forward<Handler>(handler));
+			flush();
+		}
+		void on_wrote(const boost::system::error_code &ec) {
+			// the client is gone: a closed socket fails every write at once, where another write on a reset one
+			// may wait for the socket forever, and the output of the program is drained as it is dropped
+			if (ec) {
+				boost::system::error_code ignored;
+				sock->close(ignored);
+			}
+			if (front_splice_len != 0) return splice();
+			// `writing' is still set, so the frames the handlers queue wait for the next write
+			for (const auto &x: front_handlers) x();
+			writing = false;
+			held.shrink(front_buf.size());
+			front_buf.clear();
+			front_handlers.clear();
+			if (!back_buf.empty() || !back_handlers.empty()) flush();
+		}
+		void flush() {
+			if (!writing) {
+				std::swap(front_handlers, back_handlers);
+				std::swap(front_buf, back_buf);
+				front_splice_fd = back_splice_fd;
+				front_splice_len = back_splice_len;
+				back_splice_fd = -1;
+				back_splice_len = 0;
+				if (front_splice_len != 0) {
+					std::swap(back_handlers, tail_handlers);
+					std::swap(back_buf, tail_buf);
+				}
+				boost::asio::async_write(*sock, boost::asio::buffer(front_buf), in_arena(arena, std::bind<void>(std::mem_fn(&socket_write_buffer::on_wrote), shared_from_this(), std::placeholders::_1)));
+				writing = true;
+			}
+		}
+		// moves the data of the spliced frame, waiting for the socket whenever it is full
+		void splice(const boost::system::error_code &waited = boost::system::error_code()) {
+			auto ec = waited;
+			if (!ec) sock->native_non_blocking(true, ec);
+			while (!ec && front_splice_len != 0) {
+				const auto n = splice_to_socket(front_splice_fd, sock->native_handle(), front_splice_len);
+				if (n > 0) {
+					front_splice_len -= n;
+				} else if (n == -1 && errno == EAGAIN) {
+					return sock->async_wait(boost::asio::ip::tcp::socket::wait_write, in_arena(arena, std::bind<void>(std::mem_fn(&socket_write_buffer::splice), shared_from_this(), std::placeholders::_1)));
+				} else if (n == -1 && errno == EINTR) {
+				} else if (n == -1) {
+					ec = boost::system::error_code(errno, boost::system::system_category());
+				} else {
+					break;
+				}
+			}
+			// the client is gone; the data is dropped as a failed write would drop it
+			char discard[4096];
+			while (front_splice_len != 0) {
+				const auto n = ::read(front_splice_fd, discard, std::min(sizeof(discard), front_splice_len));
+				if (n <= 0 && !(n == -1 && errno == EINTR)) break;
+				if (n > 0) front_splice_len -= n;
+			}
+			front_splice_len = 0;
+			on_wrote(ec);
+		}
+		// splice() has no MSG_NOSIGNAL: the SIGPIPE of a client that is gone is blocked and taken back
+		static ssize_t splice_to_socket(int from, int to, std::size_t len) {
+			::sigset_t pipe_signal, old;
+			sigemptyset(&pipe_signal);
+			sigaddset(&pipe_signal, SIGPIPE);
+			::pthread_sigmask(SIG_BLOCK, &pipe_signal, &old);
+			const auto n = ::splice(from, nullptr, to, nullptr, len, SPLICE_F_MOVE|SPLICE_F_MORE|SPLICE_F_NONBLOCK);
+			const int e = errno;
+			if (n == -1 && e == EPIPE) {
+				const ::timespec zero = { 0, 0 };
+				::sigtimedwait(&pipe_signal, nullptr, &zero);
+			}
+			::pthread_sigmask(SIG_SETMASK, &old, nullptr);
+			errno = e;
+			return n;
+		}
+
+		std::shared_ptr<boost::asio::ip::tcp::socket> sock;
+		std::shared_ptr<frame_encoder> encoder;
+		// for the write and for the reads of the pipes whose output is forwarded here
+		std::shared_ptr<handler_arena> arena;
+		std::vector<std::function<void()>> front_handlers;
+		std::vector<std::function<void()>> back_handlers;
+		std::string front_buf;
+		std::string back_buf;
+		std::vector<std::function<void()>> tail_handlers;
+		std::string tail_buf;
+		int front_splice_fd;
+		std::size_t front_splice_len;
+		int back_splice_fd;
+		std::size_t back_splice_len;
+		std::string encoded;
+		bool writing;
+		memory_lease held;
+		std::size_t encoder_held;
+	};
+}
+
+#endif
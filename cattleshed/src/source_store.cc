@@ -0,0 +1,49 @@
+#include "source_store.hpp"
+
+#include <fstream>
+#include <iterator>
+
+#include "posixapi.hpp"
+#include "sha256.hpp"
+
+namespace wandbox {
+	source_store::source_store(const std::string &dir, int ttl)
+		 : dir(dir),
+		   ttl(ttl)
+	{
+	}
+
+	bool source_store::contains(const std::string &hash) const {
+		if (!valid(hash)) return false;
+		const auto path = dir + "/" + hash;
+		// a source the client was told about is kept for another ttl
+		return ::utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+	}
+
+	bool source_store::load(const std::string &hash, std::string &content) const {
+		if (!contains(hash)) return false;
+		std::ifstream is(dir + "/" + hash, std::ios::binary);
+		content.assign(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+		return !is.bad() && source_store::hash(content) == hash;
+	}
+
+	void source_store::save(const std::string &content) const {
+		remove_files_older_than(dir, ttl);
+		const auto path = dir + "/" + hash(content);
+		if (::utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0) return;
+		write_file_atomically(path, [&content](std::ostream &os) {
+			os.write(content.data(), content.size());
+		});
+	}
+
+	std::string source_store::hash(const std::string &s) {
+		return sha256::hex_digest(s);
+	}
+
+	bool source_store::valid(const std::string &hash) {
+		if (hash.size() != 64) return false;
+		for (const char c: hash) if (!(('0' <= c && c <= '9') || ('a' <= c && c <= 'f'))) return false;
+		return true;
+	}
+
+}
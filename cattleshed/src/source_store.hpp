@@ -0,0 +1,30 @@
+#ifndef SOURCE_STORE_HPP_
+#define SOURCE_STORE_HPP_
+
+#include <string>
+
+namespace wandbox {
+	// sources received earlier, named by the sha-256 of their contents, so that a client can send
+	// the hash instead of a file the server already has.
+	class source_store {
+	public:
+		source_store(const std::string &dir, int ttl);
+		source_store(const source_store &) = delete;
+		source_store &operator =(const source_store &) = delete;
+
+		bool contains(const std::string &hash) const;
+		bool load(const std::string &hash, std::string &content) const;
+		void save(const std::string &content) const;
+
+		// lower case hex sha-256 of `s'
+		static std::string hash(const std::string &s);
+		// whether `hash' looks like what hash() returns, and so is safe as a file name
+		static bool valid(const std::string &hash);
+	private:
+
+		std::string dir;
+		int ttl;
+	};
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include "trace.hpp"
+
+#include <chrono>
+#include <fstream>
+#include <random>
+
+#include <unistd.h>
+
+namespace wandbox {
+	trace_recorder::trace_recorder(std::string dir, int sample_rate, int slow_threshold)
+		 : dir(std::move(dir)),
+		   sample_rate(sample_rate),
+		   slow_threshold(slow_threshold),
+		   trace_id(),
+		   started(now()),
+		   spans(),
+		   mtx()
+	{
+	}
+	trace_recorder::~trace_recorder() {
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	void trace_recorder::set_id(std::string id) {
+		std::unique_lock<std::mutex> l(mtx);
+		trace_id.clear();
+		for (const char c: id) {
+			if (trace_id.size() >= 64) break;
+			if (('0' <= c && c <= '9') || ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '-' || c == '_') trace_id.push_back(c);
+		}
+	}
+	std::string trace_recorder::id() const {
+		std::unique_lock<std::mutex> l(mtx);
+		return trace_id;
+	}
+	std::size_t trace_recorder::begin(std::string name, int lane) {
+		std::unique_lock<std::mutex> l(mtx);
+		const auto t = now();
+		spans.push_back({ std::move(name), lane, t, t });
+		return spans.size() - 1;
+	}
+	void trace_recorder::end(std::size_t span) {
+		std::unique_lock<std::mutex> l(mtx);
+		if (span < spans.size()) spans[span].end = now();
+	}
+	void trace_recorder::add(std::string name, std::int64_t begin, std::int64_t end, int lane) {
+		std::unique_lock<std::mutex> l(mtx);
+		spans.push_back({ std::move(name), lane, begin, end });
+	}
+
+	std::int64_t trace_recorder::now() {
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+	std::string trace_recorder::make_id() {
+		static const char tbl[] = "0123456789abcdef";
+		std::random_device seed_gen;
+		std::mt19937 engine(seed_gen());
+		std::uniform_int_distribution<> dist(0, 15);
+		std::string id;
+		while (id.size() < 16) id.push_back(tbl[dist(engine)]);
+		return id;
+	}
+	bool trace_recorder::sampled(const std::string &id, int sample_rate) {
+		if (sample_rate <= 0) return false;
+		if (sample_rate >= 100) return true;
+		// FNV-1a, shared with kennel so both sides sample the same traces
+		std::uint32_t h = 2166136261u;
+		for (const char c: id) {
+			h ^= static_cast<unsigned char>(c);
+			h *= 16777619u;
+		}
+		return static_cast<int>(h % 100) < sample_rate;
+	}
+
+	void trace_recorder::flush() {
+		std::unique_lock<std::mutex> l(mtx);
+		if (dir.empty()) return;
+		const auto elapsed = now() - started;
+		const bool slow = slow_threshold > 0 && elapsed >= static_cast<std::int64_t>(slow_threshold) * 1000;
+		if (!slow && (trace_id.empty() || !sampled(trace_id, sample_rate))) return;
+		if (trace_id.empty()) trace_id = make_id();
+
+		std::ofstream os(dir + "/" + trace_id + ".cattleshed.json");
+		if (!os) return;
+		const auto pid = ::getpid();
+		os << "{\"traceEvents\":[";
+		os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"cattleshed\"}}";
+		os << ",{\"name\":\"connection\",\"cat\":\"cattleshed\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":0,\"ts\":" << started << ",\"dur\":" << elapsed << "}";
+		for (const auto &s: spans) {
+			os << ",{\"name\":\"" << s.name << "\",\"cat\":\"cattleshed\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":" << s.lane << ",\"ts\":" << s.begin << ",\"dur\":" << (s.end - s.begin) << "}";
+		}
+		os << "],\"otherData\":{\"trace-id\":\"" << trace_id << "\",\"slow\":" << (slow ? "true" : "false") << "}}\n";
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef TRACE_HPP_
+#define TRACE_HPP_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace wandbox {
+	struct trace_span {
+		std::string name;
+		int lane;
+		std::int64_t begin;
+		std::int64_t end;
+	};
+
+	// collects spans of one connection and dumps them as chrome trace_event json on destruction
+	// when the run was sampled or took longer than the slow threshold.
+	class trace_recorder {
+	public:
+		trace_recorder(std::string dir, int sample_rate, int slow_threshold);
+		~trace_recorder();
+		trace_recorder(const trace_recorder &) = delete;
+		trace_recorder &operator =(const trace_recorder &) = delete;
+
+		void set_id(std::string id);
+		std::string id() const;
+		std::size_t begin(std::string name, int lane = 0);
+		void end(std::size_t span);
+		void add(std::string name, std::int64_t begin, std::int64_t end, int lane = 0);
+
+		static std::int64_t now();
+		static std::string make_id();
+		static bool sampled(const std::string &id, int sample_rate);
+	private:
+		void flush();
+
+		std::string dir;
+		int sample_rate;
+		int slow_threshold;
+		std::string trace_id;
+		std::int64_t started;
+		std::vector<trace_span> spans;
+		mutable std::mutex mtx;
+	};
+}
+
+#endif
@@ -0,0 +1,285 @@
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <boost/asio.hpp>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "benchmark.hpp"
+#include "build_cache.hpp"
+#include "frame.hpp"
+#include "http_api.hpp"
+#include "load_config.hpp"
+#include "posixapi.hpp"
+#include "quoted_printable.hpp"
+#include "sha256.hpp"
+#include "socket_write_buffer.hpp"
+
+namespace {
+	using namespace wandbox;
+
+	int failures = 0;
+
+	void check(bool ok, const std::string &what) {
+		if (ok) return;
+		std::cerr << "FAIL: " << what << std::endl;
+		++failures;
+	}
+
+	void test_quoted_printable() {
+		const std::string line(76, 'a');
+		check(quoted_printable::encode(line) == line, "76 octets fit on one line");
+		check(quoted_printable::encode(line + line + "b") == line + "=\n" + line + "=\nb", "a soft line break after every 76 octets");
+		check(quoted_printable::encode("a=b\n\x01\xff") == "a=3Db=0A=01=FF", "escapes '=', controls and 8-bit octets");
+		check(quoted_printable::decode("ab=\ncd=3D=0a") == "ab" "cd=\n", "decodes soft line breaks and escapes");
+
+		std::string all;
+		for (int n = 0; n < 3; ++n) for (int c = 0; c < 256; ++c) all += static_cast<char>(c);
+		check(quoted_printable::decode(quoted_printable::encode(all)) == all, "every octet round trips");
+		std::string appended = "x";
+		quoted_printable::encode(all.data(), all.size(), appended);
+		check(appended == "x" + quoted_printable::encode(all), "encode appends to the buffer it is given");
+	}
+
+	void test_frame() {
+		const std::string frames = "Control 5:Start\nStdIn 4:a=3D\n";
+		// a read may end anywhere; nothing is taken until a whole frame is there
+		for (std::size_t k = 0; k <= frames.size(); ++k) {
+			const std::string buf = frames.substr(0, k);
+			auto ite = buf.begin();
+			std::string command, data;
+			const bool complete = parse_frame(ite, buf.end(), command, data);
+			check(complete == (k >= 16), "frame is complete after " + std::to_string(k) + " octets");
+			if (!complete) {
+				check(ite == buf.begin(), "an incomplete frame is left unread at " + std::to_string(k));
+				continue;
+			}
+			check(command == "Control" && data == "Start" && ite == buf.begin() + 16, "first frame at " + std::to_string(k));
+			command.clear();
+			data.clear();
+			check(parse_frame(ite, buf.end(), command, data) == (k == frames.size()), "second frame at " + std::to_string(k));
+			if (k == frames.size()) check(command == "StdIn" && data == "a=3D" && ite == buf.end(), "second frame is left encoded");
+		}
+	}
+
+	void test_sha256() {
+		check(sha256::hex_digest("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", "sha-256 of nothing");
+		check(sha256::hex_digest("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", "sha-256 of one block");
+		const std::string two = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+		check(sha256::hex_digest(two) == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1", "sha-256 of two blocks");
+		sha256 pieces;
+		for (const char c: two) pieces.update(&c, 1);
+		check(pieces.hex_digest() == sha256::hex_digest(two), "sha-256 of a string given in pieces");
+		sha256 a, b;
+		a.field("ab");
+		a.field("c");
+		b.field("a");
+		b.field("bc");
+		check(a.hex_digest() != b.hex_digest(), "fields are told apart by their lengths");
+	}
+
+	void test_normalize() {
+		check(build_cache::normalize("a.h") == "a.h", "a header next to the source");
+		check(build_cache::normalize("./inc//b/../c.h") == "inc/c.h", "'.', '..' and empty parts are dropped");
+		check(build_cache::normalize("inc/..") == "", "a path back to the store itself");
+		check(build_cache::normalize("../a.h").empty(), "a path out of the store");
+		check(build_cache::normalize("inc/../../a.h").empty(), "a path out of the store through a directory");
+		check(build_cache::normalize("/etc/passwd").empty(), "an absolute path");
+		check(build_cache::normalize("").empty(), "an empty path");
+	}
+
+	bool same(const benchmark_options &opts, int runs, int warmup, bool perf) {
+		return opts.runs == runs && opts.warmup == warmup && opts.perf == perf;
+	}
+
+	void test_benchmark_options() {
+		check(same(benchmark_options::parse("", 100), 10, 1, false), "defaults of an empty Benchmark frame");
+		check(same(benchmark_options::parse("runs=5,warmup=2,perf", 100), 5, 2, true), "items split on ','");
+		check(same(benchmark_options::parse("perf\nruns=3", 100), 3, 1, true), "items split on lines");
+		check(same(benchmark_options::parse("runs=1000", 100), 100, 0, false), "runs are at most max_runs and leave no room for warmups");
+		check(same(benchmark_options::parse("runs=0,warmup=-3", 100), 1, 0, false), "at least one run and no negative warmups");
+		check(same(benchmark_options::parse("runs=8,warmup=9", 10), 8, 2, false), "warmups fill what runs leave of max_runs");
+		check(same(benchmark_options::parse("runs=x,speed=9", 100), 1, 1, false), "a run count that is not a number and unknown items");
+	}
+
+	void test_http_request() {
+		http_request req;
+		check(http_request::parse("POST /api/compile.json?x=1 HTTP/1.1\r\nHost: a\r\nContent-Type:  application/json \t\r\nContent-Length: 42", req), "a request with a body");
+		check(req.method == "POST" && req.target == "/api/compile.json", "the method, and the target without its query");
+		check(req.headers["host"] == "a" && req.headers["content-type"] == "application/json", "header names in lower case and values trimmed");
+		check(req.content_length == 42, "the content length");
+		check(http_request::parse("GET /api/list.json HTTP/1.0", req) && req.headers.empty() && req.content_length == 0, "a request without headers");
+		check(!http_request::parse("GET /api/list.json", req), "a request line without a version");
+		check(!http_request::parse("GET /api/list.json SPDY/3", req), "a version that is not http/1");
+		check(!http_request::parse("GET / HTTP/1.1\r\nno colon", req), "a header without a colon");
+		check(!http_request::parse("GET / HTTP/1.1\r\n: empty name", req), "a header without a name");
+		check(!http_request::parse("POST / HTTP/1.1\r\nContent-Length: -1", req), "a content length that is not a number");
+		check(!http_request::parse("POST / HTTP/1.1\r\nContent-Length: 1234567890123", req), "a content length of more than 12 digits");
+		check(!http_request::parse("POST / HTTP/1.1\r\nTransfer-Encoding: chunked", req), "a chunked body");
+	}
+
+	void test_compile_request() {
+		std::unordered_map<std::string, std::string> received;
+		std::string code, error;
+		check(parse_compile_request("{\"compiler\":\"gcc-head\",\"code\":\"int main(){}\",\"stdin\":\"in\",\"options\":\"warning\",\"compiler-option-raw\":\"-O2\\n-g\",\"runtime-option-raw\":\"a\",\"build-session\":\"s\",\"cache-output\":true,\"save\":false}", received, code, error), "a compile request");
+		check(received["Control"] == "compiler=gcc-head" && code == "int main(){}", "the compiler and the source");
+		check(received["StdIn"] == "in" && received["CompilerOption"] == "warning" && received["CompilerOptionRaw"] == "-O2\n-g" && received["RuntimeOptionRaw"] == "a", "the options as kennel sends them");
+		check(received["BuildSession"] == "s" && received.count("CacheOutput") == 1 && received.count("Benchmark") == 0, "a build session and cached output");
+
+		received.clear();
+		check(parse_compile_request("{\"compiler\":\"gcc-head\",\"benchmark\":{\"runs\":3,\"perf\":true}}", received, code, error), "a benchmark request");
+		check(received["Benchmark"] == "runs=3,warmup=1,perf" && received.count("BuildSession") == 0 && received.count("CacheOutput") == 0, "benchmark options with their defaults");
+		received.clear();
+		check(parse_compile_request("{\"compiler\":\"gcc-head\",\"benchmark\":{}}", received, code, error) && received["Benchmark"] == "runs=10,warmup=1", "a benchmark with no options");
+
+		check(!parse_compile_request("[1]", received, code, error) && error == "the body is not a json object", "a body that is not an object");
+		check(!parse_compile_request("{\"compiler\":", received, code, error), "a body that is not json");
+		check(!parse_compile_request("{\"code\":\"x\"}", received, code, error) && error == "compiler is not given", "no compiler");
+		check(!parse_compile_request("{\"compiler\":\"gcc-head\",\"save\":true}", received, code, error) && error == "permlinks are saved by kennel", "a permlink");
+	}
+
+	void test_compile_json_memory() {
+		const std::string out(1000, 'x');
+		const auto encoder = make_compile_json_encoder();
+		encoder->encode("StdOut", out);
+		encoder->encode("StdErr", out);
+		check(encoder->buffered() == 4 * out.size(), "the output is kept for program_output, program_error and both messages");
+		const auto response = encoder->encode("Control", "Finish");
+		check(encoder->buffered() == 0 && response.find("\"program_output\":\"" + out + "\"") != std::string::npos, "and sent on Finish");
+
+		boost::asio::io_service aio;
+		memory_budget budget;
+		const auto sockbuf = std::make_shared<socket_write_buffer>(std::make_shared<boost::asio::ip::tcp::socket>(aio), budget, make_compile_json_encoder());
+		sockbuf->async_write_command("StdOut", out, [] { });
+		sockbuf->async_write_command("StdErr", out, [] { });
+		check(budget.used() == 4 * out.size(), "the output a json response keeps until Finish is held in the memory budget");
+	}
+
+	void test_write_to_closed_client() {
+		namespace asio = boost::asio;
+		using asio::ip::tcp;
+		asio::io_service aio;
+		tcp::acceptor acc(aio, tcp::endpoint(asio::ip::address_v4::loopback(), 0));
+		tcp::socket client(aio);
+		client.connect(acc.local_endpoint());
+		const auto sock = std::make_shared<tcp::socket>(aio);
+		acc.accept(*sock);
+		// the client is gone in the middle of a run without reading anything
+		client.set_option(asio::socket_base::linger(true, 0));
+		client.close();
+
+		memory_budget budget;
+		const auto sockbuf = std::make_shared<socket_write_buffer>(sock, budget);
+		asio::deadline_timer timeout(aio, boost::posix_time::seconds(10));
+		timeout.async_wait([&aio](boost::system::error_code ec) { if (!ec) aio.stop(); });
+		// every frame is queued once the last one is written, as the output of a running program is
+		const std::string data(65536, 'x');
+		const int frames = 100;
+		int written = 0;
+		std::function<void ()> next = [&] {
+			if (++written < frames) sockbuf->async_write_command("StdOut", data, next);
+			else timeout.cancel();
+		};
+		sockbuf->async_write_command("StdOut", data, next);
+		aio.run();
+		check(written == frames, "every write to a client that is gone completes");
+		check(!sock->is_open(), "the socket is closed once a write failed");
+	}
+
+	struct config_file {
+		std::string path;
+		explicit config_file(const std::string &contents) {
+			char name[] = "/tmp/cattleshed-test-XXXXXX";
+			const int fd = ::mkstemp(name);
+			if (fd == -1) throw_system_error(errno);
+			path = name;
+			if (::write(fd, contents.data(), contents.size()) != static_cast<ssize_t>(contents.size())) throw_system_error(errno);
+			::close(fd);
+		}
+		~config_file() {
+			::unlink(path.c_str());
+		}
+	};
+
+	std::string make_config(const std::string &system, const std::string &stage_jail) {
+		return "{\"system\":{" + system + "},"
+			"\"jail\":{\"\":{\"jail-command\":[\"/usr/bin/env\"]},\"jvm\":{\"jail-command\":[\"/usr/bin/env\"]}},"
+			"\"switches\":{},"
+			"\"compilers\":[{\"name\":\"cc\",\"run-command\":[\"./prog.exe\"],\"jail-name\":\"\","
+			"\"stages\":[{\"name\":\"run\",\"command\":[\"./prog.exe\"],\"jail-name\":\"" + stage_jail + "\"}]}]}\n";
+	}
+
+	void test_load_config() {
+		{
+			const config_file f(make_config("\"artifact-size-limit\":4294967296,\"artifact-quota\":10737418240,\"memory-budget\":8589934592", ""));
+			const auto config = load_config({ f.path });
+			check(config.system.artifact_size_limit == 4294967296LL, "artifact-size-limit over 2^32");
+			check(config.system.artifact_quota == 10737418240LL, "artifact-quota over 2^32");
+			check(config.system.memory_budget == 8589934592LL, "memory-budget over 2^32");
+		}
+		{
+			const config_file f(make_config("\"listen-port\":4294967296", ""));
+			bool rejected = false;
+			try { load_config({ f.path }); } catch (const std::out_of_range &) { rejected = true; }
+			check(rejected, "an int setting that does not fit is rejected");
+		}
+		{
+			const config_file f(make_config("", "jvm"));
+			check(load_config({ f.path }).compilers.size() == 1, "a stage may run in a jail other than the compiler's");
+		}
+		{
+			const config_file f(make_config("", "nosuch"));
+			bool rejected = false;
+			try { load_config({ f.path }); } catch (const std::runtime_error &) { rejected = true; }
+			check(rejected, "a stage in an unknown jail is rejected");
+		}
+	}
+
+	void test_expiry() {
+		const auto dir = wandbox::mkdtemp("/tmp/cattleshed-test-XXXXXX");
+		check(write_file_atomically(dir + "/old", [](std::ostream &os) { os << "old"; }), "a file is written");
+		check(write_file_atomically(dir + "/new", [](std::ostream &os) { os << "new"; }), "another file is written");
+		check(!write_file_atomically(dir + "/nosuch/file", [](std::ostream &) {}), "a file in a missing directory is not");
+		wandbox::mkdir(dir + "/sub", 0700);
+		const struct ::timespec past[2] = { { 0, UTIME_OMIT }, { ::time(nullptr) - 100, 0 } };
+		::utimensat(AT_FDCWD, (dir + "/old").c_str(), past, 0);
+		::utimensat(AT_FDCWD, (dir + "/sub").c_str(), past, 0);
+
+		const auto d = wandbox::opendir(dir);
+		check(entries_older_than(d, S_IFREG, 10) == std::vector<std::string>{ "old" }, "the files older than ttl");
+		check(entries_older_than(d, S_IFDIR, 10) == std::vector<std::string>{ "sub" }, "the directories older than ttl");
+		remove_files_older_than(dir, 10);
+		std::vector<std::string> files;
+		list_files_at(nullptr, dir, files);
+		check(files == std::vector<std::string>{ "new" }, "only the old file is removed");
+		check(::access((dir + "/new.tmp" + std::to_string(::getpid())).c_str(), F_OK) == -1, "no temporary file is left");
+
+		::utimensat(AT_FDCWD, (dir + "/new").c_str(), past, 0);
+		remove_files_older_than(dir, 10);
+		check(::access((dir + "/new").c_str(), F_OK) == 0, "a directory is not looked through again within ttl");
+
+		::unlink((dir + "/new").c_str());
+		::rmdir((dir + "/sub").c_str());
+		::rmdir(dir.c_str());
+	}
+}
+
+int main() {
+	test_quoted_printable();
+	test_frame();
+	test_sha256();
+	test_normalize();
+	test_benchmark_options();
+	test_http_request();
+	test_compile_request();
+	test_compile_json_memory();
+	test_write_to_closed_client();
+	test_load_config();
+	test_expiry();
+	if (failures != 0) std::cerr << failures << " failed" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+#!/usr/bin/env python3
+# Drives kennel over HTTP and reports throughput, latency and kennel's
+# memory. Point kennel at stub_cattleshed.py so that only kennel is measured.
+#
+# Scenarios:
+#   compile          POST /compile, reading the event stream to its end
+#   compile-json     POST /api/compile.json
+#   list             GET  /api/list.json
+#   permlink-create  POST /permlink
+#   permlink-get     GET  /api/permlink/<name>
+#   all              every one of the above, one after another
+
+import argparse
+import http.client
+import json
+import statistics
+import sys
+import threading
+import time
+import urllib.parse
+
+SCENARIOS = ['compile', 'compile-json', 'list', 'permlink-create', 'permlink-get']
+
+
+def source(size):
+    line = '// ' + 'x' * 76 + '\n'
+    body = 'int main() {}\n'
+    return (line * (size // len(line) + 1))[:max(size - len(body), 0)] + body
+
+
+class Client:
+    def __init__(self, url, timeout):
+        u = urllib.parse.urlsplit(url)
+        self.host = u.hostname
+        self.port = u.port or 80
+        self.root = u.path.rstrip('/')
+        self.timeout = timeout
+        self.conn = None
+
+    def request(self, method, path, body=None, on_first=None):
+        if self.conn is None:
+            self.conn = http.client.HTTPConnection(self.host, self.port, timeout=self.timeout)
+        headers = {}
+        if body is not None:
+            body = json.dumps(body).encode('utf-8')
+            headers['Content-Type'] = 'application/json'
+        try:
+            self.conn.request(method, self.root + path, body, headers)
+            res = self.conn.getresponse()
+            data = []
+            while True:
+                chunk = res.read1(65536)
+                if not chunk:
+                    break
+                if on_first is not None and not data:
+                    on_first()
+                data.append(chunk)
+            # read1() leaves a response with Content-Length open once it is consumed
+            res.read()
+            if res.will_close:
+                self.close()
+            return res.status, b''.join(data)
+        except Exception:
+            self.close()
+            raise
+
+    def close(self):
+        if self.conn is not None:
+            self.conn.close()
+            self.conn = None
+
+
+class Scenario:
+    def __init__(self, args, links):
+        self.args = args
+        self.links = links
+        self.code = source(args.source_size)
+
+    def compile_body(self):
+        return {'compiler': self.args.compiler, 'code': self.code, 'options': '', 'stdin': ''}
+
+    def permlink_body(self):
+        return dict(self.compile_body(), **{
+            'compiler-option-raw': '',
+            'runtime-option-raw': '',
+            'outputs': [
+                {'type': 'Control', 'output': 'Start'},
+                {'type': 'StdOut', 'output': 'x' * self.args.output_size},
+                {'type': 'ExitCode', 'output': '0'},
+                {'type': 'Control', 'output': 'Finish'},
+            ],
+        })
+
+    # returns None on success, or the kind of error
+    def run(self, name, client, i, on_first):
+        if name == 'compile':
+            status, body = client.request('POST', '/compile', self.compile_body(), on_first)
+            if status == 200 and b'Control:Finish' not in body:
+                return 'truncated'
+        elif name == 'compile-json':
+            status, body = client.request('POST', '/api/compile.json', self.compile_body(), on_first)
+        elif name == 'list':
+            status, body = client.request('GET', '/api/list.json', None, on_first)
+        elif name == 'permlink-create':
+            status, body = client.request('POST', '/permlink', self.permlink_body(), on_first)
+            if status == 200:
+                self.links.append(json.loads(body)['link'])
+        elif name == 'permlink-get':
+            status, body = client.request('GET', '/api/permlink/' + self.links[i % len(self.links)], None, on_first)
+        return None if status == 200 else 'status %d' % status
+
+
+class Memory:
+    # samples VmRSS of kennel while a scenario runs; VmHWM would include the scenarios before it
+    def __init__(self, pid):
+        self.pid = pid
+        self.peak = 0
+        self.stopped = threading.Event()
+        self.thread = threading.Thread(target=self.sample, daemon=True)
+
+    def rss(self):
+        with open('/proc/%d/status' % self.pid) as f:
+            for line in f:
+                if line.startswith('VmRSS:'):
+                    return int(line.split()[1]) * 1024
+        return 0
+
+    def sample(self):
+        while not self.stopped.wait(0.05):
+            self.peak = max(self.peak, self.rss())
+
+    def __enter__(self):
+        self.peak = self.rss()
+        self.thread.start()
+        return self
+
+    def __exit__(self, *exc):
+        self.stopped.set()
+        self.thread.join()
+        self.peak = max(self.peak, self.rss())
+
+
+def percentiles(xs):
+    if not xs:
+        return {}
+    xs = sorted(xs)
+    at = lambda p: xs[min(len(xs) - 1, int(len(xs) * p))] * 1000
+    return {'min': xs[0] * 1000, 'mean': statistics.mean(xs) * 1000, 'p50': at(0.5), 'p90': at(0.9), 'p99': at(0.99), 'max': xs[-1] * 1000}
+
+
+def run_scenario(name, args, scenario):
+    lock = threading.Lock()
+    next_request = [0]
+    latency = []
+    first = []
+    errors = {}
+
+    def take():
+        with lock:
+            i = next_request[0]
+            next_request[0] += 1
+            return i
+
+    def worker(count):
+        client = Client(args.url, args.timeout)
+        while True:
+            i = take()
+            if i >= count:
+                break
+            start = time.monotonic()
+            first_at = []
+            try:
+                error = scenario.run(name, client, i, lambda: first_at.append(time.monotonic()))
+            except Exception as e:
+                error = type(e).__name__
+            end = time.monotonic()
+            with lock:
+                if error is None:
+                    latency.append(end - start)
+                    if first_at:
+                        first.append(first_at[0] - start)
+                else:
+                    errors[error] = errors.get(error, 0) + 1
+        client.close()
+
+    def spawn(count):
+        next_request[0] = 0
+        threads = [threading.Thread(target=worker, args=(count,)) for _ in range(args.concurrency)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+    if args.warmup:
+        spawn(args.warmup)
+        latency.clear()
+        first.clear()
+        errors.clear()
+
+    memory = Memory(args.kennel_pid) if args.kennel_pid else None
+    start = time.monotonic()
+    if memory:
+        with memory:
+            spawn(args.requests)
+    else:
+        spawn(args.requests)
+    elapsed = time.monotonic() - start
+
+    result = {
+        'scenario': name,
+        'requests': args.requests,
+        'concurrency': args.concurrency,
+        'elapsed': elapsed,
+        'requests_per_second': len(latency) / elapsed if elapsed else 0,
+        'errors': sum(errors.values()),
+        'error_kinds': errors,
+        'latency_ms': percentiles(latency),
+        'first_byte_ms': percentiles(first),
+    }
+    if memory:
+        result['peak_rss'] = memory.peak
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description='HTTP benchmark for kennel')
+    parser.add_argument('scenario', nargs='?', default='all', choices=SCENARIOS + ['all'])
+    parser.add_argument('--url', default='http://127.0.0.1:3500', help='kennel, including its root')
+    parser.add_argument('-c', '--compiler', default='stub-0')
+    parser.add_argument('-j', '--concurrency', type=int, default=16)
+    parser.add_argument('-n', '--requests', type=int, default=1000)
+    parser.add_argument('-w', '--warmup', type=int, default=0)
+    parser.add_argument('-t', '--timeout', type=float, default=60)
+    parser.add_argument('--source-size', type=int, default=1024)
+    parser.add_argument('--output-size', type=int, default=1024, help='octets of StdOut in a created permlink')
+    parser.add_argument('--links', type=int, default=100, help='permlinks created before permlink-get')
+    parser.add_argument('--kennel-pid', type=int, help='sample the RSS of this process')
+    parser.add_argument('--json', action='store_true', help='print the results as JSON')
+    args = parser.parse_args()
+
+    names = SCENARIOS if args.scenario == 'all' else [args.scenario]
+    links = []
+    scenario = Scenario(args, links)
+    if 'permlink-get' in names and 'permlink-create' not in names:
+        client = Client(args.url, args.timeout)
+        for i in range(args.links):
+            scenario.run('permlink-create', client, i, None)
+        client.close()
+
+    results = []
+    for name in names:
+        if name == 'permlink-get' and not links:
+            print('permlink-get: no permlinks were created', file=sys.stderr)
+            continue
+        results.append(run_scenario(name, args, scenario))
+
+    if args.json:
+        json.dump(results, sys.stdout, indent=2)
+        print()
+        return
+    print('%-16s %8s %7s %10s %9s %9s %9s %10s' % ('scenario', 'requests', 'errors', 'req/s', 'p50 ms', 'p99 ms', 'ttfb p50', 'peak RSS'))
+    for r in results:
+        print('%-16s %8d %7d %10.1f %9.2f %9.2f %9.2f %10s' % (
+            r['scenario'], r['requests'], r['errors'], r['requests_per_second'],
+            r['latency_ms'].get('p50', 0), r['latency_ms'].get('p99', 0), r['first_byte_ms'].get('p50', 0),
+            '%.1fM' % (r['peak_rss'] / 1048576) if 'peak_rss' in r else '-'))
+
+
+if __name__ == '__main__':
+    main()
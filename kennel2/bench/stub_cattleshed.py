@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+# Stands in for cattleshed when benchmarking kennel. A Version request is
+# answered with a list of fake compilers, Status with the runs in progress and
+# every run with a scripted sequence of frames, so that kennel is measured
+# without any compiler. Start several on different ports to try kennel with
+# several backends.
+#
+# The script is a JSON array of steps, each
+#   {"command": "StdOut", "data": "...", "size": N, "repeat": N, "delay": seconds}
+# sending `repeat' frames (default 1) whose content is `data', or `size'
+# octets of filler when `data' is missing, waiting `delay' seconds before each.
+# Without --script the reply is built from --output-size, --chunk-size,
+# --compile-delay and --chunk-delay.
+
+import argparse
+import asyncio
+import json
+import re
+import signal
+import sys
+
+
+def qp_encode(data):
+    out = []
+    line = 0
+    for b in data:
+        s = chr(b) if 33 <= b <= 126 and b != 61 else '=%02X' % b
+        if line + len(s) > 75:
+            out.append('=\n')
+            line = 0
+        out.append(s)
+        line += len(s)
+    return ''.join(out).encode('ascii')
+
+
+def qp_decode(data):
+    return re.sub(rb'=(\n|[0-9A-Fa-f]{2})', lambda m: b'' if m.group(1) == b'\n' else bytes([int(m.group(1), 16)]), data)
+
+
+def frame(command, data):
+    if isinstance(data, str):
+        data = data.encode('utf-8')
+    qp = qp_encode(data)
+    return command.encode('ascii') + b' ' + str(len(qp)).encode('ascii') + b':' + qp + b'\n'
+
+
+def filler(size):
+    line = b'x' * 79 + b'\n'
+    return (line * (size // len(line) + 1))[:size]
+
+
+def compiler_list(count, prefix):
+    return json.dumps([{
+        'name': '%s-%d' % (prefix, i),
+        'language': 'C++',
+        'display-name': '%s %d' % (prefix, i),
+        'version': '1.0.%d' % i,
+        'display-compile-command': 'g++ prog.cc',
+        'compiler-option-raw': True,
+        'runtime-option-raw': False,
+        'incremental-build': False,
+        'switches': [{
+            'name': 'warning',
+            'type': 'single',
+            'default': True,
+            'display-name': 'Warnings',
+            'display-flags': '-Wall -Wextra',
+        }],
+    } for i in range(count)], separators=(',', ':'))
+
+
+def default_script(args):
+    script = [
+        {'command': 'Control', 'data': 'Start', 'delay': args.compile_delay},
+        {'command': 'CompilerMessageE', 'data': 'prog.cc:1:1: warning: stub\n'},
+    ]
+    if args.output_size:
+        chunks, rest = divmod(args.output_size, args.chunk_size)
+        script.append({'command': 'StdOut', 'size': args.chunk_size, 'repeat': chunks, 'delay': args.chunk_delay})
+        if rest:
+            script.append({'command': 'StdOut', 'size': rest, 'delay': args.chunk_delay})
+    script += [
+        {'command': 'ExitCode', 'data': '0'},
+        {'command': 'Control', 'data': 'Finish'},
+    ]
+    return script
+
+
+async def read_frame(reader):
+    command = (await reader.readuntil(b' '))[:-1].decode('ascii')
+    size = int((await reader.readuntil(b':'))[:-1])
+    data = (await reader.readexactly(size + 1))[:-1]
+    return command, data
+
+
+class Stub:
+    def __init__(self, script, compilers, prefix):
+        # frames are encoded once; replies only differ in timing
+        self.steps = [(s.get('delay', 0), s.get('repeat', 1),
+                       frame(s['command'], s['data'] if 'data' in s else filler(s.get('size', 0))))
+                      for s in script]
+        self.version = frame('VersionResult', compiler_list(compilers, prefix))
+        self.requests = 0
+        self.running = 0
+
+    async def handle(self, reader, writer):
+        try:
+            while True:
+                command, data = await read_frame(reader)
+                if command == 'Version':
+                    writer.write(self.version)
+                    break
+                if command == 'Status':
+                    writer.write(frame('StatusResult', json.dumps({'running': self.running, 'queued': 0, 'max-connections': 32}, separators=(',', ':'))))
+                    break
+                data = qp_decode(data)
+                if command == 'Control' and (data in (b'run', b'prepare', b'run-batch', b'run-cases') or data.startswith(b'execute ')):
+                    await self.reply(writer)
+                    break
+            await writer.drain()
+            self.requests += 1
+        except (asyncio.IncompleteReadError, ConnectionError, ValueError):
+            pass
+        finally:
+            writer.close()
+
+    async def reply(self, writer):
+        self.running += 1
+        try:
+            await self.send_steps(writer)
+        finally:
+            self.running -= 1
+
+    async def send_steps(self, writer):
+        for delay, repeat, f in self.steps:
+            for _ in range(repeat):
+                if delay:
+                    await writer.drain()
+                    await asyncio.sleep(delay)
+                writer.write(f)
+                if writer.transport.get_write_buffer_size() > 1 << 20:
+                    await writer.drain()
+
+
+async def main():
+    parser = argparse.ArgumentParser(description='stub cattleshed for benchmarking kennel')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('-p', '--port', type=int, default=2012)
+    parser.add_argument('--compilers', type=int, default=100, help='number of compilers in the Version reply')
+    parser.add_argument('--prefix', default='stub', help='compilers are named <prefix>-<n>')
+    parser.add_argument('--script', help='JSON file with the frames of a run')
+    parser.add_argument('--output-size', type=int, default=1024, help='octets of StdOut of a run')
+    parser.add_argument('--chunk-size', type=int, default=4096, help='octets of StdOut per frame')
+    parser.add_argument('--compile-delay', type=float, default=0, help='seconds before the first frame')
+    parser.add_argument('--chunk-delay', type=float, default=0, help='seconds between StdOut frames')
+    args = parser.parse_args()
+
+    if args.script:
+        with open(args.script) as f:
+            script = json.load(f)
+    else:
+        script = default_script(args)
+    stub = Stub(script, args.compilers, args.prefix)
+    server = await asyncio.start_server(stub.handle, args.host, args.port, backlog=1024)
+    print('stub cattleshed listening on %s:%d' % (args.host, args.port), file=sys.stderr)
+
+    stop = asyncio.Event()
+    for s in (signal.SIGINT, signal.SIGTERM):
+        asyncio.get_running_loop().add_signal_handler(s, stop.set)
+    async with server:
+        await stop.wait()
+    print('%d requests served' % stub.requests, file=sys.stderr)
+
+
+if __name__ == '__main__':
+    asyncio.run(main())
@@ -0,0 +1,410 @@
+#ifndef BACKEND_H_INCLUDED
+#define BACKEND_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "libs.h"
+#include "protocol.h"
+
+// The cattleshed servers requests are sent to. "application.cattleshed" is either one server, {"host", "port"},
+// or {"backends": [{"host", "port", "compilers": [names]}, ...], "status_interval": seconds}.
+// A request goes to the least loaded backend serving all of its compilers, preferring healthy ones; a backend
+// without "compilers" serves those its VersionResult listed, or any compiler until it has answered a Version.
+// The load is the queue depth of its last StatusResult plus the requests sent to it since. A backend that does not
+// answer Status or Version within "probe_timeout" seconds is taken as down.
+// With "application.cattleshed.shed_load" set, requests are turned away while every healthy backend serving
+// their compilers reported a load per slot of at least that much.
+class backend_pool {
+    struct backend {
+        std::string host;
+        int port;
+        std::set<std::string> tags;
+        std::set<std::string> reported;
+        bool healthy;
+        double running;
+        double queued;
+        double capacity;
+        std::size_t started;
+    };
+
+    std::vector<backend> backends;
+    std::chrono::seconds status_interval;
+    std::chrono::seconds probe_timeout;
+    double shed_load;
+    std::chrono::steady_clock::time_point checked;
+    bool configured;
+    bool checking;
+    std::size_t next;
+    std::mutex mtx;
+
+    backend_pool()
+        : status_interval(5)
+        , probe_timeout(3)
+        , shed_load(0)
+        , configured(false)
+        , checking(false)
+        , next(0) {
+    }
+
+    static backend make_backend(const cppcms::json::value& v) {
+        backend b;
+        b.host = v["host"].str();
+        b.port = (int)v["port"].number();
+        if (v["compilers"].type() == cppcms::json::is_array)
+            for (auto&& c: v["compilers"].array())
+                b.tags.insert(c.str());
+        b.healthy = true;
+        b.running = 0;
+        b.queued = 0;
+        b.capacity = 1;
+        b.started = 0;
+        return b;
+    }
+    void configure(cppcms::service& srv) {
+        if (configured)
+            return;
+        auto settings = srv.settings()["application"]["cattleshed"];
+        if (settings["backends"].type() == cppcms::json::is_array) {
+            for (auto&& v: settings["backends"].array())
+                backends.push_back(make_backend(v));
+        } else {
+            backends.push_back(make_backend(settings));
+        }
+        status_interval = std::chrono::seconds(srv.settings().get("application.cattleshed.status_interval", 5));
+        probe_timeout = std::chrono::seconds(srv.settings().get("application.cattleshed.probe_timeout", 3));
+        shed_load = srv.settings().get("application.cattleshed.shed_load", 0.0);
+        configured = true;
+    }
+    static bool serves(const backend& b, const std::vector<std::string>& compilers) {
+        const auto& names = !b.tags.empty() ? b.tags : b.reported;
+        if (names.empty())
+            return true;
+        for (auto&& c: compilers)
+            if (names.count(c) == 0)
+                return false;
+        return true;
+    }
+    typedef booster::function<void (bool answered, const std::string& result)> probe_handler;
+    // Sends one request frame on the event loop and calls `done` there once, with the frame answering it or with
+    // `answered` false when the backend cannot be reached or does not answer within `timeout`.
+    static void probe(cppcms::service& srv, const std::string& host, int port, const std::string& command, std::chrono::seconds timeout, probe_handler done) {
+        auto& service = srv.get_io_service();
+        service.post([&service, host, port, command, timeout, done]() {
+            booster::shared_ptr<booster::aio::stream_socket> sock(new booster::aio::stream_socket(service));
+            booster::shared_ptr<booster::aio::deadline_timer> timer(new booster::aio::deadline_timer(service));
+            booster::shared_ptr<const request_buffer> request(new request_buffer(std::vector<protocol>{protocol{command, ""}}));
+            // whichever comes first of the answer, an error and the deadline
+            booster::shared_ptr<bool> finished(new bool(false));
+            auto finish = [sock, timer, finished, done, host, port](bool answered, const std::string& result) {
+                if (*finished)
+                    return;
+                *finished = true;
+                timer->cancel();
+                booster::system::error_code ec;
+                sock->close(ec);
+                if (!answered)
+                    std::cout << "cattleshed " << host << ":" << port << ": no answer" << std::endl;
+                done(answered, result);
+            };
+            timer->expires_from_now(booster::ptime::seconds((int)timeout.count()));
+            timer->async_wait([finish](const booster::system::error_code& e) {
+                if (!e)
+                    finish(false, std::string());
+            });
+
+            booster::system::error_code ec;
+            sock->open(booster::aio::family_type::pf_inet, ec);
+            if (ec)
+                return finish(false, std::string());
+            sock->async_connect(booster::aio::endpoint(host, port), [sock, request, finish](const booster::system::error_code& e) {
+                if (e)
+                    return finish(false, std::string());
+                sock->async_write(request->buffer(), [sock, request, finish](const booster::system::error_code& e, std::size_t) {
+                    if (e)
+                        return finish(false, std::string());
+                    booster::shared_ptr<async_read_protocol_t> arp(new async_read_protocol_t(sock, [finish](const booster::system::error_code& e, const protocol& proto) {
+                        finish(!e, proto.contents);
+                    }, 1));
+                    arp->read_async();
+                });
+            });
+        });
+    }
+    // refreshes the load and health of every backend at most once per status_interval. The backends are asked on
+    // the event loop, so the caller does not wait for them and uses the load they reported before.
+    void check_status(cppcms::service& srv) {
+        std::vector<std::pair<std::string, int>> targets;
+        std::chrono::seconds timeout;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            configure(srv);
+            auto now = std::chrono::steady_clock::now();
+            // one backend is only asked when its load decides whether to shed
+            if ((backends.size() < 2 && shed_load <= 0) || checking || now - checked < status_interval)
+                return;
+            checking = true;
+            for (auto&& b: backends)
+                targets.push_back(std::make_pair(b.host, b.port));
+            timeout = probe_timeout;
+        }
+        // every probe finishes, by its deadline at the latest, and the last one ends the check
+        booster::shared_ptr<std::size_t> remaining(new std::size_t(targets.size()));
+        for (std::size_t i = 0; i < targets.size(); i++) {
+            probe(srv, targets[i].first, targets[i].second, "Status", timeout, [this, i, remaining](bool answered, const std::string& result) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (--*remaining == 0) {
+                    checked = std::chrono::steady_clock::now();
+                    checking = false;
+                }
+                auto& b = backends[i];
+                b.healthy = answered;
+                if (!answered)
+                    return;
+                std::stringstream ss(result);
+                cppcms::json::value status;
+                if (!status.load(ss, true, nullptr))
+                    return;
+                b.running = status.get("running", 0.0);
+                b.queued = status.get("queued", 0.0);
+                b.capacity = std::max(status.get("max-connections", 1.0), 1.0);
+                b.started = 0;
+            });
+        }
+    }
+
+public:
+    static backend_pool& instance() {
+        static backend_pool pool;
+        return pool;
+    }
+
+    // the backend to send a request for `compilers` to, other than those `tried`; -1 if there is none
+    int pick(cppcms::service& srv, const std::vector<std::string>& compilers, const std::vector<int>& tried, bool check = true) {
+        if (check)
+            check_status(srv);
+        std::lock_guard<std::mutex> lock(mtx);
+        configure(srv);
+        int best = -1;
+        double best_load = 0;
+        for (std::size_t n = 0; n < backends.size(); n++) {
+            int i = (int)((next + n) % backends.size());
+            const auto& b = backends[i];
+            if (std::find(tried.begin(), tried.end(), i) != tried.end() || !serves(b, compilers))
+                continue;
+            double load = (b.running + b.queued + b.started) / b.capacity;
+            if (best == -1 ||
+                (b.healthy && !backends[best].healthy) ||
+                (b.healthy == backends[best].healthy && load < best_load)) {
+                best = i;
+                best_load = load;
+            }
+        }
+        if (best != -1) {
+            backends[best].started += 1;
+            next = best + 1;
+        }
+        return best;
+    }
+    // Whether a request for `compilers` is to be shed; `retry_after` is then set to the seconds until the load
+    // is known again. Only the running and queued requests a backend reported count; one that is down is not
+    // routed to rather than full, and a request no healthy backend serves fails when it is sent.
+    bool overloaded(cppcms::service& srv, const std::vector<std::string>& compilers, int& retry_after) {
+        check_status(srv);
+        std::lock_guard<std::mutex> lock(mtx);
+        configure(srv);
+        if (shed_load <= 0)
+            return false;
+        bool served = false;
+        for (auto&& b: backends) {
+            if (!b.healthy || !serves(b, compilers))
+                continue;
+            served = true;
+            if ((b.running + b.queued) / b.capacity < shed_load)
+                return false;
+        }
+        retry_after = std::max(1, (int)status_interval.count());
+        return served;
+    }
+    std::size_t size(cppcms::service& srv) {
+        std::lock_guard<std::mutex> lock(mtx);
+        configure(srv);
+        return backends.size();
+    }
+    booster::aio::endpoint endpoint(int i) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return booster::aio::endpoint(backends[i].host, backends[i].port);
+    }
+    std::string name(int i) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return backends[i].host + ":" + std::to_string(backends[i].port);
+    }
+    // skipped while a healthy backend serves the compilers, until a StatusResult is received from it again
+    void failed(int i) {
+        std::lock_guard<std::mutex> lock(mtx);
+        backends[i].healthy = false;
+    }
+
+    // the compilers of every backend answering Version, the first backend listing a name winning; `done` is
+    // called on the event loop once every backend answered or timed out
+    void compiler_infos_async(cppcms::service& srv, booster::function<void (const cppcms::json::value&)> done) {
+        struct state {
+            std::vector<std::set<std::string>> tags;
+            std::vector<std::string> results;
+            std::vector<bool> answered;
+            std::size_t remaining;
+        };
+        std::vector<std::pair<std::string, int>> targets;
+        booster::shared_ptr<state> s(new state());
+        std::chrono::seconds timeout;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            configure(srv);
+            for (auto&& b: backends) {
+                targets.push_back(std::make_pair(b.host, b.port));
+                s->tags.push_back(b.tags);
+            }
+            timeout = probe_timeout;
+        }
+        if (targets.empty()) {
+            cppcms::json::value merged;
+            merged.array({});
+            return done(merged);
+        }
+        s->results.resize(targets.size());
+        s->answered.resize(targets.size());
+        s->remaining = targets.size();
+        // the probes finish on the event loop, one at a time
+        for (std::size_t i = 0; i < targets.size(); i++) {
+            probe(srv, targets[i].first, targets[i].second, "Version", timeout, [this, i, s, done](bool answered, const std::string& result) {
+                s->answered[i] = answered;
+                s->results[i] = result;
+                if (--s->remaining != 0)
+                    return;
+                cppcms::json::value merged;
+                merged.array({});
+                std::set<std::string> names;
+                for (std::size_t n = 0; n < s->results.size(); n++) {
+                    std::set<std::string> reported;
+                    if (s->answered[n]) {
+                        std::stringstream ss(s->results[n]);
+                        cppcms::json::value value;
+                        if (value.load(ss, true, nullptr) && value.type() == cppcms::json::is_array) {
+                            for (auto&& c: value.array()) {
+                                auto name = c["name"].str();
+                                if (!s->tags[n].empty() && s->tags[n].count(name) == 0)
+                                    continue;
+                                reported.insert(name);
+                                if (names.insert(name).second)
+                                    merged.array().push_back(c);
+                            }
+                        }
+                    }
+                    std::lock_guard<std::mutex> lock(mtx);
+                    backends[n].healthy = s->answered[n];
+                    if (s->answered[n])
+                        backends[n].reported = reported;
+                }
+                done(merged);
+            });
+        }
+    }
+    // compiler_infos_async for a worker thread; the event loop itself must not wait for it
+    cppcms::json::value compiler_infos(cppcms::service& srv) {
+        std::mutex m;
+        std::condition_variable cv;
+        bool ready = false;
+        cppcms::json::value merged;
+        compiler_infos_async(srv, [&m, &cv, &ready, &merged](const cppcms::json::value& value) {
+            std::lock_guard<std::mutex> lock(m);
+            merged = value;
+            ready = true;
+            cv.notify_one();
+        });
+        std::unique_lock<std::mutex> lock(m);
+        cv.wait(lock, [&ready] { return ready; });
+        return merged;
+    }
+};
+
+// names of the compilers a request runs
+inline std::vector<std::string> requested_compilers(const std::vector<protocol>& protos) {
+    std::vector<std::string> compilers;
+    for (auto&& proto: protos)
+        if (proto.command == "Control" && proto.contents.compare(0, 9, "compiler=") == 0)
+            compilers.push_back(proto.contents.substr(9));
+    return compilers;
+}
+
+// Sends the request to `backend`, or to the backend picked for it when that is -1. A backend that cannot be
+// connected or written to is marked as failed and the next one is tried. Once the request is written it is not
+// sent again, since the backend may have run it: an error reading the answer goes to f.
+// Returns the backend the request was written to.
+template<class F>
+int send_command(cppcms::service& srv, const std::vector<protocol>& protos, F f, int max_line = 0, tracer_ptr trace = tracer_ptr(), int backend = -1) {
+    auto& pool = backend_pool::instance();
+    auto compilers = requested_compilers(protos);
+    // encoded once for every backend tried
+    request_buffer request(protos);
+    std::vector<int> tried;
+    std::exception_ptr thrown;
+    while (true) {
+        int i = backend >= 0 ? (tried.empty() ? backend : -1) : pool.pick(srv, compilers, tried);
+        if (i < 0) {
+            if (thrown)
+                std::rethrow_exception(thrown);
+            f(booster::system::error_code(-1, booster::system::system_category), protocol());
+            return -1;
+        }
+        tried.push_back(i);
+
+        // f is only called once the request is written
+        bool written = false;
+        try {
+            send_command(srv.get_io_service(), pool.endpoint(i), request, [&f, &written](const booster::system::error_code& e, const protocol& proto) {
+                written = true;
+                f(e, proto);
+            }, max_line, trace);
+            return i;
+        } catch (booster::system::system_error const& e) {
+            if (written)
+                throw;
+            std::cout << "cattleshed " << pool.name(i) << ": " << e.what() << std::endl;
+            thrown = std::current_exception();
+        }
+        pool.failed(i);
+    }
+}
+
+// `check` is false on the event loop, which must not ask the backends for their status
+template<class F>
+void send_command_async(cppcms::service& srv, const std::vector<std::string>& compilers, booster::shared_ptr<const request_buffer> request, F f, int max_line, tracer_ptr trace, std::vector<int> tried, bool check) {
+    auto& pool = backend_pool::instance();
+    int i = pool.pick(srv, compilers, tried, check);
+    if (i < 0)
+        return (void)f(booster::system::error_code(-1, booster::system::system_category), protocol());
+    tried.push_back(i);
+
+    send_command_async(srv.get_io_service(), pool.endpoint(i), request, f, max_line, trace, [&srv, compilers, request, f, max_line, trace, tried](const booster::system::error_code& e) {
+        auto& pool = backend_pool::instance();
+        std::cout << "cattleshed " << pool.name(tried.back()) << ": " << e.message() << std::endl;
+        pool.failed(tried.back());
+        // a retry runs on the event loop
+        send_command_async(srv, compilers, request, f, max_line, trace, tried, false);
+    });
+}
+
+template<class F>
+void send_command_async(cppcms::service& srv, const std::vector<protocol>& protos, F f, int max_line = 0, tracer_ptr trace = tracer_ptr(), bool check = true) {
+    booster::shared_ptr<const request_buffer> request(new request_buffer(protos));
+    send_command_async(srv, requested_compilers(protos), request, f, max_line, trace, std::vector<int>(), check);
+}
+
+#endif // BACKEND_H_INCLUDED
@@ -0,0 +1,168 @@
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <malloc.h>
+#include <benchmark/benchmark.h>
+#include "eventsource.h"
+#include "json_view.h"
+#include "protocol.h"
+#include "quoted_printable.h"
+
+namespace {
+// the memory held through operator new, and the most it has been, to measure what one request holds at once
+std::size_t allocated = 0;
+std::size_t peak = 0;
+}
+
+void* operator new(std::size_t size) {
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        allocated += malloc_usable_size(p);
+        peak = std::max(peak, allocated);
+        return p;
+    }
+    throw std::bad_alloc();
+}
+// out of line, or gcc sees the free() of memory from operator new and warns
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+    allocated -= malloc_usable_size(p);
+    std::free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, std::size_t) noexcept {
+    allocated -= malloc_usable_size(p);
+    std::free(p);
+}
+
+namespace {
+
+// source-like text: printable, with a newline every 60 octets and some '=' to escape
+std::string text(std::size_t n) {
+    std::string s(n, 'a');
+    for (std::size_t i = 0; i < n; ++i)
+        s[i] = i % 61 == 60 ? '\n' : i % 37 == 0 ? '=' : static_cast<char>('!' + i % 90);
+    return s;
+}
+std::string binary(std::size_t n) {
+    std::mt19937 engine(0);
+    std::string s(n, '\0');
+    for (auto&& c: s)
+        c = static_cast<char>(engine());
+    return s;
+}
+
+void qp_encode_text(benchmark::State& state) {
+    const auto s = text(state.range(0));
+    for (auto _: state)
+        benchmark::DoNotOptimize(quoted_printable::encode(s));
+    state.SetBytesProcessed(state.iterations() * s.size());
+}
+BENCHMARK(qp_encode_text)->Range(64, 1 << 20);
+
+void qp_encode_binary(benchmark::State& state) {
+    const auto s = binary(state.range(0));
+    for (auto _: state)
+        benchmark::DoNotOptimize(quoted_printable::encode(s));
+    state.SetBytesProcessed(state.iterations() * s.size());
+}
+BENCHMARK(qp_encode_binary)->Range(64, 1 << 20);
+
+void qp_decode_text(benchmark::State& state) {
+    const auto s = quoted_printable::encode(text(state.range(0)));
+    for (auto _: state)
+        benchmark::DoNotOptimize(quoted_printable::decode(s));
+    state.SetBytesProcessed(state.iterations() * s.size());
+}
+BENCHMARK(qp_decode_text)->Range(64, 1 << 20);
+
+void qp_decode_binary(benchmark::State& state) {
+    const auto s = quoted_printable::encode(binary(state.range(0)));
+    for (auto _: state)
+        benchmark::DoNotOptimize(quoted_printable::decode(s));
+    state.SetBytesProcessed(state.iterations() * s.size());
+}
+BENCHMARK(qp_decode_binary)->Range(64, 1 << 20);
+
+// the reply to a run: compiler messages, then program output in lines, as cattleshed sends it
+std::string reply(std::size_t output_size) {
+    std::string r;
+    r += protocol{"Control", "Start"}.to_string();
+    r += protocol{"CompilerMessageE", "prog.cc:1:1: warning: unused\n"}.to_string();
+    const auto out = text(output_size);
+    for (std::size_t off = 0; off < out.size(); off += 4096)
+        r += protocol{"StdOut", out.substr(off, 4096)}.to_string();
+    r += protocol{"ExitCode", "0"}.to_string();
+    r += protocol{"Control", "Finish"}.to_string();
+    return r;
+}
+
+// what async_read_protocol_t does with every octet it receives
+void protocol_consume(benchmark::State& state) {
+    const auto r = reply(state.range(0));
+    for (auto _: state) {
+        protocol_parser parser;
+        for (auto c: r) {
+            if (parser.consume(c) == protocol_parser::consume_state_t::read_line) {
+                benchmark::DoNotOptimize(quoted_printable::decode(parser.contents));
+                parser.clear();
+            }
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * r.size());
+}
+BENCHMARK(protocol_consume)->Range(64, 1 << 20);
+
+// `s` as a JSON string literal
+std::string json_quote(const std::string& s) {
+    std::string r = "\"";
+    for (auto c: s) {
+        if (c == '"' || c == '\\')
+            r += '\\';
+        if (c == '\n')
+            r += "\\n";
+        else
+            r += c;
+    }
+    return r + "\"";
+}
+
+// a compile request from the POST body to the buffers written to cattleshed, as /api/compile.json makes it;
+// peak_bytes is the most memory the request held at once
+void compile_request(benchmark::State& state) {
+    const auto body = "{\"compiler\":\"gcc-head\",\"options\":\"warning\",\"stdin\":\"\",\"code\":" + json_quote(text(state.range(0))) + "}";
+    std::size_t most = 0;
+    for (auto _: state) {
+        const auto before = allocated;
+        peak = allocated;
+        {
+            json_view value;
+            value.load(body.data(), body.size());
+            std::vector<protocol> protos = {
+                protocol{"Control", "compiler=" + value.str("compiler")},
+                protocol{"StdIn", "", value.string("stdin")},
+                protocol{"Source", "", value.string("code")},
+                protocol{"CompilerOption", value.str("options")},
+                protocol{"Control", "run"},
+            };
+            request_buffer request(protos);
+            benchmark::DoNotOptimize(request.size());
+        }
+        most = std::max(most, peak - before);
+    }
+    state.counters["peak_bytes"] = most;
+    state.SetBytesProcessed(state.iterations() * body.size());
+}
+BENCHMARK(compile_request)->Range(64, 1 << 20)->Arg(10 << 20);
+
+// formatting an event before it is written as a chunk; the output of a run is sent as one data field per frame
+void eventsource_format(benchmark::State& state) {
+    const auto data = "StdOut:" + text(state.range(0));
+    for (auto _: state)
+        benchmark::DoNotOptimize(eventsource::format("data", data, true));
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(eventsource_format)->Range(64, 1 << 20);
+
+}
+
+BENCHMARK_MAIN();
@@ -27,7 +27,8 @@ public:
     eventsource& operator=(const eventsource&) = default;
     //eventsource& operator=(eventsource&&) = default;
 
-    void send(const std::string& name, const std::string& contents, bool flush) const {
+    // the field `name' with contents, continued on a new field line after every line break
+    static std::string format(const std::string& name, const std::string& contents, bool flush) {
         std::string buf;
         buf += name;
         buf += ": ";
@@ -51,7 +52,10 @@ public:
         if (flush) {
             buf += '\n';
         }
-        send_chunk(buf, flush);
+        return buf;
+    }
+    void send(const std::string& name, const std::string& contents, bool flush) const {
+        send_chunk(format(name, contents, flush), flush);
     }
 
     void send_header() const {
@@ -0,0 +1,190 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include "libs.h"
+#include "protocol.h"
+
+// Output of one run, numbered from 1, kept so that a client can reconnect to the run or poll it, and forwarded
+// to every client streaming it: the one that started the run and any number watching it, all fed from the one
+// connection to cattleshed. The oldest output is dropped once the journal holds more than max_bytes.
+// Subscribers are called without the journal locked, so a slow client does not hold up the others or the run.
+class run_journal {
+public:
+    struct entry {
+        std::size_t id;
+        protocol proto;
+    };
+    typedef std::function<void (const entry&)> subscriber;
+
+private:
+    // one client streaming the run; `m` keeps its output in order between the replay and the live entries
+    struct listener {
+        std::mutex m;
+        std::atomic<bool> cancelled;
+        subscriber f;
+        explicit listener(subscriber f) : cancelled(false), f(std::move(f)) { }
+    };
+    typedef std::shared_ptr<listener> listener_ptr;
+
+    std::size_t max_bytes;
+    std::size_t bytes;
+    std::size_t next_id;
+    std::deque<entry> entries;
+    bool finished_;
+    std::chrono::steady_clock::time_point finished_at;
+    std::map<std::size_t, listener_ptr> live;
+    std::size_t next_subscription;
+    mutable std::mutex mtx;
+
+public:
+    explicit run_journal(std::size_t max_bytes)
+        : max_bytes(max_bytes)
+        , bytes(0)
+        , next_id(1)
+        , finished_(false)
+        , next_subscription(1) {
+    }
+    run_journal(const run_journal&) = delete;
+    run_journal& operator=(const run_journal&) = delete;
+
+    // called for one entry at a time, as the output of the run arrives
+    void append(const protocol& proto) {
+        std::vector<listener_ptr> targets;
+        entry e{0, proto};
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            e.id = next_id++;
+            entries.push_back(e);
+            bytes += proto.command.size() + proto.contents.size();
+            while (max_bytes != 0 && bytes > max_bytes && entries.size() > 1) {
+                bytes -= entries.front().proto.command.size() + entries.front().proto.contents.size();
+                entries.pop_front();
+            }
+            for (auto&& s: live)
+                targets.push_back(s.second);
+        }
+        for (auto&& t: targets) {
+            std::lock_guard<std::mutex> lock(t->m);
+            if (!t->cancelled)
+                t->f(e);
+        }
+    }
+    void finish() {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished_ = true;
+        finished_at = std::chrono::steady_clock::now();
+        live.clear();
+    }
+
+    // entries after `last`; false if some of them were already dropped
+    bool since(std::size_t last, std::vector<entry>& out, bool& finished) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished = finished_;
+        if (!entries.empty() && entries.front().id > last + 1)
+            return false;
+        for (auto&& e: entries)
+            if (e.id > last)
+                out.push_back(e);
+        return true;
+    }
+    // Replays the entries after `last` to f and then forwards new ones until the run finishes or the subscription
+    // is cancelled. Returns the subscription, or 0 if some of the entries were already dropped.
+    std::size_t subscribe(std::size_t last, subscriber f) {
+        auto l = std::make_shared<listener>(std::move(f));
+        // an entry appended from here on waits for the replay, so the client sees every entry once and in order
+        std::unique_lock<std::mutex> replaying(l->m);
+        std::vector<entry> backlog;
+        std::size_t subscription;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (!entries.empty() && entries.front().id > last + 1)
+                return 0;
+            for (auto&& e: entries)
+                if (e.id > last)
+                    backlog.push_back(e);
+            subscription = next_subscription++;
+            if (!finished_)
+                live[subscription] = l;
+        }
+        for (auto&& e: backlog)
+            l->f(e);
+        return subscription;
+    }
+    // the subscriber may still be running for an entry when this returns, but is not called again
+    void unsubscribe(std::size_t subscription) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = live.find(subscription);
+        if (it == live.end())
+            return;
+        it->second->cancelled = true;
+        live.erase(it);
+    }
+    bool expired(std::chrono::seconds ttl) const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return finished_ && std::chrono::steady_clock::now() - finished_at > ttl;
+    }
+};
+
+typedef booster::shared_ptr<run_journal> run_journal_ptr;
+
+// Journals of the runs of this process by run id. Finished runs are kept for ttl seconds.
+class journal_registry {
+    std::map<std::string, run_journal_ptr> journals;
+    std::mutex mtx;
+
+    static std::string make_id() {
+        const char tbl[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+        std::random_device seed_gen;
+        std::mt19937 engine(seed_gen());
+        std::uniform_int_distribution<> dist(0, sizeof(tbl) - 2);
+        std::string id;
+        while (id.size() < 16) {
+            id.push_back(tbl[dist(engine)]);
+        }
+        return id;
+    }
+    void expire(std::chrono::seconds ttl) {
+        for (auto it = journals.begin(); it != journals.end(); ) {
+            if (it->second->expired(ttl))
+                it = journals.erase(it);
+            else
+                ++it;
+        }
+    }
+
+public:
+    static journal_registry& instance() {
+        static journal_registry registry;
+        return registry;
+    }
+
+    std::pair<std::string, run_journal_ptr> create(cppcms::service& srv) {
+        std::lock_guard<std::mutex> lock(mtx);
+        expire(std::chrono::seconds(srv.settings().get("application.journal.ttl", 300)));
+        run_journal_ptr journal(new run_journal(srv.settings().get("application.journal.max_bytes", 1048576)));
+        std::string id;
+        do {
+            id = make_id();
+        } while (journals.count(id) != 0);
+        journals[id] = journal;
+        return std::make_pair(id, journal);
+    }
+    run_journal_ptr find(cppcms::service& srv, const std::string& id) {
+        std::lock_guard<std::mutex> lock(mtx);
+        expire(std::chrono::seconds(srv.settings().get("application.journal.ttl", 300)));
+        auto it = journals.find(id);
+        return it == journals.end() ? run_journal_ptr() : it->second;
+    }
+};
+
+#endif // JOURNAL_H_INCLUDED
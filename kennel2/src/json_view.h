@@ -0,0 +1,320 @@
+#ifndef JSON_VIEW_H_INCLUDED
+#define JSON_VIEW_H_INCLUDED
+
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "libs.h"
+
+// A string of a JSON document, left escaped where the document is.
+// `owner`, when set, keeps the document alive for as long as the string is.
+struct json_string {
+    const char* begin;
+    const char* end;
+    std::size_t size; // in octets once unescaped
+    booster::shared_ptr<void> owner;
+
+    json_string() : begin(nullptr), end(nullptr), size(0) {}
+
+    bool is_set() const {
+        return begin != nullptr;
+    }
+    // calls f(const char*, std::size_t) with the unescaped string, in pieces: the runs without escapes
+    // where they are, and what the escapes stand for from a small buffer
+    template<class F>
+    void decode(F f) const {
+        char buf[256];
+        std::size_t n = 0;
+        auto put = [&](char c) {
+            if (n == sizeof(buf)) {
+                f(buf, n);
+                n = 0;
+            }
+            buf[n++] = c;
+        };
+        for (auto p = begin; p != end; ++p) {
+            if (*p != '\\') {
+                auto run = static_cast<const char*>(std::memchr(p, '\\', end - p));
+                if (!run)
+                    run = end;
+                if (n != 0)
+                    f(buf, n);
+                n = 0;
+                f(p, run - p);
+                p = run - 1;
+                continue;
+            }
+            ++p;
+            switch (*p) {
+            case 'b': put('\b'); break;
+            case 'f': put('\f'); break;
+            case 'n': put('\n'); break;
+            case 'r': put('\r'); break;
+            case 't': put('\t'); break;
+            case 'u': {
+                unsigned cp = hex4(p + 1);
+                p += 4;
+                // the low half of a surrogate pair follows the high half; load() made sure of it
+                if (0xD800 <= cp && cp < 0xDC00) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (hex4(p + 3) - 0xDC00);
+                    p += 6;
+                }
+                if (cp < 0x80) {
+                    put((char)cp);
+                } else if (cp < 0x800) {
+                    put((char)(0xC0 | (cp >> 6)));
+                    put((char)(0x80 | (cp & 0x3F)));
+                } else if (cp < 0x10000) {
+                    put((char)(0xE0 | (cp >> 12)));
+                    put((char)(0x80 | ((cp >> 6) & 0x3F)));
+                    put((char)(0x80 | (cp & 0x3F)));
+                } else {
+                    put((char)(0xF0 | (cp >> 18)));
+                    put((char)(0x80 | ((cp >> 12) & 0x3F)));
+                    put((char)(0x80 | ((cp >> 6) & 0x3F)));
+                    put((char)(0x80 | (cp & 0x3F)));
+                }
+                break;
+            }
+            default: put(*p); break; // '"', '\\' and '/'
+            }
+        }
+        if (n != 0)
+            f(buf, n);
+    }
+    std::string str() const {
+        std::string r;
+        r.reserve(size);
+        decode([&r](const char* p, std::size_t n) { r.append(p, n); });
+        return r;
+    }
+
+    // the value of 4 hex digits at `p`, or -1 if they are not
+    static int hex4(const char* p) {
+        int v = 0;
+        for (int i = 0; i < 4; i++) {
+            char c = p[i];
+            v <<= 4;
+            if ('0' <= c && c <= '9')
+                v += c - '0';
+            else if ('a' <= c && c <= 'f')
+                v += c - 'a' + 10;
+            else if ('A' <= c && c <= 'F')
+                v += c - 'A' + 10;
+            else
+                return -1;
+        }
+        return v;
+    }
+};
+
+// The members of a JSON object, read where the document is instead of being copied into a cppcms::json::value.
+// Strings stay escaped until they are used, so a large one can be unescaped straight into whatever it is
+// sent as. Used for the body of a compile request, whose "code" may be megabytes.
+class json_view {
+    struct member {
+        std::string key;
+        cppcms::json::json_type type;
+        const char* begin;
+        const char* end;
+        json_string string;
+    };
+    std::vector<member> members;
+
+    const member* find(const std::string& key) const {
+        // the last of duplicated keys wins, as it does in cppcms::json::value
+        for (auto it = members.rbegin(); it != members.rend(); ++it)
+            if (it->key == key)
+                return &*it;
+        return nullptr;
+    }
+
+    static const char* skip_space(const char* p, const char* e) {
+        while (p != e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+            ++p;
+        return p;
+    }
+    // `p` is at the opening quote; returns the end of the string, or nullptr if it is not a valid one
+    static const char* read_string(const char* p, const char* e, json_string& s) {
+        s.begin = ++p;
+        s.size = 0;
+        while (p != e && *p != '"') {
+            auto c = (unsigned char)*p;
+            if (c < 0x20)
+                return nullptr;
+            if (c != '\\') {
+                ++p;
+                s.size += 1;
+                continue;
+            }
+            if (++p == e)
+                return nullptr;
+            switch (*p) {
+            case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                ++p;
+                s.size += 1;
+                break;
+            case 'u': {
+                if (e - p < 5)
+                    return nullptr;
+                int cp = json_string::hex4(p + 1);
+                p += 5;
+                if (cp < 0 || (0xDC00 <= cp && cp < 0xE000))
+                    return nullptr;
+                if (0xD800 <= cp && cp < 0xDC00) {
+                    if (e - p < 6 || p[0] != '\\' || p[1] != 'u')
+                        return nullptr;
+                    int low = json_string::hex4(p + 2);
+                    if (low < 0xDC00 || 0xE000 <= low)
+                        return nullptr;
+                    p += 6;
+                    s.size += 4;
+                } else {
+                    s.size += cp < 0x80 ? 1 : cp < 0x800 ? 2 : 3;
+                }
+                break;
+            }
+            default:
+                return nullptr;
+            }
+        }
+        if (p == e)
+            return nullptr;
+        s.end = p;
+        return p + 1;
+    }
+    // returns the end of the value at `p`, or nullptr if it is not a valid one
+    static const char* skip_value(const char* p, const char* e, cppcms::json::json_type& type, int depth) {
+        if (p == e || depth > 64)
+            return nullptr;
+        json_string s;
+        switch (*p) {
+        case '"':
+            type = cppcms::json::is_string;
+            return read_string(p, e, s);
+        case '{':
+        case '[': {
+            const char close = *p == '{' ? '}' : ']';
+            type = *p == '{' ? cppcms::json::is_object : cppcms::json::is_array;
+            p = skip_space(p + 1, e);
+            if (p != e && *p == close)
+                return p + 1;
+            while (p != e) {
+                cppcms::json::json_type t;
+                if (close == '}') {
+                    if (*p != '"' || !(p = read_string(p, e, s)))
+                        return nullptr;
+                    p = skip_space(p, e);
+                    if (p == e || *p != ':')
+                        return nullptr;
+                    p = skip_space(p + 1, e);
+                }
+                if (!(p = skip_value(p, e, t, depth + 1)))
+                    return nullptr;
+                p = skip_space(p, e);
+                if (p == e)
+                    return nullptr;
+                if (*p == close)
+                    return p + 1;
+                if (*p != ',')
+                    return nullptr;
+                p = skip_space(p + 1, e);
+            }
+            return nullptr;
+        }
+        case 't':
+            type = cppcms::json::is_boolean;
+            return e - p >= 4 && std::string(p, 4) == "true" ? p + 4 : nullptr;
+        case 'f':
+            type = cppcms::json::is_boolean;
+            return e - p >= 5 && std::string(p, 5) == "false" ? p + 5 : nullptr;
+        case 'n':
+            type = cppcms::json::is_null;
+            return e - p >= 4 && std::string(p, 4) == "null" ? p + 4 : nullptr;
+        default: {
+            type = cppcms::json::is_number;
+            auto begin = p;
+            while (p != e && (('0' <= *p && *p <= '9') || *p == '-' || *p == '+' || *p == '.' || *p == 'e' || *p == 'E'))
+                ++p;
+            return p == begin ? nullptr : p;
+        }
+        }
+    }
+
+public:
+    // Reads the object in [p, p + size). The document must outlive the view and the strings taken from it,
+    // unless `owner` keeps it alive. Returns false if it is not a JSON object.
+    bool load(const char* p, std::size_t size, booster::shared_ptr<void> owner = booster::shared_ptr<void>()) {
+        members.clear();
+        const char* e = p + size;
+        p = skip_space(p, e);
+        if (p == e || *p != '{')
+            return false;
+        p = skip_space(p + 1, e);
+        if (p != e && *p == '}')
+            return skip_space(p + 1, e) == e;
+        while (p != e) {
+            member m;
+            json_string key;
+            if (*p != '"' || !(p = read_string(p, e, key)))
+                return false;
+            m.key = key.str();
+            p = skip_space(p, e);
+            if (p == e || *p != ':')
+                return false;
+            m.begin = skip_space(p + 1, e);
+            if (m.begin != e && *m.begin == '"') {
+                m.type = cppcms::json::is_string;
+                m.end = read_string(m.begin, e, m.string);
+                m.string.owner = owner;
+            } else {
+                m.end = skip_value(m.begin, e, m.type, 0);
+            }
+            if (!m.end)
+                return false;
+            members.push_back(m);
+            p = skip_space(m.end, e);
+            if (p == e)
+                return false;
+            if (*p == '}')
+                return skip_space(p + 1, e) == e;
+            if (*p != ',')
+                return false;
+            p = skip_space(p + 1, e);
+        }
+        return false;
+    }
+
+    cppcms::json::json_type type(const std::string& key) const {
+        auto m = find(key);
+        return m ? m->type : cppcms::json::is_undefined;
+    }
+    // the member `key` if it is a string, or a json_string that is not set
+    json_string string(const std::string& key) const {
+        auto m = find(key);
+        return m && m->type == cppcms::json::is_string ? m->string : json_string();
+    }
+    // the member `key` unescaped, or an empty string if it is not a string
+    std::string str(const std::string& key) const {
+        return string(key).str();
+    }
+    bool boolean(const std::string& key, bool def) const {
+        auto m = find(key);
+        if (!m || m->type != cppcms::json::is_boolean)
+            return def;
+        return *m->begin == 't';
+    }
+    // the member `key` copied into a cppcms::json::value, for the small ones that are objects
+    cppcms::json::value value(const std::string& key) const {
+        cppcms::json::value v;
+        auto m = find(key);
+        if (m) {
+            std::stringstream ss(std::string(m->begin, m->end));
+            v.load(ss, true, nullptr);
+        }
+        return v;
+    }
+};
+
+#endif // JSON_VIEW_H_INCLUDED
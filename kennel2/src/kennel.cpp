@@ -4,8 +4,13 @@
 #include "libs.h"
 #include "root.h"
 #include "protocol.h"
+#include "backend.h"
 #include "eventsource.h"
+#include "journal.h"
+#include "json_view.h"
 #include "permlink.h"
+#include "rate_limit.h"
+#include "trace.h"
 
 namespace cppcms {
     template<>
@@ -39,8 +44,20 @@ public:
 
         dispatcher().assign("/permlink/([a-zA-Z0-9]+)/?", &kennel::get_permlink, this, 1);
 
+        dispatcher().assign("/watch/([a-zA-Z0-9]+)/?", &kennel::watch, this, 1);
+        mapper().assign("watch", "/watch");
+
         dispatcher().assign("/api/list.json", &kennel::api_list, this);
         dispatcher().assign("/api/compile.json", &kennel::api_compile, this);
+        dispatcher().assign("/api/compile.raw", &kennel::api_compile_raw, this);
+        dispatcher().assign("/api/compile-batch.json", &kennel::api_compile_batch, this);
+        dispatcher().assign("/api/compile-cases.json", &kennel::api_compile_cases, this);
+        dispatcher().assign("/api/prepare.json", &kennel::api_prepare, this);
+        dispatcher().assign("/api/execute.json", &kennel::api_execute, this);
+        dispatcher().assign("/api/jobs.json", &kennel::api_submit_job, this);
+        dispatcher().assign("/api/jobs/([a-zA-Z0-9]+)\\.json", &kennel::api_poll_job, this, 1);
+        dispatcher().assign("/api/jobs/([a-zA-Z0-9]+)/stream", &kennel::api_stream_job, this, 1);
+        mapper().assign("jobs", "/api/jobs");
         dispatcher().assign("/api/permlink/([a-zA-Z0-9]+)/?", &kennel::api_permlink, this, 1);
 
         dispatcher().assign("/?", &kennel::root, this);
@@ -58,6 +75,12 @@ public:
         value.load(is, true, nullptr);
         return value;
     }
+    // Reads the body in place, for the requests that carry code. `context` is the released context of a
+    // request that is still sent after its handler returned; it keeps the body alive.
+    bool json_post_view(json_view& view, booster::shared_ptr<cppcms::http::context> context = booster::shared_ptr<cppcms::http::context>()) {
+        auto p = (context ? context->request() : request()).raw_post_data();
+        return view.load(static_cast<const char*>(p.first), p.second, context);
+    }
 
     cppcms::json::value get_compiler_infos_or_cache() {
         cppcms::json::value json;
@@ -73,29 +96,18 @@ public:
                 update_timer.expires_from_now(booster::ptime::seconds(1));
                 booster::intrusive_ptr<kennel> self(this);
                 update_timer.async_wait([self](const booster::system::error_code&) {
-                    auto json = self->get_compiler_infos();
-                    self->cache().store_data("compiler_infos", json, 10);
-                    self->cache().store_data("compiler_infos_persist", json, -1);
+                    // on the event loop, which runs the probes and so must not wait for them
+                    backend_pool::instance().compiler_infos_async(self->service(), [self](const cppcms::json::value& json) {
+                        self->cache().store_data("compiler_infos", json, 10);
+                        self->cache().store_data("compiler_infos_persist", json, -1);
+                    });
                 });
             }
         }
         return json;
     }
     cppcms::json::value get_compiler_infos() {
-        std::vector<protocol> protos = {
-            protocol{"Version", ""},
-        };
-        std::string json;
-        send_command(service(), protos, [&json](const booster::system::error_code& e, const protocol& proto) {
-            if (e)
-                return (void)(std::cout << e.message() << std::endl);
-            json = proto.contents;
-        }, 1);
-        std::stringstream ss(json);
-        cppcms::json::value value;
-        value.load(ss, true, nullptr);
-        //value.save(std::cout, cppcms::json::readable);
-        return value;
+        return backend_pool::instance().compiler_infos(service());
     }
 
     void root() {
@@ -103,35 +115,212 @@ public:
         c.compiler_infos = get_compiler_infos_or_cache();
         render("root", c);
     }
-    static std::vector<protocol> make_protocols(const cppcms::json::value& value) {
+    // the page, streaming a run that another client started
+    void watch(std::string id) {
+        content::root c;
+        c.compiler_infos = get_compiler_infos_or_cache();
+        c.watch_run = id;
+        render("root", c);
+    }
+    // The code and stdin are left in the body and unescaped as they are encoded for cattleshed.
+    static std::vector<protocol> make_protocols(const json_view& value, const std::string& trace_id, const std::string& control = "run") {
         std::vector<protocol> protos = {
-            protocol{"Control", "compiler=" + value["compiler"].str()},
-            protocol{"StdIn", value.get("stdin", "")},
-            protocol{"CompilerOptionRaw", value.get("compiler-option-raw", "")},
-            protocol{"RuntimeOptionRaw", value.get("runtime-option-raw", "")},
-            protocol{"Source", value["code"].str()},
-            protocol{"CompilerOption", value.get("options", "")},
-            protocol{"Control", "run"},
+            protocol{"TraceId", trace_id},
+            protocol{"Control", "compiler=" + value.str("compiler")},
+            protocol{"StdIn", "", value.string("stdin")},
+            protocol{"CompilerOptionRaw", "", value.string("compiler-option-raw")},
+            protocol{"RuntimeOptionRaw", "", value.string("runtime-option-raw")},
+            protocol{"Source", "", value.string("code")},
+            protocol{"CompilerOption", value.str("options")},
         };
+        if (value.type("build-session") == cppcms::json::is_string)
+            protos.push_back(protocol{"BuildSession", value.str("build-session")});
+        if (value.boolean("cache-output", false))
+            protos.push_back(protocol{"CacheOutput", ""});
+        if (value.type("benchmark") == cppcms::json::is_object)
+            push_benchmark(protos, value.value("benchmark"));
+        protos.push_back(protocol{"Control", control});
         return protos;
     }
+    // "benchmark": {"runs", "warmup", "perf"} runs the program several times and measures every run
+    static void push_benchmark(std::vector<protocol>& protos, const cppcms::json::value& bench) {
+        if (bench.type() != cppcms::json::is_object)
+            return;
+        auto opts = "runs=" + std::to_string((int)bench.get("runs", 10.0)) + ",warmup=" + std::to_string((int)bench.get("warmup", 1.0));
+        if (bench.get("perf", false))
+            opts += ",perf";
+        protos.push_back(protocol{"Benchmark", opts});
+    }
+    // sha-256 of the contents of `proto` in hex, or an empty string if cppcms was built without it
+    static std::string source_hash(const protocol& proto) {
+        auto md = cppcms::crypto::message_digest::create_by_name("sha256");
+        if (!md.get())
+            return std::string();
+        proto.read([&md](const char* p, std::size_t n) { md->append(p, n); });
+        std::vector<unsigned char> digest(md->digest_size());
+        md->readout(digest.data());
+        static const char hex[] = "0123456789abcdef";
+        std::string result;
+        for (auto c: digest) {
+            result += hex[c >> 4];
+            result += hex[c & 0xf];
+        }
+        return result;
+    }
+    // Asks cattleshed which sources of at least "application.source_hash_min_size" octets it already holds,
+    // and replaces those with their SourceHash. `backend` is set to the backend that was asked.
+    std::vector<protocol> hash_sources(const std::vector<protocol>& protos, tracer_ptr trace, int* backend = nullptr) {
+        const std::size_t min_size = service().settings().get("application.source_hash_min_size", 0);
+        if (min_size == 0)
+            return protos;
+        std::vector<protocol> check;
+        std::vector<std::string> hashes(protos.size());
+        for (std::size_t i = 0; i < protos.size(); i++) {
+            const auto& proto = protos[i];
+            if (proto.command == "SourceFileName" || (proto.command == "Control" && proto.contents.compare(0, 9, "compiler=") == 0))
+                check.push_back(proto);
+            else if (proto.command == "Source" && proto.size() >= min_size && !(hashes[i] = source_hash(proto)).empty())
+                check.push_back(protocol{"SourceHash", hashes[i]});
+        }
+        if (std::all_of(hashes.begin(), hashes.end(), [](const std::string& h) { return h.empty(); }))
+            return protos;
+        check.push_back(protocol{"Control", "check-sources"});
+
+        std::set<std::string> missing;
+        bool answered = false;
+        auto check_span = trace->begin("check_sources");
+        int asked = send_command(service(), check, [&missing, &answered](const booster::system::error_code& e, const protocol& proto) {
+            if (e)
+                return (void)(std::cout << e.message() << std::endl);
+            if (proto.command == "SourceMissing")
+                missing.insert(proto.contents);
+            else if (proto.command == "Control" && proto.contents == "Finish")
+                answered = true;
+        }, 0, trace);
+        trace->end(check_span);
+        if (!answered)
+            return protos;
+        if (backend)
+            *backend = asked;
+
+        std::vector<protocol> result;
+        for (std::size_t i = 0; i < protos.size(); i++) {
+            if (!hashes[i].empty() && missing.count(hashes[i]) == 0)
+                result.push_back(protocol{"SourceHash", hashes[i]});
+            else
+                result.push_back(protos[i]);
+        }
+        return result;
+    }
+    // whether every compiler `protos` runs is one of `compiler_infos`; cattleshed drops a request naming another
+    static bool known_compilers(const cppcms::json::value& compiler_infos, const std::vector<protocol>& protos) {
+        for (auto&& c: requested_compilers(protos)) {
+            auto&& infos = compiler_infos.array();
+            if (std::none_of(infos.begin(), infos.end(), [&c](const cppcms::json::value& v) { return v.get("name", "") == c; }))
+                return false;
+        }
+        return true;
+    }
+    // Answers with Retry-After and returns false if the request is not to be run now: 429 when its client used
+    // up its rate limit, 503 when the backends for its compilers are shedding load.
+    bool admit(cppcms::http::context& context, const std::vector<protocol>& protos) {
+        int retry_after = rate_limiter::instance().take(service(), context.request().remote_addr(), context.request().getenv("HTTP_X_API_KEY"));
+        if (retry_after != 0)
+            context.response().status(429);
+        else if (backend_pool::instance().overloaded(service(), requested_compilers(protos), retry_after))
+            context.response().status(503);
+        else
+            return true;
+        context.response().set_header("Retry-After", std::to_string(retry_after));
+        return false;
+    }
     void compile() {
         if (request().request_method() != "POST") {
             response().status(404);
             return;
         }
-        auto value = json_post_data();
-        auto protos = make_protocols(value);
+        // a client reconnecting after its connection dropped resumes the run it started
+        if (!request().getenv("HTTP_LAST_EVENT_ID").empty()) {
+            if (!resume_run(request().getenv("HTTP_LAST_EVENT_ID")))
+                response().status(410);
+            return;
+        }
+        auto compiler_infos = get_compiler_infos_or_cache();
+        auto context = release_context();
+        json_view value;
+        if (!json_post_view(value, context)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        tracer_ptr trace(new tracer(service()));
+        auto protos = make_protocols(value, trace->id());
+        if (!known_compilers(compiler_infos, protos)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        if (!admit(*context, protos))
+            return context->complete_response();
 
-        auto es = eventsource(release_context());
-        es.send_header();
-        send_command_async(service(), protos, [es](const booster::system::error_code& e, const protocol& proto) {
-            if (e)
-                return (void)(std::cout << e.message() << std::endl);
-            es.send_data(proto.command + ":" + proto.contents, true);
+        auto run = start_run(protos, trace);
+        stream_run(context, run.first, run.second, 0);
+    }
+    // runs in the background, whether or not a client is listening
+    std::pair<std::string, run_journal_ptr> start_run(const std::vector<protocol>& protos, tracer_ptr trace) {
+        auto run = journal_registry::instance().create(service());
+        send_run(service(), run.second, hash_sources(protos, trace), protos, trace);
+        return run;
+    }
+    // `full` is sent instead when cattleshed no longer holds a source sent as SourceHash; that resend runs on the
+    // event loop and so goes by the status of the backends known already (`check` false)
+    static void send_run(cppcms::service& srv, run_journal_ptr journal, const std::vector<protocol>& protos, const std::vector<protocol>& full, tracer_ptr trace, bool check = true) {
+        booster::shared_ptr<bool> missing(new bool(false));
+        send_command_async(srv, protos, [&srv, journal, full, trace, missing](const booster::system::error_code& e, const protocol& proto) {
+            if (e) {
+                std::cout << e.message() << std::endl;
+                return journal->finish();
+            }
+            if (proto.command == "SourceMissing")
+                return (void)(*missing = true);
+            if (*missing && proto.command == "Control" && proto.contents == "Finish")
+                return send_run(srv, journal, full, full, trace, false);
+            journal->append(proto);
             std::cout << proto.command << ":" << proto.contents << std::endl;
+            if (proto.command == "Control" && proto.contents == "Finish")
+                journal->finish();
+        }, 0, trace, check);
+    }
+    // sends the output after event `last` as server-sent events with ids "<run id>:<n>", alongside the other
+    // clients streaming the run; the X-Wandbox-Run header has the run id before any output is sent
+    void stream_run(booster::shared_ptr<cppcms::http::context> context, const std::string& id, const run_journal_ptr& journal, std::size_t last) {
+        auto es = eventsource(context);
+        context->response().set_header("X-Wandbox-Run", id);
+        es.send_header();
+        auto subscription = journal->subscribe(last, [es, id](const run_journal::entry& e) {
+            es.send_id(id + ":" + std::to_string(e.id), false);
+            es.send_data(e.proto.command + ":" + e.proto.contents, true);
+        });
+        if (subscription == 0) {
+            es.context->response().status(410);
+            return es.close();
+        }
+        // a client that went away, or reconnected as another one, is not sent the rest
+        booster::weak_ptr<run_journal> weak = journal;
+        context->async_on_peer_reset([weak, subscription]() {
+            if (auto journal = weak.lock())
+                journal->unsubscribe(subscription);
         });
     }
+    bool resume_run(const std::string& last_event_id) {
+        auto pos = last_event_id.find(':');
+        if (pos == std::string::npos)
+            return false;
+        auto id = last_event_id.substr(0, pos);
+        auto journal = journal_registry::instance().find(service(), id);
+        if (!journal)
+            return false;
+        stream_run(release_context(), id, journal, std::strtoul(last_event_id.c_str() + pos + 1, nullptr, 10));
+        return true;
+    }
     static std::string make_random_name() {
         std::string name;
         std::random_device seed_gen;
@@ -234,7 +423,7 @@ public:
         } else if (proto.command == "CompilerMessageE") {
             append(result["compiler_error"], proto.contents);
             append(result["compiler_message"], proto.contents);
-        } else if (proto.command == "StdOut") {
+        } else if (proto.command == "StdOut" || proto.command == "StdOutRaw") {
             append(result["program_output"], proto.contents);
             append(result["program_message"], proto.contents);
         } else if (proto.command == "StdErr") {
@@ -244,6 +433,31 @@ public:
             append(result["status"], proto.contents);
         } else if (proto.command == "Signal") {
             append(result["signal"], proto.contents);
+        } else if (proto.command == "Cached") {
+            result["cached"] = true;
+        } else if (proto.command == "BuildStatus") {
+            append(result["build_status"], proto.contents);
+        } else if (proto.command == "BuildSession") {
+            result["build_session"] = proto.contents;
+        } else if (proto.command == "BenchmarkResult") {
+            std::stringstream ss(proto.contents);
+            result["benchmark"].load(ss, true, nullptr);
+        } else if (proto.command == "CompileTrace") {
+            auto pos = proto.contents.find('\n');
+            cppcms::json::value trace;
+            trace["name"] = proto.contents.substr(0, pos);
+            trace["trace"] = pos == std::string::npos ? std::string() : proto.contents.substr(pos + 1);
+            if (result["compile_traces"].is_undefined())
+                result["compile_traces"].array({});
+            result["compile_traces"].array().push_back(trace);
+        } else if (proto.command == "Verdict") {
+            append(result["verdict"], proto.contents);
+        } else if (proto.command == "Handle") {
+            result["handle"] = proto.contents;
+        } else if (proto.command == "HandleExpired") {
+            result["expired"] = true;
+        } else if (proto.command == "Rejected") {
+            result["rejected"] = proto.contents;
         } else {
             //append(result["error"], proto.contents);
         }
@@ -254,29 +468,44 @@ public:
             return;
         }
 
-        auto value = json_post_data();
-        auto save = value.get("save", false);
-        auto protos = make_protocols(value);
+        json_view value;
+        if (!json_post_view(value)) {
+            response().status(400);
+            return;
+        }
+        tracer_ptr trace(new tracer(service()));
+        auto save = value.boolean("save", false);
+        auto protos = make_protocols(value, trace->id());
 
+        auto compiler_infos_span = trace->begin("compiler_infos");
         auto compiler_infos = get_compiler_infos_or_cache();
+        trace->end(compiler_infos_span);
         // find compiler info.
+        auto compiler = value.str("compiler");
         auto it = std::find_if(compiler_infos.array().begin(), compiler_infos.array().end(),
-            [&value](cppcms::json::value& v) {
-                return v["name"].str() == value["compiler"].str();
+            [&compiler](cppcms::json::value& v) {
+                return v["name"].str() == compiler;
             });
         // error if the compiler is not found
         if (it == compiler_infos.array().end()) {
             response().status(400);
             return;
         }
+        if (!admit(context(), protos))
+            return;
 
+        int backend = -1;
+        auto hashed = hash_sources(protos, trace, &backend);
 
         cppcms::json::value result;
         cppcms::json::value outputs;
         outputs.array({});
-        send_command(service(), protos, [this, &result, &outputs, save](const booster::system::error_code& e, const protocol& proto) {
+        bool missing = false;
+        auto handler = [this, &result, &outputs, &missing, save](const booster::system::error_code& e, const protocol& proto) {
             if (e)
                 return (void)(std::cout << e.message() << std::endl);
+            if (proto.command == "SourceMissing")
+                return (void)(missing = true);
 
             update_compile_result(result, proto);
 
@@ -286,14 +515,27 @@ public:
                 v["output"] = proto.contents;
                 outputs.array().push_back(v);
             }
-        });
+        };
+        send_command(service(), hashed, handler, 0, trace, backend);
+        // cattleshed dropped a source it said it had; send all of them
+        if (missing) {
+            result = cppcms::json::value();
+            outputs.array({});
+            send_command(service(), protos, handler, 0, trace);
+        }
 
+        // cattleshed is out of memory; nothing ran, so there is nothing to save
+        if (result["rejected"].type() == cppcms::json::is_string) {
+            response().status(503);
+            save = false;
+        }
         if (save) {
+            auto permlink_span = trace->begin("permlink");
             permlink pl(service());
             std::string permlink_name = make_random_name();
-            value["outputs"] = outputs;
-            pl.make_permlink(permlink_name, value, *it);
+            pl.make_permlink(permlink_name, value, outputs, *it);
             result["permlink"] = permlink_name;
+            trace->end(permlink_span);
 
             auto settings = service().settings()["application"];
             auto scheme = settings["scheme"].str();
@@ -304,6 +546,366 @@ public:
         response().content_type("application/json");
         result.save(response().out(), cppcms::json::readable);
     }
+    static void send_chunk(cppcms::http::context& context, const std::string& data) {
+        std::ostringstream oss;
+        oss << std::hex << data.size();
+        context.response().out() << oss.str() << "\r\n" << data << "\r\n" << std::flush;
+    }
+    // The stdout of the program is the response body, relayed as cattleshed sends it without being encoded;
+    // the other output goes to the journal of the run named by the X-Wandbox-Run header, read with
+    // /api/jobs/<id>.json once the body has ended.
+    void api_compile_raw() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        auto compiler_infos = get_compiler_infos_or_cache();
+        auto context = release_context();
+        json_view value;
+        if (!json_post_view(value, context)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        tracer_ptr trace(new tracer(service()));
+        auto protos = make_protocols(value, trace->id());
+        if (!known_compilers(compiler_infos, protos)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        protos.insert(protos.end() - 1, protocol{"RawOutput", ""});
+        if (!admit(*context, protos))
+            return context->complete_response();
+        auto run = journal_registry::instance().create(service());
+        auto journal = run.second;
+
+        context->response().status(200);
+        context->response().content_type("application/octet-stream");
+        context->response().set_header("X-Wandbox-Run", run.first);
+        context->response().transfer_encoding("chunked");
+        send_command_async(service(), protos, [context, journal](const booster::system::error_code& e, const protocol& proto) {
+            if (!e && proto.command == "StdOutRaw") {
+                if (!proto.contents.empty())
+                    send_chunk(*context, proto.contents);
+                return;
+            }
+            if (e)
+                std::cout << e.message() << std::endl;
+            else
+                journal->append(proto);
+            if (e || (proto.command == "Control" && proto.contents == "Finish")) {
+                journal->finish();
+                send_chunk(*context, "");
+                context->complete_response();
+            }
+        }, 0, trace);
+    }
+    static std::vector<protocol> make_batch_protocols(const cppcms::json::value& value, const std::string& trace_id) {
+        std::vector<protocol> protos = {
+            protocol{"TraceId", trace_id},
+            protocol{"StdIn", value.get("stdin", "")},
+            protocol{"Source", value["code"].str()},
+        };
+        const auto& compilers = value["compilers"].array();
+        for (std::size_t i = 0; i < compilers.size(); i++) {
+            const auto& c = compilers[i];
+            protos.push_back(protocol{"BatchId", std::to_string(i)});
+            protos.push_back(protocol{"Control", "compiler=" + c["compiler"].str()});
+            protos.push_back(protocol{"CompilerOption", c.get("options", "")});
+            protos.push_back(protocol{"CompilerOptionRaw", c.get("compiler-option-raw", "")});
+            protos.push_back(protocol{"RuntimeOptionRaw", c.get("runtime-option-raw", "")});
+        }
+        protos.push_back(protocol{"Control", "run-batch"});
+        return protos;
+    }
+    void api_compile_batch() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        tracer_ptr trace(new tracer(service()));
+        auto value = json_post_data();
+        if (value["compilers"].type() != cppcms::json::is_array || value["compilers"].array().empty()) {
+            response().status(400);
+            return;
+        }
+
+        auto compiler_infos_span = trace->begin("compiler_infos");
+        auto compiler_infos = get_compiler_infos_or_cache();
+        trace->end(compiler_infos_span);
+        // error if any of the compilers is not found
+        for (auto&& c: value["compilers"].array()) {
+            auto it = std::find_if(compiler_infos.array().begin(), compiler_infos.array().end(),
+                [&c](cppcms::json::value& v) {
+                    return v["name"].str() == c["compiler"].str();
+                });
+            if (it == compiler_infos.array().end()) {
+                response().status(400);
+                return;
+            }
+        }
+
+        auto protos = make_batch_protocols(value, trace->id());
+        if (!admit(context(), protos))
+            return;
+        cppcms::json::value results;
+        results.array({});
+        for (auto&& c: value["compilers"].array()) {
+            cppcms::json::value result;
+            result["compiler"] = c["compiler"].str();
+            results.array().push_back(result);
+        }
+        send_command(service(), protos, [&results](const booster::system::error_code& e, const protocol& proto) {
+            if (e)
+                return (void)(std::cout << e.message() << std::endl);
+
+            // output of each sub-request is tagged as "<command>@<index>"
+            auto pos = proto.command.find('@');
+            if (pos == std::string::npos)
+                return;
+            std::size_t index = std::strtoul(proto.command.c_str() + pos + 1, nullptr, 10);
+            if (index >= results.array().size())
+                return;
+            update_compile_result(results.array()[index], protocol{proto.command.substr(0, pos), proto.contents});
+        }, 0, trace);
+
+        response().content_type("application/json");
+        results.save(response().out(), cppcms::json::readable);
+    }
+    static std::vector<protocol> make_cases_protocols(const cppcms::json::value& value, const std::string& trace_id) {
+        std::vector<protocol> protos = {
+            protocol{"TraceId", trace_id},
+            protocol{"Control", "compiler=" + value["compiler"].str()},
+            protocol{"CompilerOptionRaw", value.get("compiler-option-raw", "")},
+            protocol{"RuntimeOptionRaw", value.get("runtime-option-raw", "")},
+            protocol{"Source", value["code"].str()},
+            protocol{"CompilerOption", value.get("options", "")},
+        };
+        const auto& cases = value["cases"].array();
+        for (std::size_t i = 0; i < cases.size(); i++) {
+            const auto& c = cases[i];
+            protos.push_back(protocol{"TestCase", std::to_string(i)});
+            protos.push_back(protocol{"StdIn", c.get("stdin", "")});
+            if (c["expected-output"].type() == cppcms::json::is_string)
+                protos.push_back(protocol{"ExpectedOutput", c["expected-output"].str()});
+        }
+        protos.push_back(protocol{"Control", "run-cases"});
+        return protos;
+    }
+    void api_compile_cases() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        tracer_ptr trace(new tracer(service()));
+        auto value = json_post_data();
+        if (value["cases"].type() != cppcms::json::is_array || value["cases"].array().empty()) {
+            response().status(400);
+            return;
+        }
+
+        auto compiler_infos_span = trace->begin("compiler_infos");
+        auto compiler_infos = get_compiler_infos_or_cache();
+        trace->end(compiler_infos_span);
+        // find compiler info.
+        auto it = std::find_if(compiler_infos.array().begin(), compiler_infos.array().end(),
+            [&value](cppcms::json::value& v) {
+                return v["name"].str() == value["compiler"].str();
+            });
+        // error if the compiler is not found
+        if (it == compiler_infos.array().end()) {
+            response().status(400);
+            return;
+        }
+
+        auto protos = make_cases_protocols(value, trace->id());
+        if (!admit(context(), protos))
+            return;
+        cppcms::json::value result;
+        cppcms::json::value& cases = result["cases"];
+        cases.array({});
+        for (std::size_t i = 0; i < value["cases"].array().size(); i++) {
+            cases.array().push_back(cppcms::json::value());
+        }
+        send_command(service(), protos, [&result, &cases](const booster::system::error_code& e, const protocol& proto) {
+            if (e)
+                return (void)(std::cout << e.message() << std::endl);
+
+            // compiler messages are untagged, output of each case is tagged as "<command>@<index>"
+            auto pos = proto.command.find('@');
+            if (pos == std::string::npos)
+                return update_compile_result(result, proto);
+            std::size_t index = std::strtoul(proto.command.c_str() + pos + 1, nullptr, 10);
+            if (index >= cases.array().size())
+                return;
+            update_compile_result(cases.array()[index], protocol{proto.command.substr(0, pos), proto.contents});
+        }, 0, trace);
+
+        response().content_type("application/json");
+        result.save(response().out(), cppcms::json::readable);
+    }
+    void api_prepare() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        json_view value;
+        if (!json_post_view(value)) {
+            response().status(400);
+            return;
+        }
+        tracer_ptr trace(new tracer(service()));
+
+        auto compiler_infos_span = trace->begin("compiler_infos");
+        auto compiler_infos = get_compiler_infos_or_cache();
+        trace->end(compiler_infos_span);
+        // find compiler info.
+        auto compiler = value.str("compiler");
+        auto it = std::find_if(compiler_infos.array().begin(), compiler_infos.array().end(),
+            [&compiler](cppcms::json::value& v) {
+                return v["name"].str() == compiler;
+            });
+        // error if the compiler is not found
+        if (it == compiler_infos.array().end()) {
+            response().status(400);
+            return;
+        }
+
+        auto protos = make_protocols(value, trace->id(), "prepare");
+        cppcms::json::value result;
+        auto backend = send_command(service(), protos, [&result](const booster::system::error_code& e, const protocol& proto) {
+            if (e)
+                return (void)(std::cout << e.message() << std::endl);
+            update_compile_result(result, proto);
+        }, 0, trace);
+        // the program is kept by the backend that compiled it, so the handle names that backend too
+        if (result["handle"].type() == cppcms::json::is_string)
+            result["handle"] = std::to_string(backend) + "-" + result["handle"].str();
+
+        response().content_type("application/json");
+        result.save(response().out(), cppcms::json::readable);
+    }
+    void api_execute() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        tracer_ptr trace(new tracer(service()));
+        auto value = json_post_data();
+        if (value["handle"].type() != cppcms::json::is_string) {
+            response().status(400);
+            return;
+        }
+
+        // "<backend>-<handle of cattleshed>"
+        auto handle = value["handle"].str();
+        auto pos = handle.find('-');
+        if (pos == std::string::npos || pos == 0 || handle.find_first_not_of("0123456789") != pos) {
+            response().status(400);
+            return;
+        }
+        int backend = std::atoi(handle.substr(0, pos).c_str());
+        // prepared by a backend that is no longer configured
+        if (backend >= (int)backend_pool::instance().size(service())) {
+            response().status(410);
+            return;
+        }
+
+        std::vector<protocol> protos = {
+            protocol{"TraceId", trace->id()},
+            protocol{"StdIn", value.get("stdin", "")},
+            protocol{"RuntimeOptionRaw", value.get("runtime-option-raw", "")},
+            protocol{"CompilerOption", value.get("options", "")},
+        };
+        push_benchmark(protos, value["benchmark"]);
+        protos.push_back(protocol{"Control", "execute handle=" + handle.substr(pos + 1)});
+        cppcms::json::value result;
+        send_command(service(), protos, [&result](const booster::system::error_code& e, const protocol& proto) {
+            if (e)
+                return (void)(std::cout << e.message() << std::endl);
+            update_compile_result(result, proto);
+        }, 0, trace, backend);
+
+        // the client has to prepare again
+        if (result["expired"].type() == cppcms::json::is_boolean)
+            response().status(410);
+        else if (result["rejected"].type() == cppcms::json::is_string)
+            response().status(503);
+        response().content_type("application/json");
+        result.save(response().out(), cppcms::json::readable);
+    }
+    void api_submit_job() {
+        if (request().request_method() != "POST") {
+            response().status(404);
+            return;
+        }
+
+        auto compiler_infos = get_compiler_infos_or_cache();
+        // the run is sent after the response; the context keeps the body for it
+        auto context = release_context();
+        json_view value;
+        if (!json_post_view(value, context)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        tracer_ptr trace(new tracer(service()));
+        auto protos = make_protocols(value, trace->id());
+        if (!known_compilers(compiler_infos, protos)) {
+            context->response().status(400);
+            return context->complete_response();
+        }
+        if (!admit(*context, protos))
+            return context->complete_response();
+        auto run = start_run(protos, trace);
+
+        cppcms::json::value result;
+        result["id"] = run.first;
+        context->response().content_type("application/json");
+        result.save(context->response().out(), cppcms::json::readable);
+        context->complete_response();
+    }
+    void api_poll_job(std::string id) {
+        auto journal = journal_registry::instance().find(service(), id);
+        if (!journal) {
+            response().status(404);
+            return;
+        }
+        auto since = std::strtoul(request().get("since").c_str(), nullptr, 10);
+        std::vector<run_journal::entry> entries;
+        bool finished;
+        if (!journal->since(since, entries, finished)) {
+            response().status(410);
+            return;
+        }
+
+        cppcms::json::value result;
+        cppcms::json::value& events = result["events"];
+        events.array({});
+        cppcms::json::value& outputs = result["result"];
+        outputs.object({});
+        for (auto&& e: entries) {
+            cppcms::json::value v;
+            v["type"] = e.proto.command;
+            v["output"] = e.proto.contents;
+            events.array().push_back(v);
+            update_compile_result(outputs, e.proto);
+        }
+        result["finished"] = finished;
+        result["next"] = static_cast<double>(entries.empty() ? since : entries.back().id);
+        response().content_type("application/json");
+        result.save(response().out(), cppcms::json::readable);
+    }
+    void api_stream_job(std::string id) {
+        auto last_event_id = request().getenv("HTTP_LAST_EVENT_ID");
+        if (last_event_id.empty())
+            last_event_id = id + ":0";
+        if (last_event_id.compare(0, id.size() + 1, id + ":") != 0 || !resume_run(last_event_id))
+            response().status(404);
+    }
     void api_permlink(std::string permlink_name) {
         permlink pl(service());
         auto value = pl.get_permlink(permlink_name);
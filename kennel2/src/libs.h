@@ -15,6 +15,7 @@
 #include <cppcms/serialization.h>
 #include <cppcms/json.h>
 #include <cppcms/view.h>
+#include <cppcms/crypto.h>
 #include <cppcms/http_context.h>
 #include <cppcms/http_response.h>
 #include <booster/system_error.h>
@@ -0,0 +1,58 @@
+// kennel-migrate <kennel.json> [<link id>]
+//
+// Copies the permlinks of application.database.legacy into the shards of application.database while kennel
+// keeps running with that configuration: kennel writes new permlinks to the shards and reads the ones not
+// copied yet from the legacy database. Permlinks already in their shard are skipped, so it can be stopped and
+// run again; <link id> resumes after the last link id it printed. Once it finished, drop "legacy".
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include "libs.h"
+#include "permlink.h"
+
+int main(int argc, char** argv) try {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <kennel.json> [<link id>]" << std::endl;
+        return 2;
+    }
+    std::ifstream config_file(argv[1]);
+    cppcms::json::value config;
+    if (!config_file || !config.load(config_file, true, nullptr)) {
+        std::cerr << argv[1] << ": cannot read the configuration" << std::endl;
+        return 2;
+    }
+    const auto& database = config["application"]["database"];
+    if (database.type() != cppcms::json::is_object || database.get("legacy", "").empty()) {
+        std::cerr << "application.database needs \"shards\" and \"legacy\"" << std::endl;
+        return 2;
+    }
+    auto store = permlink_store::make(database);
+    auto& sharded = static_cast<sharded_permlink_store&>(*store);
+    auto& legacy = *sharded.legacy_store();
+    sharded.init();
+
+    long long after = argc > 2 ? std::atoll(argv[2]) : 0;
+    std::size_t copied = 0;
+    std::size_t skipped = 0;
+    while (true) {
+        auto links = legacy.links(after, 1000);
+        if (links.empty())
+            break;
+        for (auto&& link: links) {
+            auto& shard = sharded.shard(sharded.shard_of(link.second));
+            permlink_record record;
+            if (shard.has(link.second) || !legacy.get(link.second, record)) {
+                skipped += 1;
+            } else {
+                shard.put(link.second, record);
+                copied += 1;
+            }
+            after = link.first;
+        }
+        std::cout << "copied up to link " << after << ": " << copied << " copied, " << skipped << " skipped" << std::endl;
+    }
+    std::cout << "done: " << copied << " copied, " << skipped << " skipped" << std::endl;
+} catch (std::exception const& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+}
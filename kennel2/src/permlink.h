@@ -1,16 +1,62 @@
 #ifndef PERMLINK_H_INCLUDED
 #define PERMLINK_H_INCLUDED
 
-#include <iostream>
 #include <ctime>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 #include "libs.h"
+#include "json_view.h"
 
-class permlink {
-    cppdb::session sql;
+// A permlink as it is stored.
+struct permlink_record {
+    std::string compiler;
+    std::string code;
+    std::string options;
+    std::string compiler_option_raw;
+    std::string runtime_option_raw;
+    std::string input;
+    std::tm created_at; // UTC
+    cppcms::json::value outputs; // [{"type", "output"}, ...]
+    cppcms::json::value compiler_info; // undefined if it was not saved
+};
+
+// Where permlinks are kept. One instance is shared by every request, from any thread.
+class permlink_store {
 public:
-    permlink(cppcms::service& service) : sql(service.settings()["application"]["database"].str()) {
+    virtual ~permlink_store() {}
+    virtual void init() = 0;
+    virtual void put(const std::string& permlink_name, const permlink_record& record) = 0;
+    // false if there is no such permlink
+    virtual bool get(const std::string& permlink_name, permlink_record& record) = 0;
+
+    // the store "application.database" names
+    static permlink_store& instance(cppcms::service& service) {
+        static std::unique_ptr<permlink_store> store(make(service.settings()["application"]["database"]));
+        return *store;
     }
-    void init() {
+    // `database` is either the cppdb connection string of one database, or
+    // {"shards": [connection strings], "prefix_length": n, "legacy": connection string}
+    static std::unique_ptr<permlink_store> make(const cppcms::json::value& database);
+};
+
+// One SQLite database. Its writes take turns on `writer` rather than contending for the lock of the file;
+// reads run at once on the connections of the pool the connection string asks for (@pool_size).
+class sqlite_permlink_store : public permlink_store {
+    std::string connection_string;
+    std::mutex writer;
+public:
+    explicit sqlite_permlink_store(std::string connection_string) : connection_string(std::move(connection_string)) {
+    }
+    void init() override {
+        cppdb::session sql(connection_string);
+        // readers do not wait for the writer
+        sql << "PRAGMA journal_mode=WAL" << cppdb::row;
+
         cppdb::transaction guard(sql);
 
         sql <<
@@ -58,13 +104,12 @@ public:
             ")"
             << cppdb::exec;
 
-        sql.commit();
+        guard.commit();
     }
 
-    void make_permlink(std::string permlink_name, cppcms::json::value code, cppcms::json::value compiler_info) {
-        std::time_t now_time = std::time(nullptr);
-        std::tm now = *std::gmtime(&now_time);
-
+    void put(const std::string& permlink_name, const permlink_record& record) override {
+        std::lock_guard<std::mutex> lock(writer);
+        cppdb::session sql(connection_string);
         cppdb::transaction guard(sql);
 
         cppdb::statement stat;
@@ -72,29 +117,29 @@ public:
         stat = sql <<
             "INSERT INTO code (compiler, code, optimize, warning, options, compiler_option_raw, runtime_option_raw, stdin, created_at) "
             "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?)"
-            << code["compiler"].str()
-            << code["code"].str()
+            << record.compiler
+            << record.code
             << false
             << false
-            << code.get("options", "")
-            << code.get("compiler-option-raw", "")
-            << code.get("runtime-option-raw", "")
-            << code.get("stdin", "")
-            << now
+            << record.options
+            << record.compiler_option_raw
+            << record.runtime_option_raw
+            << record.input
+            << record.created_at
             << cppdb::exec;
 
         auto code_id = stat.last_insert_id();
-        std::cout << code_id << std::endl;
 
-        std::stringstream ss;
-        compiler_info.save(ss, cppcms::json::compact);
-        stat = sql <<
-            "INSERT INTO compiler_info (code_id, json) "
-            "VALUES (?, ?)"
-            << code_id
-            << ss.str()
-            << cppdb::exec;
-        std::cout << "compiler_info id: " << stat.last_insert_id() << std::endl;
+        if (!record.compiler_info.is_undefined()) {
+            std::stringstream ss;
+            record.compiler_info.save(ss, cppcms::json::compact);
+            stat = sql <<
+                "INSERT INTO compiler_info (code_id, json) "
+                "VALUES (?, ?)"
+                << code_id
+                << ss.str()
+                << cppdb::exec;
+        }
 
         stat = sql <<
             "INSERT INTO link (permlink, code_id) "
@@ -104,13 +149,12 @@ public:
             << cppdb::exec;
 
         auto link_id = stat.last_insert_id();
-        std::cout << link_id << std::endl;
 
         int order = 1;
         stat = sql <<
             "INSERT INTO link_output (link_id, \"order\", type, output) "
             "VALUES (?, ?, ?, ?)";
-        for (auto&& output: code["outputs"].array()) {
+        for (auto&& output: record.outputs.array()) {
             stat
                 << link_id
                 << order
@@ -121,14 +165,18 @@ public:
             order += 1;
         }
 
-        sql.commit();
+        guard.commit();
     }
-    cppcms::json::value get_permlink(std::string permlink_name) {
+
+    bool get(const std::string& permlink_name, permlink_record& record) override {
+        cppdb::session sql(connection_string);
         cppdb::result r;
         r = sql <<
             "SELECT id, code_id FROM link WHERE permlink=? "
             << permlink_name
             << cppdb::row;
+        if (r.empty())
+            return false;
 
         auto link_id = r.get<int>("id");
         auto code_id = r.get<int>("code_id");
@@ -139,19 +187,13 @@ public:
             "WHERE id=?"
             << code_id
             << cppdb::row;
-        cppcms::json::value value;
-        value["compiler"] = r.get<std::string>("compiler");
-        value["code"] = r.get<std::string>("code");
-        value["options"] = r.get<std::string>("options");
-        value["compiler-option-raw"] = r.get<std::string>("compiler_option_raw");
-        value["runtime-option-raw"] = r.get<std::string>("runtime_option_raw");
-        value["stdin"] = r.get<std::string>("stdin");
-        auto created_at = r.get<std::tm>("created_at");
-        auto time = std::mktime(&created_at);
-        auto local_created_at = *std::localtime(&time);
-        char buf[128];
-        auto size = std::strftime(buf, sizeof(buf), "%FT%T", &local_created_at);
-        value["created-at"] = std::string(buf, size);
+        record.compiler = r.get<std::string>("compiler");
+        record.code = r.get<std::string>("code");
+        record.options = r.get<std::string>("options");
+        record.compiler_option_raw = r.get<std::string>("compiler_option_raw");
+        record.runtime_option_raw = r.get<std::string>("runtime_option_raw");
+        record.input = r.get<std::string>("stdin");
+        record.created_at = r.get<std::tm>("created_at");
 
         r = sql <<
             "SELECT type, output "
@@ -159,14 +201,17 @@ public:
             "WHERE link_id=? "
             "ORDER BY \"order\""
             << link_id;
-        int n = 0;
+        record.outputs = cppcms::json::value();
+        record.outputs.array({});
         while (r.next()) {
-            value["outputs"][n]["type"] = r.get<std::string>("type");
-            value["outputs"][n]["output"] = r.get<std::string>("output");
-            n += 1;
+            cppcms::json::value output;
+            output["type"] = r.get<std::string>("type");
+            output["output"] = r.get<std::string>("output");
+            record.outputs.array().push_back(output);
         }
 
         // load compiler_info if exists.
+        record.compiler_info = cppcms::json::value();
         r = sql <<
             "SELECT json "
             "FROM compiler_info "
@@ -177,9 +222,148 @@ public:
             cppcms::json::value compiler_info;
             std::stringstream ss(r.get<std::string>("json"));
             if (compiler_info.load(ss, true)) {
-                value["compiler-info"] = compiler_info;
+                record.compiler_info = compiler_info;
             }
         }
+        return true;
+    }
+
+    bool has(const std::string& permlink_name) {
+        cppdb::session sql(connection_string);
+        cppdb::result r = sql << "SELECT id FROM link WHERE permlink=?" << permlink_name << cppdb::row;
+        return !r.empty();
+    }
+    // up to `limit` links with an id greater than `after`, in the order they were made, as (id, name)
+    std::vector<std::pair<long long, std::string>> links(long long after, int limit) {
+        cppdb::session sql(connection_string);
+        cppdb::result r = sql << "SELECT id, permlink FROM link WHERE id>? ORDER BY id LIMIT ?" << after << limit;
+        std::vector<std::pair<long long, std::string>> result;
+        while (r.next())
+            result.push_back(std::make_pair(r.get<long long>("id"), r.get<std::string>("permlink")));
+        return result;
+    }
+};
+
+// Permlinks spread over several SQLite databases by the first `prefix_length` characters of their names, so
+// that writes to different shards do not wait for each other. Each shard has its own pool and writer.
+// Permlinks not found in their shard are looked up in `legacy`, the single database they were kept in
+// before, until kennel-migrate has copied them; nothing is written to it.
+class sharded_permlink_store : public permlink_store {
+    std::vector<std::unique_ptr<sqlite_permlink_store>> shards;
+    std::size_t prefix_length;
+    std::unique_ptr<sqlite_permlink_store> legacy;
+public:
+    sharded_permlink_store(const std::vector<std::string>& connection_strings, std::size_t prefix_length, const std::string& legacy_connection_string)
+        : prefix_length(prefix_length) {
+        for (auto&& cs: connection_strings)
+            shards.emplace_back(new sqlite_permlink_store(cs));
+        if (!legacy_connection_string.empty())
+            legacy.reset(new sqlite_permlink_store(legacy_connection_string));
+    }
+    // FNV-1a of the prefix; changing the shards or the prefix length moves permlinks to other shards
+    std::size_t shard_of(const std::string& permlink_name) const {
+        std::uint32_t h = 2166136261u;
+        for (std::size_t i = 0; i < prefix_length && i < permlink_name.size(); i++) {
+            h ^= (unsigned char)permlink_name[i];
+            h *= 16777619u;
+        }
+        return h % shards.size();
+    }
+    sqlite_permlink_store& shard(std::size_t i) {
+        return *shards[i];
+    }
+    sqlite_permlink_store* legacy_store() {
+        return legacy.get();
+    }
+
+    void init() override {
+        for (auto&& s: shards)
+            s->init();
+    }
+    void put(const std::string& permlink_name, const permlink_record& record) override {
+        shards[shard_of(permlink_name)]->put(permlink_name, record);
+    }
+    bool get(const std::string& permlink_name, permlink_record& record) override {
+        return shards[shard_of(permlink_name)]->get(permlink_name, record) ||
+            (legacy && legacy->get(permlink_name, record));
+    }
+};
+
+inline std::unique_ptr<permlink_store> permlink_store::make(const cppcms::json::value& database) {
+    if (database.type() != cppcms::json::is_object)
+        return std::unique_ptr<permlink_store>(new sqlite_permlink_store(database.str()));
+    std::vector<std::string> shards;
+    for (auto&& s: database["shards"].array())
+        shards.push_back(s.str());
+    if (shards.empty())
+        throw std::runtime_error("application.database.shards is empty");
+    return std::unique_ptr<permlink_store>(new sharded_permlink_store(shards, (std::size_t)database.get("prefix_length", 2.0), database.get("legacy", "")));
+}
+
+// Permlinks as the pages and the API see them.
+class permlink {
+    permlink_store& store;
+public:
+    permlink(cppcms::service& service) : store(permlink_store::instance(service)) {
+    }
+    void init() {
+        store.init();
+    }
+
+    void make_permlink(const std::string& permlink_name, const cppcms::json::value& code, const cppcms::json::value& compiler_info) {
+        make_permlink(permlink_name, code["compiler"].str(), code["code"].str(), code.get("options", ""),
+            code.get("compiler-option-raw", ""), code.get("runtime-option-raw", ""), code.get("stdin", ""),
+            code["outputs"], compiler_info);
+    }
+    // the code of a compile request, read in place
+    void make_permlink(const std::string& permlink_name, const json_view& code, const cppcms::json::value& outputs, const cppcms::json::value& compiler_info) {
+        make_permlink(permlink_name, code.str("compiler"), code.str("code"), code.str("options"),
+            code.str("compiler-option-raw"), code.str("runtime-option-raw"), code.str("stdin"),
+            outputs, compiler_info);
+    }
+    void make_permlink(const std::string& permlink_name, const std::string& compiler, const std::string& code,
+                       const std::string& options, const std::string& compiler_option_raw, const std::string& runtime_option_raw,
+                       const std::string& input, const cppcms::json::value& outputs, const cppcms::json::value& compiler_info) {
+        std::time_t now_time = std::time(nullptr);
+
+        permlink_record record;
+        record.compiler = compiler;
+        record.code = code;
+        record.options = options;
+        record.compiler_option_raw = compiler_option_raw;
+        record.runtime_option_raw = runtime_option_raw;
+        record.input = input;
+        record.created_at = *std::gmtime(&now_time);
+        record.outputs = outputs;
+        record.compiler_info = compiler_info;
+        store.put(permlink_name, record);
+    }
+    cppcms::json::value get_permlink(std::string permlink_name) {
+        permlink_record record;
+        if (!store.get(permlink_name, record))
+            throw std::runtime_error("no permlink " + permlink_name);
+
+        cppcms::json::value value;
+        value["compiler"] = record.compiler;
+        value["code"] = record.code;
+        value["options"] = record.options;
+        value["compiler-option-raw"] = record.compiler_option_raw;
+        value["runtime-option-raw"] = record.runtime_option_raw;
+        value["stdin"] = record.input;
+        auto time = std::mktime(&record.created_at);
+        auto local_created_at = *std::localtime(&time);
+        char buf[128];
+        auto size = std::strftime(buf, sizeof(buf), "%FT%T", &local_created_at);
+        value["created-at"] = std::string(buf, size);
+
+        int n = 0;
+        for (auto&& output: record.outputs.array()) {
+            value["outputs"][n]["type"] = output["type"].str();
+            value["outputs"][n]["output"] = output["output"].str();
+            n += 1;
+        }
+        if (!record.compiler_info.is_undefined())
+            value["compiler-info"] = record.compiler_info;
         return value;
     }
 };
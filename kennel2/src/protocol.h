@@ -1,23 +1,91 @@
 #ifndef PROTOCOL_H_INCLUDED
 #define PROTOCOL_H_INCLUDED
 
+#include <algorithm>
+#include <utility>
 #include <string>
 #include <vector>
 #include <cstdio>
 #include "libs.h"
+#include "json_view.h"
 #include "quoted_printable.h"
+#include "trace.h"
 
 struct protocol {
     std::string command;
     std::string contents;
+    // when set, sent instead of `contents`: a string of the request body, unescaped while it is encoded
+    json_string body;
 
+    protocol() {}
+    protocol(std::string command, std::string contents, json_string body = json_string())
+        : command(std::move(command))
+        , contents(std::move(contents))
+        , body(std::move(body)) {
+    }
+
+    std::size_t size() const {
+        return body.is_set() ? body.size : contents.size();
+    }
+    // calls f(const char*, std::size_t) with the contents, in pieces
+    template<class F>
+    void read(F f) const {
+        if (body.is_set())
+            body.decode(f);
+        else
+            f(contents.data(), contents.size());
+    }
+    // the contents encoded as quoted-printable, in a string of exactly their size
+    std::string encode() const {
+        quoted_printable::encoder counting;
+        quoted_printable::counter size;
+        read([&](const char* p, std::size_t n) { counting.encode(p, n, size); });
+        std::string qp;
+        qp.reserve(size.size);
+        quoted_printable::encoder encoder;
+        read([&](const char* p, std::size_t n) { encoder.encode(p, n, qp); });
+        return qp;
+    }
     std::string to_string() const {
-        auto qp = quoted_printable::encode(contents);
+        auto qp = encode();
         return command + " " + std::to_string(qp.size()) + ":" + qp + "\n";
     }
 };
 
-class async_read_protocol_t : public booster::enable_shared_from_this<async_read_protocol_t> {
+// A request as it is written to cattleshed. The contents of every frame are encoded once, from where they
+// are, into a buffer of their own, and the buffers are gathered by one write instead of being joined.
+class request_buffer {
+    std::vector<std::string> parts;
+public:
+    explicit request_buffer(const std::vector<protocol>& protos) {
+        parts.reserve(protos.size() * 2 + 1);
+        std::string head;
+        for (auto&& proto: protos) {
+            auto qp = proto.encode();
+            head += proto.command + " " + std::to_string(qp.size()) + ":";
+            parts.push_back(std::move(head));
+            parts.push_back(std::move(qp));
+            head = "\n";
+        }
+        parts.push_back(std::move(head));
+    }
+    booster::aio::const_buffer buffer() const {
+        booster::aio::const_buffer buf;
+        for (auto&& part: parts)
+            if (!part.empty())
+                buf.add(part.data(), part.size());
+        return buf;
+    }
+    std::size_t size() const {
+        std::size_t n = 0;
+        for (auto&& part: parts)
+            n += part.size();
+        return n;
+    }
+};
+
+// Splits the stream from cattleshed into frames, one character at a time.
+class protocol_parser {
     enum class read_state_t {
         command,
         size,
@@ -25,6 +93,8 @@ class async_read_protocol_t : public booster::enable_shared_from_this<async_read
     };
     read_state_t state;
     int content_size;
+
+public:
     std::string command;
     std::string contents;
 
@@ -38,6 +108,10 @@ class async_read_protocol_t : public booster::enable_shared_from_this<async_read
         error_invalid_content_size,
     };
 
+    protocol_parser() {
+        clear();
+    }
+
     consume_state_t consume(char c) {
         if (state == read_state_t::command) {
             if (c == '\0') {
@@ -74,15 +148,32 @@ class async_read_protocol_t : public booster::enable_shared_from_this<async_read
         }
         return consume_state_t::more;
     }
+    // takes as much of the contents as [p, p + n) holds at once; the number of characters taken
+    std::size_t consume_contents(const char* p, std::size_t n) {
+        if (state != read_state_t::contents)
+            return 0;
+        auto taken = std::min(n, static_cast<std::size_t>(content_size) - contents.size());
+        contents.append(p, taken);
+        return taken;
+    }
     void clear() {
         state = read_state_t::command;
         content_size = 0;
         command.clear();
         contents.clear();
     }
+};
+
+class async_read_protocol_t : public booster::enable_shared_from_this<async_read_protocol_t> {
+    typedef protocol_parser::consume_state_t consume_state_t;
+    protocol_parser parser;
 
     void disconnect() {
-        clear();
+        parser.clear();
+        if (trace) {
+            trace->end(trace_span);
+            trace.reset();
+        }
         if (sock) {
             booster::system::error_code ec;
             sock->shutdown(booster::aio::stream_socket::shut_rdwr, ec);
@@ -99,6 +190,8 @@ private:
     char buf[BUFSIZ];
     int line;
     int max_line;
+    tracer_ptr trace;
+    std::size_t trace_span;
 
     bool read_(const booster::system::error_code& e, std::size_t size) {
         if (e) {
@@ -107,24 +200,28 @@ private:
             return true;
         }
         for (std::size_t i = 0; i < size; i++) {
+            i += parser.consume_contents(buf + i, size - i);
+            if (i == size)
+                break;
             auto c = buf[i];
-            auto cs = consume(c);
+            auto cs = parser.consume(c);
             if (cs == consume_state_t::more) {
                 continue;
             }
 
             if (cs == consume_state_t::read_line) {
                 protocol proto;
-                proto.command = command;
-                proto.contents = quoted_printable::decode(contents);
+                proto.command = parser.command;
+                // StdOutRaw carries the output of the program as it is
+                proto.contents = parser.command == "StdOutRaw" ? parser.contents : quoted_printable::decode(parser.contents);
                 handler(e, proto);
                 line += 1;
-                if ((command == "Control" && contents == "Finish") ||
+                if ((parser.command == "Control" && parser.contents == "Finish") ||
                     (max_line > 0 && line == max_line)) {
                     disconnect();
                     return true;
                 } else {
-                    clear();
+                    parser.clear();
                 }
             }
             if (cs == consume_state_t::read_completed) {
@@ -146,8 +243,9 @@ private:
     }
 
 public:
-    async_read_protocol_t(socket_ptr_t sock, const handler_t& handler, int max_line = 0) : sock(sock), handler(handler), line(0), max_line(max_line) {
-        clear();
+    async_read_protocol_t(socket_ptr_t sock, const handler_t& handler, int max_line = 0, tracer_ptr trace = tracer_ptr()) : sock(sock), handler(handler), line(0), max_line(max_line), trace(trace), trace_span(0) {
+        if (trace)
+            trace_span = trace->begin("stream");
     }
 
     void read() {
@@ -171,7 +269,7 @@ public:
 };
 
 template<class F>
-void send_command(booster::aio::io_service& service, booster::aio::endpoint ep, std::vector<protocol> protos, F f, int max_line = 0) {
+void send_command(booster::aio::io_service& service, booster::aio::endpoint ep, const request_buffer& request, F f, int max_line = 0, tracer_ptr trace = tracer_ptr()) {
     booster::shared_ptr<booster::aio::stream_socket> sock(new booster::aio::stream_socket(service));
 
     std::cout << "open start" << std::endl;
@@ -179,70 +277,63 @@ void send_command(booster::aio::io_service& service, booster::aio::endpoint ep,
     sock->open(booster::aio::family_type::pf_inet);
 
     std::cout << "connect start" << std::endl;
+    auto connect_span = trace ? trace->begin("connect") : 0;
     sock->connect(ep);
+    if (trace)
+        trace->end(connect_span);
 
     std::cout << "connected" << std::endl;
-    std::string send_string;
-    for (auto&& proto: protos) {
-        send_string += proto.to_string();
-    }
+    auto write_span = trace ? trace->begin("write") : 0;
+    sock->write(request.buffer());
+    if (trace)
+        trace->end(write_span);
 
-    sock->write(booster::aio::buffer(send_string));
-
-    booster::shared_ptr<async_read_protocol_t> arp(new async_read_protocol_t(sock, f, max_line));
+    booster::shared_ptr<async_read_protocol_t> arp(new async_read_protocol_t(sock, f, max_line, trace));
     arp->read();
 }
 
 template<class F>
-void send_command_async(booster::aio::io_service& service, booster::aio::endpoint ep, std::vector<protocol> protos, F f, int max_line = 0) {
+void send_command(booster::aio::io_service& service, booster::aio::endpoint ep, const std::vector<protocol>& protos, F f, int max_line = 0, tracer_ptr trace = tracer_ptr()) {
+    send_command(service, ep, request_buffer(protos), f, max_line, trace);
+}
+
+// `request` is shared with the retries of the caller, which send it again as it is.
+// When the request cannot be connected or written, `unsent` is called with the error instead of f, if it is set.
+typedef booster::function<void (const booster::system::error_code&)> unsent_handler_t;
+template<class F>
+void send_command_async(booster::aio::io_service& service, booster::aio::endpoint ep, booster::shared_ptr<const request_buffer> request, F f, int max_line = 0, tracer_ptr trace = tracer_ptr(), unsent_handler_t unsent = unsent_handler_t()) {
     booster::shared_ptr<booster::aio::stream_socket> sock(new booster::aio::stream_socket(service));
+    if (!unsent)
+        unsent = [f](const booster::system::error_code& e) { f(e, protocol()); };
 
     std::cout << "open start" << std::endl;
     booster::system::error_code ec;
     sock->open(booster::aio::family_type::pf_inet, ec);
     if (ec)
-        return (void)f(ec, protocol());
+        return unsent(ec);
 
     std::cout << "connect start" << std::endl;
-    sock->async_connect(ep, [sock, f, max_line, protos](const booster::system::error_code& e) {
+    auto connect_span = trace ? trace->begin("connect") : 0;
+    sock->async_connect(ep, [sock, f, max_line, request, trace, connect_span, unsent](const booster::system::error_code& e) {
+        if (trace)
+            trace->end(connect_span);
         if (e)
-            return (void)f(e, protocol());
+            return unsent(e);
         std::cout << "connected" << std::endl;
-        std::string send_string;
-        for (auto&& proto: protos) {
-            send_string += proto.to_string();
-        }
-        std::size_t send_string_size = send_string.size();
-
-        sock->async_write(booster::aio::buffer(send_string), [sock, f, max_line, send_string_size](const booster::system::error_code& e, std::size_t send_size) {
+        auto write_span = trace ? trace->begin("write") : 0;
+        sock->async_write(request->buffer(), [sock, f, max_line, request, trace, write_span, unsent](const booster::system::error_code& e, std::size_t send_size) {
+            if (trace)
+                trace->end(write_span);
             if (e)
-                return (void)f(e, protocol());
-            assert(send_size == send_string_size);
+                return unsent(e);
+            assert(send_size == request->size());
 
             std::cout << "written" << std::endl;
 
-            booster::shared_ptr<async_read_protocol_t> arp(new async_read_protocol_t(sock, f, max_line));
+            booster::shared_ptr<async_read_protocol_t> arp(new async_read_protocol_t(sock, f, max_line, trace));
             arp->read_async();
         });
     });
 }
 
-template<class F>
-void send_command(cppcms::service& srv, std::vector<protocol> protos, F f, int max_line = 0) {
-    auto host = srv.settings()["application"]["cattleshed"]["host"].str();
-    auto port = (int)srv.settings()["application"]["cattleshed"]["port"].number();
-    booster::aio::endpoint ep(host, port);
-
-    send_command(srv.get_io_service(), ep, protos, f, max_line);
-}
-
-template<class F>
-void send_command_async(cppcms::service& srv, std::vector<protocol> protos, F f, int max_line = 0) {
-    auto host = srv.settings()["application"]["cattleshed"]["host"].str();
-    auto port = (int)srv.settings()["application"]["cattleshed"]["port"].number();
-    booster::aio::endpoint ep(host, port);
-
-    send_command_async(srv.get_io_service(), ep, protos, f, max_line);
-}
-
 #endif // PROTOCOL_H_INCLUDED
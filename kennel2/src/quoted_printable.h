@@ -1,6 +1,8 @@
 #ifndef QUOTED_PRINTABLE_H_INCLUDED
 #define QUOTED_PRINTABLE_H_INCLUDED
 
+#include <cstddef>
+#include <string>
 #include <utility>
 
 class quoted_printable {
@@ -30,36 +32,50 @@ class quoted_printable {
     }
 
 public:
-    static std::string encode(const std::string& str) {
-        std::string r;
-        r.reserve(str.size() + str.size() / 2);
-        int n = 0;
-        for (auto&& c: str) {
-            bool enc = is_encode(c);
-            if (enc) {
-                auto h = to_hex(c);
-                if (n >= 73) {
-                    r += "=\n=";
-                    r.push_back(h.first);
-                    r.push_back(h.second);
-                    n = 3;
-                } else {
+    // Encodes a string given in pieces, breaking the lines where encoding it at once would.
+    // `Out` is anything with push_back(char): a std::string, or a counter to size the output first.
+    class encoder {
+        int n;
+    public:
+        encoder() : n(0) {}
+        template<class Out>
+        void encode(const char* p, std::size_t size, Out& r) {
+            for (auto end = p + size; p != end; ++p) {
+                auto c = *p;
+                bool enc = is_encode(c);
+                if (enc) {
+                    auto h = to_hex(c);
+                    if (n >= 73) {
+                        r.push_back('=');
+                        r.push_back('\n');
+                        n = 0;
+                    }
                     r.push_back('=');
                     r.push_back(h.first);
                     r.push_back(h.second);
                     n += 3;
-                }
-            } else {
-                if (n >= 75) {
-                    r += "=\n";
-                    r.push_back(c);
-                    n = 1;
                 } else {
+                    if (n >= 75) {
+                        r.push_back('=');
+                        r.push_back('\n');
+                        n = 0;
+                    }
                     r.push_back(c);
                     n += 1;
                 }
             }
         }
+    };
+    struct counter {
+        std::size_t size;
+        counter() : size(0) {}
+        void push_back(char) { size += 1; }
+    };
+
+    static std::string encode(const std::string& str) {
+        std::string r;
+        r.reserve(str.size() + str.size() / 2);
+        encoder().encode(str.data(), str.size(), r);
         return r;
     }
 
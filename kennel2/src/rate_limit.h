@@ -0,0 +1,160 @@
+#ifndef RATE_LIMIT_H_INCLUDED
+#define RATE_LIMIT_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "libs.h"
+
+// Token buckets for the requests that run code, one per client: a request carrying an API key listed in
+// "application.rate_limit.api_keys" ({key: {"rate", "burst"}}) takes from the bucket of that key, any other
+// from the bucket of its address, limited by "application.rate_limit.rate" and "burst". A bucket holds up to
+// `burst` requests and refills at `rate` requests per second; a rate of 0 does not limit. At most
+// "application.rate_limit.max_clients" buckets are kept, the one taken from least recently making room for a new one.
+class rate_limiter {
+public:
+    typedef std::chrono::steady_clock clock;
+
+private:
+    struct limit {
+        double rate;
+        double burst;
+    };
+    struct bucket {
+        double tokens;
+        clock::time_point updated;
+        std::list<std::string>::iterator used;
+    };
+
+    limit address_limit;
+    std::map<std::string, limit> key_limits;
+    std::unordered_map<std::string, bucket> buckets;
+    // the names of the buckets, the one taken from least recently first
+    std::list<std::string> used;
+    std::size_t max_buckets;
+    bool configured;
+    std::mutex mtx;
+
+    void configure(cppcms::service& srv) {
+        if (configured)
+            return;
+        address_limit.rate = srv.settings().get("application.rate_limit.rate", 0.0);
+        address_limit.burst = std::max(srv.settings().get("application.rate_limit.burst", 10.0), 1.0);
+        const auto& keys = srv.settings().find("application.rate_limit.api_keys");
+        if (keys.type() == cppcms::json::is_object) {
+            for (auto&& k: keys.object()) {
+                limit l;
+                l.rate = k.second.get("rate", 0.0);
+                l.burst = std::max(k.second.get("burst", 10.0), 1.0);
+                key_limits[k.first] = l;
+            }
+        }
+        max_buckets = std::max(srv.settings().get("application.rate_limit.max_clients", 100000), 1);
+        configured = true;
+    }
+    // A refilled bucket has nothing to remember; the oldest is forgotten once it refilled, or to make room for a
+    // new one when there are max_buckets. At most one is looked at, so that a new client costs no more than any.
+    void forget_oldest(bool full, clock::time_point now) {
+        if (used.empty())
+            return;
+        auto it = buckets.find(used.front());
+        if (!full && refill(it->second, limit_of(it->first), now) < limit_of(it->first).burst)
+            return;
+        buckets.erase(it);
+        used.pop_front();
+    }
+    const limit& limit_of(const std::string& name) const {
+        if (name.compare(0, 4, "key:") == 0) {
+            auto it = key_limits.find(name.substr(4));
+            if (it != key_limits.end())
+                return it->second;
+        }
+        return address_limit;
+    }
+    // `now` may be a little behind b.updated when another thread took a token in between
+    static double refill(bucket& b, const limit& l, clock::time_point now) {
+        if (now <= b.updated)
+            return b.tokens;
+        b.tokens = std::min(l.burst, b.tokens + l.rate * std::chrono::duration<double>(now - b.updated).count());
+        b.updated = now;
+        return b.tokens;
+    }
+
+public:
+    rate_limiter()
+        : max_buckets(100000)
+        , configured(false) {
+        address_limit.rate = 0;
+        address_limit.burst = 0;
+    }
+    static rate_limiter& instance() {
+        static rate_limiter limiter;
+        return limiter;
+    }
+
+    // the limits given instead of read from the settings, for the tests
+    void set_limit(double rate, double burst) {
+        std::lock_guard<std::mutex> lock(mtx);
+        address_limit.rate = rate;
+        address_limit.burst = std::max(burst, 1.0);
+        configured = true;
+    }
+    void set_max_clients(std::size_t n) {
+        std::lock_guard<std::mutex> lock(mtx);
+        max_buckets = std::max<std::size_t>(n, 1);
+    }
+    std::size_t clients() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return buckets.size();
+    }
+    void set_key_limit(const std::string& api_key, double rate, double burst) {
+        std::lock_guard<std::mutex> lock(mtx);
+        limit l;
+        l.rate = rate;
+        l.burst = std::max(burst, 1.0);
+        key_limits[api_key] = l;
+        configured = true;
+    }
+
+    // Takes a token for a request from `address` with `api_key` (may be empty). Returns 0 if the request may go
+    // on, or the seconds until the client has a token again.
+    int take(cppcms::service& srv, const std::string& address, const std::string& api_key) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            configure(srv);
+        }
+        return take(address, api_key, clock::now());
+    }
+    // the same at `now`, with the limits already configured
+    int take(const std::string& address, const std::string& api_key, clock::time_point now) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto name = !api_key.empty() && key_limits.count(api_key) != 0 ? "key:" + api_key : "address:" + address;
+        const auto& l = limit_of(name);
+        if (l.rate <= 0)
+            return 0;
+
+        auto it = buckets.find(name);
+        if (it == buckets.end()) {
+            forget_oldest(buckets.size() >= max_buckets, now);
+            bucket b;
+            b.tokens = l.burst;
+            b.updated = now;
+            b.used = used.insert(used.end(), name);
+            it = buckets.insert(std::make_pair(name, b)).first;
+        } else {
+            used.splice(used.end(), used, it->second.used);
+        }
+        if (refill(it->second, l, now) >= 1) {
+            it->second.tokens -= 1;
+            return 0;
+        }
+        return std::max(1, (int)std::ceil((1 - it->second.tokens) / l.rate));
+    }
+};
+
+#endif // RATE_LIMIT_H_INCLUDED
@@ -26,6 +26,7 @@ namespace content {
 
         bool using_permlink;
         std::string permlink;
+        std::string watch_run; // the run streamed into the page, if any
 
         void set_twitter(std::string title, std::string description) {
             std::string tmpl = " - Wandbox";
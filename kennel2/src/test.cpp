@@ -0,0 +1,281 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "journal.h"
+#include "json_view.h"
+#include "protocol.h"
+#include "quoted_printable.h"
+#include "rate_limit.h"
+
+namespace {
+
+int failures = 0;
+
+void check(bool ok, const std::string& what) {
+    if (ok)
+        return;
+    std::cerr << "FAIL: " << what << std::endl;
+    ++failures;
+}
+
+bool load(json_view& view, const std::string& doc) {
+    return view.load(doc.data(), doc.size());
+}
+
+void test_json_escapes() {
+    json_view view;
+    const std::string doc = "{\"code\":\"a\\n\\t\\\"\\\\\\/\\u0041\\u00e9\\u20ac\\ud83d\\ude00z\",\"n\":1}";
+    check(load(view, doc), "a document with every escape loads");
+    const std::string expected = "a\n\t\"\\/A\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80z";
+    check(view.str("code") == expected, "escapes and a surrogate pair are unescaped to UTF-8");
+    check(view.string("code").size == expected.size(), "the size of an unescaped string is known before it is");
+    check(view.type("n") == cppcms::json::is_number, "a number member");
+    check(view.str("n").empty(), "a member that is not a string has no string");
+}
+
+void test_json_lone_surrogates() {
+    json_view view;
+    check(!load(view, "{\"code\":\"\\ud83d\"}"), "a high surrogate at the end of a string is rejected");
+    check(!load(view, "{\"code\":\"\\ud83dx\"}"), "a high surrogate followed by a character is rejected");
+    check(!load(view, "{\"code\":\"\\ud83d\\u0041\"}"), "a high surrogate followed by another escape is rejected");
+    check(!load(view, "{\"code\":\"\\ude00\"}"), "a low surrogate on its own is rejected");
+    check(!load(view, "{\"code\":\"\\u12\"}"), "a short \\u escape is rejected");
+    check(!load(view, "{\"code\":\"\\x\"}"), "an unknown escape is rejected");
+}
+
+void test_json_pieces() {
+    // more escapes than the decode buffer holds, between runs that are passed as they are
+    std::string doc = "{\"code\":\"head";
+    std::string expected = "head";
+    for (int i = 0; i < 300; ++i) {
+        doc += i % 3 == 0 ? "\\u00e9" : "\\n";
+        expected += i % 3 == 0 ? "\xc3\xa9" : "\n";
+    }
+    doc += "tail\"}";
+    expected += "tail";
+
+    json_view view;
+    check(load(view, doc), "a long escaped string loads");
+    std::string joined;
+    int pieces = 0;
+    view.string("code").decode([&](const char* p, std::size_t n) {
+        joined.append(p, n);
+        ++pieces;
+    });
+    check(joined == expected, "the pieces of a decoded string join to the whole");
+    check(pieces > 2, "a long escaped string is decoded in pieces");
+
+    protocol proto("Source", "", view.string("code"));
+    check(proto.encode() == quoted_printable::encode(expected), "a string encoded from its pieces is the same as at once");
+}
+
+void test_quoted_printable() {
+    std::string s;
+    for (int i = 0; i < 1000; ++i)
+        s += static_cast<char>(i % 7 == 0 ? '=' : i % 11 == 0 ? '\xff' : 'a' + i % 26);
+    const auto qp = quoted_printable::encode(s);
+    std::size_t begin = 0;
+    bool short_lines = true;
+    for (auto end = qp.find('\n'); end != std::string::npos; begin = end + 1, end = qp.find('\n', begin))
+        short_lines = short_lines && end - begin <= 76 && qp[end - 1] == '=';
+    check(short_lines, "every encoded line ends in a soft break within 76 octets");
+    check(qp.size() - begin <= 76, "the last encoded line is within 76 octets");
+    check(quoted_printable::decode(qp) == s, "quoted-printable round trips");
+
+    quoted_printable::encoder encoder;
+    std::string pieces;
+    for (std::size_t i = 0; i < s.size(); i += 7)
+        encoder.encode(s.data() + i, std::min<std::size_t>(7, s.size() - i), pieces);
+    check(pieces == qp, "the lines break where they do when the string is encoded at once");
+}
+
+// feeds `stream` to the parser as async_read_protocol_t does, in reads of `size` octets
+std::vector<protocol> parse(const std::string& stream, std::size_t size) {
+    std::vector<protocol> frames;
+    protocol_parser parser;
+    for (std::size_t begin = 0; begin < stream.size(); begin += size) {
+        const char* buf = stream.data() + begin;
+        const auto n = std::min(size, stream.size() - begin);
+        for (std::size_t i = 0; i < n; i++) {
+            i += parser.consume_contents(buf + i, n - i);
+            if (i == n)
+                break;
+            auto cs = parser.consume(buf[i]);
+            if (cs == protocol_parser::consume_state_t::read_line) {
+                frames.push_back(protocol(parser.command, quoted_printable::decode(parser.contents)));
+                parser.clear();
+            } else if (cs != protocol_parser::consume_state_t::more) {
+                return std::vector<protocol>();
+            }
+        }
+    }
+    return frames;
+}
+
+void test_frames() {
+    const std::vector<protocol> protos = {
+        protocol("Control", "Start"),
+        protocol("StdOut", std::string(200, 'x') + "=\n" + std::string(100, 'y')),
+        protocol("ExitCode", "0"),
+        protocol("Control", "Finish"),
+    };
+    std::string stream;
+    for (auto&& proto: protos)
+        stream += proto.to_string();
+    check(request_buffer(protos).size() == stream.size(), "a request buffer holds the frames as they are written one by one");
+
+    for (std::size_t size = 1; size <= stream.size(); ++size) {
+        auto frames = parse(stream, size);
+        bool same = frames.size() == protos.size();
+        for (std::size_t i = 0; same && i < frames.size(); ++i)
+            same = frames[i].command == protos[i].command && frames[i].contents == protos[i].contents;
+        check(same, "frames read " + std::to_string(size) + " octets at a time");
+    }
+    check(parse("Control 5:Starts\n", 4096).empty(), "a frame longer than its size is an error");
+    check(parse("Control x:Start\n", 4096).empty(), "a size that is not a number is an error");
+}
+
+void test_rate_limit() {
+    typedef rate_limiter::clock clock;
+    const auto t0 = clock::now();
+    const auto at = [t0](double seconds) {
+        return t0 + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(seconds));
+    };
+
+    rate_limiter limiter;
+    limiter.set_limit(2, 3);
+    limiter.set_key_limit("k", 1, 1);
+    check(limiter.take("a", "", at(0)) == 0 && limiter.take("a", "", at(0)) == 0 && limiter.take("a", "", at(0)) == 0, "a full bucket takes `burst` requests at once");
+    check(limiter.take("a", "", at(0)) == 1, "an empty bucket asks to retry once a token is back");
+    check(limiter.take("b", "", at(0)) == 0, "every address has a bucket of its own");
+    check(limiter.take("a", "", at(0.25)) == 1, "half a token is not enough");
+    check(limiter.take("a", "", at(0.5)) == 0, "a token is back after 1 / rate seconds");
+    check(limiter.take("a", "", at(0.5)) == 1, "and is taken");
+    check(limiter.take("a", "", at(0.4)) == 1, "a time before the last refill adds nothing");
+    int taken = 0;
+    while (limiter.take("a", "", at(100)) == 0)
+        ++taken;
+    check(taken == 3, "a bucket refills up to `burst` and no further");
+
+    check(limiter.take("a", "k", at(0)) == 0, "a listed key has a bucket of its own");
+    check(limiter.take("a", "k", at(0)) == 1, "limited by the key");
+    check(limiter.take("c", "unlisted", at(0)) == 0, "an unlisted key is limited by the address");
+
+    rate_limiter few;
+    few.set_limit(1, 1);
+    few.set_max_clients(3);
+    for (int i = 0; i < 1000; ++i)
+        few.take("x" + std::to_string(i), "", at(0));
+    check(few.clients() == 3, "no more than max_clients buckets are kept");
+    few.take("a", "", at(0));
+    few.take("b", "", at(0));
+    few.take("a", "", at(0.1));
+    few.take("c", "", at(0.2));
+    few.take("d", "", at(0.3));
+    check(few.take("a", "", at(0.3)) == 1, "the bucket taken from most recently is kept");
+    check(few.take("b", "", at(0.3)) == 0, "the one taken from least recently makes room");
+    check(few.clients() == 3, "a client that was forgotten takes the place of another");
+
+    rate_limiter refilled;
+    refilled.set_limit(1, 1);
+    refilled.take("a", "", at(0));
+    refilled.take("b", "", at(0.5));
+    refilled.take("c", "", at(2));
+    check(refilled.clients() == 2, "the oldest bucket is forgotten once it refilled");
+
+    rate_limiter unlimited;
+    unlimited.set_limit(0, 1);
+    bool always = true;
+    for (int i = 0; i < 100; ++i)
+        always = always && unlimited.take("a", "", at(0)) == 0;
+    check(always, "a rate of 0 does not limit");
+}
+
+void test_journal() {
+    run_journal journal(0);
+    journal.append(protocol("Control", "Start"));
+    journal.append(protocol("StdOut", "a"));
+    journal.append(protocol("StdOut", "b"));
+
+    std::vector<run_journal::entry> out;
+    bool finished = true;
+    check(journal.since(1, out, finished) && out.size() == 2 && out[0].id == 2 && out[1].proto.contents == "b", "a run is resumed after an event that is still kept");
+    check(!finished, "a run is not finished before it is");
+    std::vector<std::size_t> seen;
+    check(journal.subscribe(2, [&](const run_journal::entry& e) { seen.push_back(e.id); }) != 0, "a stream is resumed after an event");
+    journal.append(protocol("Control", "Finish"));
+    journal.finish();
+    check(seen == std::vector<std::size_t>({3, 4}), "the entries after the last event, then the new ones");
+    out.clear();
+    check(journal.since(4, out, finished) && out.empty() && finished, "a finished run has nothing after its last event");
+    std::size_t late = 0;
+    check(journal.subscribe(0, [&](const run_journal::entry&) { ++late; }) != 0 && late == 4, "a finished run is replayed whole");
+
+    run_journal small(8);
+    small.append(protocol("StdOut", "0123"));
+    small.append(protocol("StdOut", "4567"));
+    out.clear();
+    check(!small.since(0, out, finished), "a run is not resumed after an event that was dropped");
+    check(small.subscribe(0, [](const run_journal::entry&) {}) == 0, "nor streamed from it");
+    check(small.since(1, out, finished) && out.size() == 1 && out[0].id == 2, "but is after the oldest one kept");
+}
+
+void test_journal_subscribers() {
+    run_journal journal(0);
+    journal.append(protocol("Control", "Start"));
+
+    std::vector<std::size_t> first, second;
+    bool since_in_subscriber = true;
+    auto subscription = journal.subscribe(0, [&](const run_journal::entry& e) {
+        first.push_back(e.id);
+        // the journal is not locked while a subscriber runs
+        std::vector<run_journal::entry> out;
+        bool finished;
+        since_in_subscriber = since_in_subscriber && journal.since(0, out, finished);
+    });
+    journal.subscribe(0, [&](const run_journal::entry& e) { second.push_back(e.id); });
+    journal.append(protocol("StdOut", "a"));
+    check(first == std::vector<std::size_t>({1, 2}) && second == first, "every subscriber is sent every entry");
+    check(since_in_subscriber, "a subscriber may read the journal");
+
+    journal.unsubscribe(subscription);
+    journal.append(protocol("StdOut", "b"));
+    check(first.size() == 2 && second.size() == 3, "an unsubscribed client is not sent the rest");
+
+    // clients joining while the run goes on get each entry once and in order
+    const std::size_t n = 2000;
+    std::thread writer([&journal, n]() {
+        for (std::size_t i = 0; i < n; ++i)
+            journal.append(protocol("StdOut", "x"));
+        journal.finish();
+    });
+    std::vector<std::vector<std::size_t>> seen(20);
+    for (auto&& s: seen)
+        journal.subscribe(0, [&s](const run_journal::entry& e) { s.push_back(e.id); });
+    writer.join();
+    bool in_order = true;
+    for (auto&& s: seen) {
+        in_order = in_order && s.size() == n + 3;
+        for (std::size_t i = 0; in_order && i < s.size(); ++i)
+            in_order = s[i] == i + 1;
+    }
+    check(in_order, "a client joining a live run gets every entry once and in order");
+}
+
+} // namespace
+
+int main() {
+    test_json_escapes();
+    test_json_lone_surrogates();
+    test_json_pieces();
+    test_quoted_printable();
+    test_frames();
+    test_rate_limit();
+    test_journal();
+    test_journal_subscribers();
+    if (failures != 0)
+        std::cerr << failures << " failed" << std::endl;
+    return failures == 0 ? 0 : 1;
+}
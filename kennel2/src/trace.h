@@ -0,0 +1,117 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "libs.h"
+
+// Records spans of one request against a trace id that is also sent to cattleshed (TraceId frame).
+// The spans are written as chrome trace_event json when the trace is sampled or slow.
+class tracer {
+    struct span {
+        std::string name;
+        std::int64_t begin;
+        std::int64_t end;
+    };
+
+    std::string dir;
+    int sample_rate;
+    int slow_threshold;
+    std::string trace_id;
+    std::int64_t started;
+    std::vector<span> spans;
+    std::mutex mtx;
+
+    static std::string make_id() {
+        const char tbl[] = "0123456789abcdef";
+        std::random_device seed_gen;
+        std::mt19937 engine(seed_gen());
+        std::uniform_int_distribution<> dist(0, 15);
+        std::string id;
+        while (id.size() < 16) {
+            id.push_back(tbl[dist(engine)]);
+        }
+        return id;
+    }
+
+    void flush() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (dir.empty())
+            return;
+        auto elapsed = now() - started;
+        bool slow = slow_threshold > 0 && elapsed >= static_cast<std::int64_t>(slow_threshold) * 1000;
+        if (!slow && !sampled(trace_id, sample_rate))
+            return;
+
+        std::ofstream os((dir + "/" + trace_id + ".kennel.json").c_str());
+        if (!os)
+            return;
+        auto pid = ::getpid();
+        os << "{\"traceEvents\":[";
+        os << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"args\":{\"name\":\"kennel\"}}";
+        os << ",{\"name\":\"request\",\"cat\":\"kennel\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":0,\"ts\":" << started << ",\"dur\":" << elapsed << "}";
+        for (auto&& s: spans) {
+            os << ",{\"name\":\"" << s.name << "\",\"cat\":\"kennel\",\"ph\":\"X\",\"pid\":" << pid << ",\"tid\":0,\"ts\":" << s.begin << ",\"dur\":" << (s.end - s.begin) << "}";
+        }
+        os << "],\"otherData\":{\"trace-id\":\"" << trace_id << "\",\"slow\":" << (slow ? "true" : "false") << "}}\n";
+    }
+
+public:
+    tracer(cppcms::service& srv)
+        : dir(srv.settings().get("application.trace.dir", ""))
+        , sample_rate(srv.settings().get("application.trace.sample_rate", 0))
+        , slow_threshold(srv.settings().get("application.trace.slow_threshold", 0))
+        , trace_id(make_id())
+        , started(now()) {
+    }
+    ~tracer() {
+        try {
+            flush();
+        } catch (...) {
+        }
+    }
+    tracer(const tracer&) = delete;
+    tracer& operator=(const tracer&) = delete;
+
+    const std::string& id() const {
+        return trace_id;
+    }
+    std::size_t begin(std::string name) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto t = now();
+        spans.push_back(span{std::move(name), t, t});
+        return spans.size() - 1;
+    }
+    void end(std::size_t n) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (n < spans.size())
+            spans[n].end = now();
+    }
+
+    static std::int64_t now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+    // same hash as cattleshed, so both services sample the same trace ids
+    static bool sampled(const std::string& id, int sample_rate) {
+        if (sample_rate <= 0)
+            return false;
+        if (sample_rate >= 100)
+            return true;
+        std::uint32_t h = 2166136261u;
+        for (auto&& c: id) {
+            h ^= static_cast<unsigned char>(c);
+            h *= 16777619u;
+        }
+        return static_cast<int>(h % 100) < sample_rate;
+    }
+};
+
+typedef booster::shared_ptr<tracer> tracer_ptr;
+
+#endif // TRACE_H_INCLUDED
@@ -5,6 +5,7 @@ var reTrim = /^(\s|\u00A0)+|(\s|\u00A0)+$/g;
 var PostEventSource = function (url, obj) {
   var eventsource = this,
       lastEventId = null,
+      interval = 1000,
       cache = '';
 
   if (!url || typeof url != 'string') {
@@ -80,7 +81,11 @@ var PostEventSource = function (url, obj) {
 
           // don't need to poll again, because we're long-loading
         } else if (eventsource.readyState !== eventsource.CLOSED) {
-          if (this.readyState == 4) { // and some other status
+          if (this.readyState == 4 && this.status == 0 && lastEventId != null) {
+            // the connection dropped; the server resumes the run after the last event we received
+            eventsource.readyState = eventsource.CONNECTING;
+            setTimeout(poll, interval);
+          } else if (this.readyState == 4) { // and some other status
             // dispatch error
             eventsource.readyState = eventsource.ERROR;
             eventsource.dispatchEvent('error', { type: 'error' });
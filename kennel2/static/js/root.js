@@ -127,6 +127,12 @@ $(function() {
     result_container.set_code(compiler, code.code, code.stdin, code.outputs);
   }
 
+  // stream the run named in the url, started by someone else
+  if (WATCH_RUN != '') {
+    result_container.expand(true).change();
+    result_container.watch(WATCH_RUN);
+  }
+
   update_compile_command(compiler);
 
   editor.focus();
@@ -579,7 +585,18 @@ ResultContainer.prototype.post_code = function(compiler, code, stdin) {
   this.running = true;
 
   var result_window = this._post_init(compiler, code, this._next_name());
-  result_window.post_code(compiler, code, stdin);
+  var benchmark = $(this.settings_id).find('input.benchmark').prop('checked');
+  result_window.post_code(compiler, code, stdin, benchmark);
+}
+
+ResultContainer.prototype.watch = function(run) {
+  if (this.running) {
+    return;
+  }
+  this.running = true;
+
+  var result_window = this._post_init(null, null, 'watch');
+  result_window.watch(run);
 }
 
 ResultContainer.prototype.set_code = function(compiler, code, stdin, outputs) {
@@ -781,7 +798,45 @@ ResultWindow.prototype.to_compiler_info = function(compiler) {
   return compiler_info;
 }
 
-ResultWindow.prototype.post_code = function(compiler, code, stdin) {
+ResultWindow.prototype.benchmark_table = function(json) {
+  var result = JSON.parse(json);
+  var table = $('<table class="table table-condensed benchmark"></table>');
+  $('<tr><th></th><th>min</th><th>median</th><th>max</th></tr>').appendTo(table);
+  var row = function(name, summary, unit, scale) {
+    var tr = $('<tr>').append($('<th>').text(name)).appendTo(table);
+    $.each(['min', 'median', 'max'], function(n, k) {
+      tr.append($('<td>').text((summary[k] * scale).toFixed(scale == 1 ? 0 : 3) + ' ' + unit));
+    });
+  };
+  if (result.runs > 0) {
+    row('wall', result.wall, 'ms', 1000);
+    row('user', result.user, 'ms', 1000);
+    row('sys', result.sys, 'ms', 1000);
+    row('peak rss', result.maxrss, 'KiB', 1);
+    $.each(result.counters, function(name, summary) {
+      row(name, summary, '', 1);
+    });
+  }
+  var caption = result.runs + ' runs after ' + result.warmup + ' warmups' +
+                (result.cpu === null ? '' : ', on cpu ' + result.cpu);
+  $('<caption>').text(caption).prependTo(table);
+  return table;
+}
+
+ResultWindow.prototype.compile_trace_link = function(message) {
+  var index = message.indexOf('\n');
+  var name = message.substring(0, index);
+  var blob = new Blob([message.substring(index + 1)], { type: 'application/json' });
+  var div = $('<div class="compile-trace">');
+  $('<a>').attr('href', URL.createObjectURL(blob))
+          .attr('download', name)
+          .text('Download ' + name)
+          .appendTo(div);
+  $('<span>').text(' (open in chrome://tracing)').appendTo(div);
+  return div;
+}
+
+ResultWindow.prototype.post_code = function(compiler, code, stdin, benchmark) {
   var self = this;
 
   var compiler_info = this.to_compiler_info(compiler);
@@ -795,10 +850,11 @@ ResultWindow.prototype.post_code = function(compiler, code, stdin) {
       options: compiler_info.compile_options,
       'compiler-option-raw': compiler_info.compiler_option_raw,
       'runtime-option-raw': compiler_info.runtime_option_raw,
+      benchmark: benchmark ? { runs: 10, warmup: 1, perf: true } : undefined,
   });
 
   var finalize = function() {
-    src.close();
+    self._permlink().empty();
 
     var outputs = self._output_window().find('p').map(function(n,e) {
         return { 'type': $(e).attr('data-type'), 'output': $(e).text() };
@@ -809,11 +865,50 @@ ResultWindow.prototype.post_code = function(compiler, code, stdin) {
       self.onfinish();
   };
 
+  this.stream(src, finalize);
+}
+
+// event ids are "<run id>:<n>"; while the run goes on, anyone may watch it from the link
+ResultWindow.prototype.watch_link = function(event_id) {
+  var run = event_id.substring(0, event_id.indexOf(':'));
+  if (run == '' || this._permlink().find('a').length != 0)
+    return;
+  var url = URL_WATCH + '/' + run;
+  $('<a class="btn btn-default" target="_blank">Watch This Run</a>')
+    .attr('href', url)
+    .appendTo(this._permlink());
+}
+
+ResultWindow.prototype.watch = function(run) {
+  var self = this;
+  var src = new EventSource(URL_JOBS + '/' + run + '/stream');
+  this.stream(src, function() {
+    self._permlink().empty();
+    if (self.onfinish)
+      self.onfinish();
+  });
+}
+
+ResultWindow.prototype.stream = function(src, finalize) {
+  var self = this;
+
   var preview_paragraph = null;
   src.onmessage = function(msg) {
     var output = self._output_window()
 
+    self.watch_link(msg.lastEventId);
+
     var data = parse(msg.data);
+    if (data.type == 'BenchmarkResult') {
+      self.benchmark_table(data.message).appendTo(output);
+      preview_paragraph = null;
+      return;
+    }
+    if (data.type == 'CompileTrace') {
+      self.compile_trace_link(data.message).appendTo(output);
+      preview_paragraph = null;
+      return;
+    }
     var is_message = function(type) {
       return data.type == "CompilerMessageS" ||
              data.type == "CompilerMessageE" ||
@@ -835,11 +930,13 @@ ResultWindow.prototype.post_code = function(compiler, code, stdin) {
     output[0].scrollTop = output[0].scrollHeight;
 
     if (data.type == 'Control' && data.message == 'Finish') {
+        src.close();
         finalize();
     }
   };
 
   src.onerror = function() {
+    src.close();
     finalize();
   }
 }